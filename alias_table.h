@@ -0,0 +1,105 @@
+#ifndef ALIAS_TABLE_H_
+#define ALIAS_TABLE_H_
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include "model_file.h"
+
+// Walker alias table of every word row of a ModelData, so that a topic can be
+// drawn from p(z|w) ~ p(w|z) in O(1). Built once at model load, only for the
+// Metropolis-Hastings sampler, the rows share the offsets of the word->topic
+// table. p(w|z) of an arbitrary topic is ModelData::GetWordTopicProb().
+class WordAliasTable {
+public:
+    WordAliasTable() : _built(false) { }
+
+    void Build(const ModelData& data)
+    {
+        _built = true;
+        uint64_t num_entry = data.GetEntryNum();
+        _alias_prob.resize(num_entry);
+        _alias_index.resize(num_entry);
+        _offset.resize(data.GetVocabNum() + 1);
+        _mass.resize(data.GetVocabNum());
+
+        std::vector<double> scaled;
+        std::vector<int> small, large;
+        uint32_t begin = 0;
+        for (int word_id = 0; word_id < data.GetVocabNum(); ++word_id)
+        {
+            WordTopicRow row = data.GetWordTopicRow(word_id);
+            _offset[word_id] = begin;
+            BuildRow(row, &_alias_prob[begin], &_alias_index[begin], &_mass[word_id],
+                     &scaled, &small, &large);
+            begin += row._size;
+        }
+        _offset[data.GetVocabNum()] = begin;
+    }
+
+    inline bool IsBuilt() const { return _built; }
+
+    // draws slot i of the word row with probability p(w|z_i) / sum_k p(w|k),
+    // rdm in [0, 1)
+    inline int Sample(int word_id, double rdm) const
+    {
+        uint32_t begin = _offset[word_id];
+        int size = _offset[word_id + 1] - begin;
+        double pos = rdm * size;
+        int i = static_cast<int>(pos);
+        if (i >= size)  i = size - 1;
+        if (pos - i >= _alias_prob[begin + i])  i = _alias_index[begin + i];
+        return i;
+    }
+
+    // sum_k p(w|k) of the word
+    inline double GetMass(int word_id) const { return _mass[word_id]; }
+
+private:
+    // Vose's alias method, _alias_prob[i] is the probability to keep slot i
+    static void BuildRow(const WordTopicRow& row, float* alias_prob, int* alias_index, double* mass,
+                         std::vector<double>* scaled, std::vector<int>* small, std::vector<int>* large)
+    {
+        int size = row._size;
+        *mass = 0.0;
+        for (int i = 0; i < size; ++i)
+            *mass += row._prob[i];
+        if (size == 0)  return;
+
+        scaled->resize(size);
+        small->clear();
+        large->clear();
+        for (int i = 0; i < size; ++i)
+        {
+            (*scaled)[i] = row._prob[i] * size / *mass;
+            alias_index[i] = i;
+            if ((*scaled)[i] < 1.0)  small->push_back(i);
+            else  large->push_back(i);
+        }
+        while (!small->empty() && !large->empty())
+        {
+            int s = small->back();  small->pop_back();
+            int l = large->back();
+            alias_prob[s] = (*scaled)[s];
+            alias_index[s] = l;
+            (*scaled)[l] -= 1.0 - (*scaled)[s];
+            if ((*scaled)[l] < 1.0)
+            {
+                large->pop_back();
+                small->push_back(l);
+            }
+        }
+        // leftovers are 1 up to rounding
+        for (size_t i = 0; i < large->size(); ++i)  alias_prob[(*large)[i]] = 1.0f;
+        for (size_t i = 0; i < small->size(); ++i)  alias_prob[(*small)[i]] = 1.0f;
+    }
+
+private:
+    bool _built;
+    std::vector<uint32_t> _offset;
+    std::vector<float> _alias_prob;
+    std::vector<int> _alias_index;
+    std::vector<double> _mass;
+};
+
+#endif
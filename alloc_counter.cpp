@@ -0,0 +1,45 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+
+// heap allocations counter of the benchmark binaries, see NumAllocs() in
+// benchmark.h. link it into a benchmark binary only: it replaces the
+// global operator new and delete of the whole program
+
+uint64_t g_num_allocs = 0;
+
+void* operator new(size_t size)
+{
+    __sync_fetch_and_add(&g_num_allocs, 1);
+    void* ptr = malloc(size > 0 ? size : 1);
+    if (ptr == NULL)  throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr)
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr)
+{
+    free(ptr);
+}
+
+#if __cplusplus >= 201402L
+// the sized forms of C++14
+void operator delete(void* ptr, size_t)
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t)
+{
+    free(ptr);
+}
+#endif
@@ -0,0 +1,240 @@
+#include "model.h"
+#include "benchmark.h"
+
+// latency and throughput of the LdaInfer / LDAQueryExtend paths: model
+// load, Infer with both samplers and the fold-in, ExtendQuery and
+// ExtendQueryTopN, over synthetic queries and, if query_file is given, over
+// a replayed log, and one against several chains on long documents. the
+// quality of the inference methods is measured against a long Gibbs chain.
+// see benchmark.h for the measurement and benchmark.sh
+// for the whole suite
+
+static const size_t kTopN = 20;
+// of the adaptive sweeps, see LdaInfer::SetTolerance()
+static const double kTolerance = 0.01;
+// sweeps of the reference chain of the quality measure, and its queries
+static const int kReferenceIter = 1000;
+static const size_t kQualityQueries = 500;
+// the long documents of the multi-chain runs
+static const size_t kNumLongDocs = 200;
+static const int kLongDocLen = 100;
+static const int kNumChains = 4;
+
+class InferTask : public ParallelTask {
+public:
+    InferTask(LdaInfer* infer, const vector<vector<string> >& queries, InferMethod method = INFER_GIBBS,
+              ThreadPool* chain_pool = NULL)
+    : _infer(infer), _queries(queries), _method(method), _chain_pool(chain_pool) { }
+
+    virtual void Run(int index)
+    {
+        _doc._rng.Seed(index);
+        const vector<string>& query = _queries[index % _queries.size()];
+        if (_chain_pool != NULL)
+            _infer->InferChains(*_infer->GetModel(), query, _chain_pool->Size(), _chain_pool, &_chains, &_doc);
+        else
+            _infer->Infer(*_infer->GetModel(), query, &_doc, _method);
+    }
+
+private:
+    LdaInfer* _infer;
+    const vector<vector<string> >& _queries;
+    InferMethod _method;
+    ThreadPool* _chain_pool;          // one chain per thread, NULL for one chain
+    Document _doc;
+    vector<Document> _chains;
+};
+
+static double Distance(const Document& lhs, const Document& rhs)
+{
+    double distance = 0.0;
+    const vector<int>& topics = lhs._accumulate_topic_dist.Keys();
+    for (size_t i = 0; i < topics.size(); ++i)
+        distance += fabs(lhs._accumulate_topic_dist.Get(topics[i]) - rhs._accumulate_topic_dist.Get(topics[i]));
+    // the topics of rhs only
+    const vector<int>& rhs_topics = rhs._accumulate_topic_dist.Keys();
+    for (size_t i = 0; i < rhs_topics.size(); ++i)
+        if (lhs._accumulate_topic_dist.Get(rhs_topics[i]) == 0)
+            distance += fabs(rhs._accumulate_topic_dist.Get(rhs_topics[i]));
+    return distance;
+}
+
+// error of infer against a kReferenceIter sweeps chain, and spread between
+// two runs with other seeds, over the first kQualityQueries queries
+static void MeasureQuality(LdaInfer* infer, InferMethod method, const string& name, const string& query_set,
+                           const vector<vector<string> >& queries, const vector<Document>& reference,
+                           BenchmarkReport* report, ThreadPool* chain_pool = NULL)
+{
+    QualityResult result = QualityResult();
+    result._name = name;
+    result._query_set = query_set;
+    result._queries = reference.size();
+    ModelPtr model = infer->GetModel();
+    Document doc, other;
+    vector<Document> chains;
+    for (size_t i = 0; i < reference.size(); ++i)
+    {
+        doc._rng.Seed(i);
+        other._rng.Seed(i + reference.size());
+        if (chain_pool != NULL)
+        {
+            infer->InferChains(*model, queries[i], chain_pool->Size(), chain_pool, &chains, &doc);
+            infer->InferChains(*model, queries[i], chain_pool->Size(), chain_pool, &chains, &other);
+        }
+        else
+        {
+            infer->Infer(*model, queries[i], &doc, method);
+            infer->Infer(*model, queries[i], &other, method);
+        }
+        result._error += Distance(reference[i], doc);
+        result._spread += Distance(doc, other);
+        result._sweeps += doc._num_sweeps;
+    }
+    if (result._queries > 0)
+    {
+        result._error /= result._queries;
+        result._spread /= result._queries;
+        result._sweeps /= result._queries;
+    }
+    report->AddQuality(result);
+}
+
+class ExtendTask : public ParallelTask {
+public:
+    ExtendTask(LDAQueryExtend* extender, const vector<vector<string> >& queries, size_t top_n)
+    : _extender(extender), _queries(queries), _top_n(top_n) { }
+
+    virtual void Run(int index)
+    {
+        const vector<string>& query = _queries[index % _queries.size()];
+        if (_top_n > 0)
+            _extender->ExtendQueryTopN(query, _top_n, &_extended_query, &_topic_dist);
+        else
+            _extender->ExtendQuery(query, &_extended_query, &_topic_dist);
+    }
+
+private:
+    LDAQueryExtend* _extender;
+    const vector<vector<string> >& _queries;
+    size_t _top_n;
+    ExtendedQuery _extended_query;
+    vector<TopicCountPair> _topic_dist;
+};
+
+static void RunQuerySet(const string& model_file, double alpha, const string& query_set,
+                        const vector<vector<string> >& queries, size_t num_queries, BenchmarkReport* report)
+{
+    size_t num_warmup = min<size_t>(num_queries / 10 + 1, 1000);
+    LdaInfer linear(model_file, alpha, 0.0, 10, 50, SAMPLER_LINEAR);
+    InferTask linear_task(&linear, queries);
+    report->Run("infer_linear", query_set, &linear_task, num_queries, num_warmup);
+
+    // the same with the adaptive number of sweeps
+    LdaInfer adaptive(model_file, alpha, 0.0, 10, 50, SAMPLER_LINEAR);
+    adaptive.SetTolerance(kTolerance);
+    InferTask adaptive_task(&adaptive, queries);
+    report->Run("infer_linear_adaptive", query_set, &adaptive_task, num_queries, num_warmup);
+
+    LdaInfer alias_mh(model_file, alpha, 0.0, 10, 50, SAMPLER_ALIAS_MH);
+    InferTask alias_mh_task(&alias_mh, queries);
+    report->Run("infer_alias_mh", query_set, &alias_mh_task, num_queries, num_warmup);
+
+    // deterministic, the same for every seed
+    InferTask fold_in_task(&linear, queries, INFER_FOLD_IN);
+    report->Run("infer_fold_in", query_set, &fold_in_task, num_queries, num_warmup);
+
+    LdaInfer reference_infer(model_file, alpha, 0.0, 10, 10 + kReferenceIter);
+    ModelPtr model = reference_infer.GetModel();
+    vector<Document> reference(min(queries.size(), kQualityQueries));
+    for (size_t i = 0; i < reference.size(); ++i)
+        reference_infer.Infer(*model, queries[i], &reference[i]);
+    MeasureQuality(&linear, INFER_GIBBS, "infer_linear", query_set, queries, reference, report);
+    MeasureQuality(&adaptive, INFER_GIBBS, "infer_linear_adaptive", query_set, queries, reference, report);
+    MeasureQuality(&alias_mh, INFER_GIBBS, "infer_alias_mh", query_set, queries, reference, report);
+    MeasureQuality(&linear, INFER_FOLD_IN, "infer_fold_in", query_set, queries, reference, report);
+
+    LDAQueryExtend extender(model_file, alpha, 0.0, 10, 50);
+    ExtendTask extend_task(&extender, queries, 0);
+    report->Run("extend_query", query_set, &extend_task, num_queries, num_warmup);
+    ExtendTask top_n_task(&extender, queries, kTopN);
+    report->Run("extend_query_top_n", query_set, &top_n_task, num_queries, num_warmup);
+}
+
+// one chain against kNumChains chains of 1/kNumChains of the samples each,
+// on long documents. the chains only save wall time with as many cores
+static void RunLongDocuments(const string& model_file, double alpha, const vector<vector<string> >& docs,
+                             BenchmarkReport* report)
+{
+    size_t num_warmup = min<size_t>(docs.size() / 10 + 1, 1000);
+    ThreadPool chain_pool(kNumChains);
+    LdaInfer linear(model_file, alpha, 0.0, 10, 110, SAMPLER_LINEAR);
+    InferTask one_chain_task(&linear, docs);
+    report->Run("infer_linear", "long", &one_chain_task, docs.size(), num_warmup);
+    InferTask chains_task(&linear, docs, INFER_GIBBS, &chain_pool);
+    report->Run("infer_chains", "long", &chains_task, docs.size(), num_warmup);
+
+    LdaInfer reference_infer(model_file, alpha, 0.0, 10, 10 + kReferenceIter);
+    ModelPtr model = reference_infer.GetModel();
+    vector<Document> reference(min(docs.size(), kQualityQueries));
+    for (size_t i = 0; i < reference.size(); ++i)
+        reference_infer.Infer(*model, docs[i], &reference[i]);
+    MeasureQuality(&linear, INFER_GIBBS, "infer_linear", "long", docs, reference, report);
+    MeasureQuality(&linear, INFER_GIBBS, "infer_chains", "long", docs, reference, report, &chain_pool);
+}
+
+int main(int argc, char *argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr = 1;
+
+    if (argc < 3)
+    {
+        cout<<"Usage: "<<argv[0]<<" model_file alpha [query_file|-] [json_file|-] [num_queries]"<<endl;
+        return 0;
+    }
+
+    string model_file = argv[1];
+    double alpha = boost::lexical_cast<double>(argv[2]);
+    string query_file = argc > 3 ? argv[3] : "-";
+    string json_file = argc > 4 ? argv[4] : "-";
+    size_t num_queries = argc > 5 ? boost::lexical_cast<size_t>(argv[5]) : 10000;
+
+    BenchmarkReport report;
+    uint64_t start = NowNs();
+    Model model;
+    if (!model.Load(model_file))
+    {
+        LOG(ERROR)<<"Load Model failed: "<<model_file;
+        return 1;
+    }
+    report.AddTime("model_load", (NowNs() - start) * 1e-9);
+
+    vector<vector<int> > rows;
+    MakeSyntheticQueries(model.GetModelData(), num_queries, 8, 1, &rows);
+    vector<vector<string> > synthetic(rows.size());
+    for (size_t i = 0; i < rows.size(); ++i)
+        for (size_t j = 0; j < rows[i].size(); ++j)
+            synthetic[i].push_back(model.GetModelData().GetWord(rows[i][j]));
+    RunQuerySet(model_file, alpha, "synthetic", synthetic, num_queries, &report);
+
+    MakeSyntheticQueries(model.GetModelData(), kNumLongDocs, kLongDocLen, 2, &rows);
+    vector<vector<string> > long_docs(rows.size());
+    for (size_t i = 0; i < rows.size(); ++i)
+        for (size_t j = 0; j < rows[i].size(); ++j)
+            long_docs[i].push_back(model.GetModelData().GetWord(rows[i][j]));
+    RunLongDocuments(model_file, alpha, long_docs, &report);
+
+    if (query_file != "-")
+    {
+        vector<vector<string> > replay;
+        if (!ReadQueries(query_file, &replay) || replay.empty())
+        {
+            LOG(ERROR)<<"read queries failed: "<<query_file;
+            return 1;
+        }
+        RunQuerySet(model_file, alpha, "replay", replay, replay.size(), &report);
+    }
+
+    report.Print(cerr);
+    return report.WriteJson(json_file) ? 0 : 1;
+}
@@ -0,0 +1,269 @@
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "model_file.h"
+#include "monotonic_clock.h"
+#include "random.h"
+#include "thread_pool.h"
+
+// latency and throughput measurement of the inference paths, shared by the
+// benchmark binaries. every query is timed on its own with the monotonic
+// clock, less the cost of reading the clock, and the heap allocations are
+// counted if the binary is linked with alloc_counter.cpp. the results go to
+// a JSON report, one object per benchmark, to be compared across commits.
+
+// defined by alloc_counter.cpp, a weak reference so that the binaries
+// without it still link
+extern uint64_t g_num_allocs __attribute__((weak));
+
+// false unless the binary is linked with alloc_counter.cpp
+inline bool CountsAllocs()
+{
+    return &g_num_allocs != NULL;
+}
+
+inline uint64_t NumAllocs()
+{
+    return CountsAllocs() ? __sync_fetch_and_add(&g_num_allocs, 0) : 0;
+}
+
+// the cost of one NowNs(), taken off every measured latency
+inline uint64_t ClockOverheadNs()
+{
+    uint64_t best = ~static_cast<uint64_t>(0);
+    for (int i = 0; i < 1000; ++i)
+    {
+        uint64_t start = NowNs();
+        uint64_t end = NowNs();
+        best = std::min(best, end - start);
+    }
+    return best;
+}
+
+struct BenchmarkResult
+{
+    std::string _name;
+    std::string _query_set;
+    size_t _queries;
+    double _seconds;                  // wall time of the whole run
+    double _mean_us;
+    double _p50_us;
+    double _p99_us;
+    double _p999_us;
+    double _max_us;
+    double _qps;
+    double _allocs_per_query;         // -1 if the allocations are not counted
+};
+
+// agreement of an inference method with a long reference chain, averaged
+// over the queries of a set
+struct QualityResult
+{
+    std::string _name;
+    std::string _query_set;
+    size_t _queries;
+    double _error;                    // L1 distance of theta to the reference
+    double _spread;                   // L1 distance of theta between two runs of other seeds
+    double _sweeps;                   // sweeps or fold-in passes per query
+};
+
+class BenchmarkReport {
+public:
+    BenchmarkReport() : _clock_overhead(ClockOverheadNs()) { }
+
+    // a one-off duration such as the model load
+    void AddTime(const std::string& name, double seconds)
+    {
+        BenchmarkResult result = BenchmarkResult();
+        result._name = name;
+        result._queries = 1;
+        result._seconds = seconds;
+        result._mean_us = result._p50_us = result._p99_us = result._p999_us = result._max_us = seconds * 1e6;
+        result._qps = seconds > 0 ? 1.0 / seconds : 0.0;
+        _results.push_back(result);
+    }
+
+    // task->Run(i) for i in [0, num_queries), each call is one query. the
+    // first num_warmup calls warm up the caches and workspaces and are not
+    // measured
+    const BenchmarkResult& Run(const std::string& name, const std::string& query_set,
+                               ParallelTask* task, size_t num_queries, size_t num_warmup)
+    {
+        for (size_t i = 0; i < num_warmup; ++i)
+            task->Run(i % std::max<size_t>(num_queries, 1));
+
+        std::vector<uint64_t> latency(num_queries);
+        uint64_t allocs = NumAllocs();
+        uint64_t start = NowNs();
+        for (size_t i = 0; i < num_queries; ++i)
+        {
+            uint64_t query_start = NowNs();
+            task->Run(i);
+            uint64_t query_ns = NowNs() - query_start;
+            latency[i] = query_ns > _clock_overhead ? query_ns - _clock_overhead : 0;
+        }
+        double seconds = (NowNs() - start) * 1e-9;
+        allocs = NumAllocs() - allocs;
+
+        BenchmarkResult result = BenchmarkResult();
+        result._name = name;
+        result._query_set = query_set;
+        result._queries = num_queries;
+        result._seconds = seconds;
+        if (num_queries > 0)
+        {
+            double sum = 0.0;
+            for (size_t i = 0; i < num_queries; ++i)
+                sum += latency[i];
+            std::sort(latency.begin(), latency.end());
+            result._mean_us = sum / num_queries * 1e-3;
+            result._p50_us = Percentile(latency, 0.5);
+            result._p99_us = Percentile(latency, 0.99);
+            result._p999_us = Percentile(latency, 0.999);
+            result._max_us = latency.back() * 1e-3;
+            result._qps = seconds > 0 ? num_queries / seconds : 0.0;
+            result._allocs_per_query = CountsAllocs() ? 1.0 * allocs / num_queries : -1.0;
+        }
+        _results.push_back(result);
+        return _results.back();
+    }
+
+    void AddQuality(const QualityResult& result)
+    {
+        _quality.push_back(result);
+    }
+
+    // one line per benchmark, for the terminal
+    void Print(std::ostream& out) const
+    {
+        char line[256];
+        for (size_t i = 0; i < _results.size(); ++i)
+        {
+            const BenchmarkResult& r = _results[i];
+            snprintf(line, sizeof(line), "%-24s %-10s n=%-7zu p50=%.1fus p99=%.1fus p999=%.1fus qps=%.0f allocs/q=%.2f",
+                     r._name.c_str(), r._query_set.c_str(), r._queries, r._p50_us, r._p99_us, r._p999_us,
+                     r._qps, r._allocs_per_query);
+            out<<line<<std::endl;
+        }
+        for (size_t i = 0; i < _quality.size(); ++i)
+        {
+            const QualityResult& q = _quality[i];
+            snprintf(line, sizeof(line), "%-24s %-10s n=%-7zu error=%.4f spread=%.4f sweeps=%.1f",
+                     q._name.c_str(), q._query_set.c_str(), q._queries, q._error, q._spread, q._sweeps);
+            out<<line<<std::endl;
+        }
+    }
+
+    void WriteJson(std::ostream& out) const
+    {
+        char value[512];
+        snprintf(value, sizeof(value), "{\n  \"clock\": \"CLOCK_MONOTONIC\",\n  \"clock_overhead_ns\": %lu,\n",
+                 static_cast<unsigned long>(_clock_overhead));
+        out<<value<<"  \"benchmarks\": [";
+        for (size_t i = 0; i < _results.size(); ++i)
+        {
+            const BenchmarkResult& r = _results[i];
+            snprintf(value, sizeof(value),
+                     "%s\n    {\"name\": \"%s\", \"query_set\": \"%s\", \"queries\": %zu, \"seconds\": %.6f, "
+                     "\"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f, "
+                     "\"qps\": %.1f, \"allocs_per_query\": %.3f}",
+                     i > 0 ? "," : "", r._name.c_str(), r._query_set.c_str(), r._queries, r._seconds,
+                     r._mean_us, r._p50_us, r._p99_us, r._p999_us, r._max_us, r._qps, r._allocs_per_query);
+            out<<value;
+        }
+        out<<"\n  ],\n  \"quality\": [";
+        for (size_t i = 0; i < _quality.size(); ++i)
+        {
+            const QualityResult& q = _quality[i];
+            snprintf(value, sizeof(value),
+                     "%s\n    {\"name\": \"%s\", \"query_set\": \"%s\", \"queries\": %zu, "
+                     "\"error\": %.6f, \"spread\": %.6f, \"sweeps\": %.2f}",
+                     i > 0 ? "," : "", q._name.c_str(), q._query_set.c_str(), q._queries,
+                     q._error, q._spread, q._sweeps);
+            out<<value;
+        }
+        out<<"\n  ]\n}"<<std::endl;
+    }
+
+    // to json_file, or to stdout if it is empty or -
+    bool WriteJson(const std::string& json_file) const
+    {
+        if (json_file.empty() || json_file == "-")
+        {
+            WriteJson(std::cout);
+            return true;
+        }
+        std::ofstream ofs(json_file.c_str());
+        WriteJson(ofs);
+        return ofs.good();
+    }
+
+private:
+    static double Percentile(const std::vector<uint64_t>& sorted, double q)
+    {
+        size_t index = std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()));
+        return sorted[index] * 1e-3;
+    }
+
+private:
+    uint64_t _clock_overhead;
+    std::vector<BenchmarkResult> _results;
+    std::vector<QualityResult> _quality;
+};
+
+// num_queries random queries of 1 to max_len words as rows of model_data.
+// the words are drawn from the heads of random topics, so the queries are
+// made of frequent words as the real ones. a fixed seed gives the same
+// queries on every run
+inline void MakeSyntheticQueries(const ModelData& model_data, size_t num_queries, int max_len,
+                                 uint64_t seed, std::vector<std::vector<int> >* queries)
+{
+    Random rng(seed);
+    queries->resize(num_queries);
+    for (size_t i = 0; i < num_queries; ++i)
+    {
+        std::vector<int>& query = (*queries)[i];
+        query.clear();
+        int len = 1 + rng.UniformInt(max_len);
+        while (static_cast<int>(query.size()) < len)
+        {
+            const int* word;
+            ProbArray prob;
+            int size = model_data.GetTopicWords(rng.UniformInt(model_data.GetTopicNum()), &word, &prob);
+            if (size == 0)  continue;
+            query.push_back(word[rng.UniformInt(std::min(size, 50))]);
+        }
+    }
+}
+
+// the lines of query_file split at spaces
+inline bool ReadQueries(const std::string& query_file, std::vector<std::vector<std::string> >* queries)
+{
+    std::ifstream ifs(query_file.c_str());
+    if (!ifs)  return false;
+    std::string line;
+    while (std::getline(ifs, line))
+    {
+        queries->push_back(std::vector<std::string>());
+        std::vector<std::string>& tokens = queries->back();
+        size_t begin = 0;
+        while (begin < line.size())
+        {
+            size_t end = line.find(' ', begin);
+            if (end == std::string::npos)  end = line.size();
+            if (end > begin)  tokens.push_back(line.substr(begin, end - begin));
+            begin = end + 1;
+        }
+    }
+    return true;
+}
+
+#endif
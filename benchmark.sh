@@ -0,0 +1,52 @@
+#!/bin/sh
+# latency and throughput suite over model.dat, run build.sh first:
+#   ./benchmark.sh [query_file] [json_file]
+# query_file holds tokenized queries, words of model.dat separated by
+# spaces, replayed next to the synthetic queries. the predictors take
+# wordid models, so model.dat and the queries are renumbered for them.
+# json_file (benchmark.json by default) collects all the results, keep it
+# to compare against the next commits. the predictors run as their _bench
+# builds, which count the heap allocations.
+set -e
+QUERY_FILE=${1:--}
+JSON_FILE=${2:-benchmark.json}
+ALPHA=0.1
+BETA=0.01
+TMP=$(mktemp -d)
+trap 'rm -rf $TMP' EXIT
+
+# every word of model.dat gets the number of its first occurrence
+awk -F'\t' -v OFS='\t' -v vocab=$TMP/vocab '{
+    for (i = 2; i <= NF; ++i) {
+        word = $i; count = $i
+        sub(/:[^:]*$/, "", word); sub(/.*:/, "", count)
+        if (!(word in id)) { id[word] = n++; print word, id[word] > vocab }
+        $i = id[word] ":" count
+    }
+    print
+}' model.dat > $TMP/model_id.dat
+QUERY_ID_FILE=-
+if [ "$QUERY_FILE" != "-" ]; then
+    awk -F'\t' 'NR == FNR { id[$1] = $2; next }
+    {
+        line = ""
+        for (i = 1; i <= NF; ++i) if ($i in id) line = line (line == "" ? "" : " ") id[$i]
+        if (line != "") print line
+    }' $TMP/vocab FS=' ' "$QUERY_FILE" > $TMP/query_id.txt
+    QUERY_ID_FILE=$TMP/query_id.txt
+fi
+
+./benchmark model.dat $ALPHA "$QUERY_FILE" $TMP/lda.json
+./rt_lda_predictor_bench $ALPHA 1 $TMP/model_id.dat --bench $QUERY_ID_FILE $TMP/rt_lda.json
+./sparse_lda_predictor_bench $ALPHA 1 $TMP/model_id.dat --bench $BETA $QUERY_ID_FILE $TMP/sparse_lda.json
+
+{
+    printf '{\n"commit": "%s",\n"lda": ' "$(git rev-parse --short HEAD 2>/dev/null)"
+    cat $TMP/lda.json
+    printf ',\n"rt_lda": '
+    cat $TMP/rt_lda.json
+    printf ',\n"sparse_lda": '
+    cat $TMP/sparse_lda.json
+    printf '}\n'
+} > "$JSON_FILE"
+echo "results in $JSON_FILE"
@@ -0,0 +1,76 @@
+#ifndef BLOCKING_QUEUE_H_
+#define BLOCKING_QUEUE_H_
+
+#include <pthread.h>
+#include <deque>
+
+// bounded FIFO between the threads of a pipeline: Push() waits while the
+// queue is full, Pop() while it is empty. after Close() the remaining items
+// are still popped, then Pop() returns false
+template<typename T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity) : _capacity(capacity), _closed(false)
+    {
+        pthread_mutex_init(&_mutex, NULL);
+        pthread_cond_init(&_not_empty, NULL);
+        pthread_cond_init(&_not_full, NULL);
+    }
+
+    ~BlockingQueue()
+    {
+        pthread_cond_destroy(&_not_full);
+        pthread_cond_destroy(&_not_empty);
+        pthread_mutex_destroy(&_mutex);
+    }
+
+    void Push(const T& item)
+    {
+        pthread_mutex_lock(&_mutex);
+        while (_items.size() >= _capacity)
+            pthread_cond_wait(&_not_full, &_mutex);
+        _items.push_back(item);
+        pthread_cond_signal(&_not_empty);
+        pthread_mutex_unlock(&_mutex);
+    }
+
+    bool Pop(T* item)
+    {
+        pthread_mutex_lock(&_mutex);
+        while (_items.empty() && !_closed)
+            pthread_cond_wait(&_not_empty, &_mutex);
+        bool ok = !_items.empty();
+        if (ok)
+        {
+            *item = _items.front();
+            _items.pop_front();
+            pthread_cond_signal(&_not_full);
+        }
+        pthread_mutex_unlock(&_mutex);
+        return ok;
+    }
+
+    // no more Push(), wakes up the waiting Pop()s
+    void Close()
+    {
+        pthread_mutex_lock(&_mutex);
+        _closed = true;
+        pthread_cond_broadcast(&_not_empty);
+        pthread_mutex_unlock(&_mutex);
+    }
+
+private:
+    // disallow copy and assignment
+    BlockingQueue(const BlockingQueue&);
+    BlockingQueue& operator = (const BlockingQueue&);
+
+private:
+    pthread_mutex_t _mutex;
+    pthread_cond_t _not_empty;
+    pthread_cond_t _not_full;
+    size_t _capacity;
+    bool _closed;
+    std::deque<T> _items;
+};
+
+#endif
@@ -1,4 +1,27 @@
 
 
 g++ -c model.cpp -o model.o
-g++ -o model model.o /usr/local/lib/libglog.so
+g++ -o model model.o /usr/local/lib/libglog.so -lpthread -lrt
+g++ -o convert_model convert_model.cpp
+g++ -c model2.cpp -o model2.o
+g++ -o model2 model2.o /usr/local/lib/libglog.so -lpthread -lrt
+g++ -c lda_server.cpp -o lda_server.o
+g++ -o lda_server lda_server.o /usr/local/lib/libglog.so -lpthread -lrt
+g++ -c compare_model.cpp -o compare_model.o
+g++ -o compare_model compare_model.o /usr/local/lib/libglog.so -lpthread -lrt
+g++ -O2 -c alloc_counter.cpp -o alloc_counter.o
+g++ -O2 -c benchmark.cpp -o benchmark.o
+g++ -o benchmark benchmark.o alloc_counter.o /usr/local/lib/libglog.so -lpthread -lrt
+g++ -O2 -c rt_lda_predictor.cpp -o rt_lda_predictor.o
+g++ -o rt_lda_predictor rt_lda_predictor.o -lpthread -lrt
+g++ -o rt_lda_predictor_bench rt_lda_predictor.o alloc_counter.o -lpthread -lrt
+g++ -O2 -c sparse_lda_predictor.cpp -o sparse_lda_predictor.o
+g++ -o sparse_lda_predictor sparse_lda_predictor.o -lpthread -lrt
+g++ -o sparse_lda_predictor_bench sparse_lda_predictor.o alloc_counter.o -lpthread -lrt
+g++ -O2 -c related_queries.cpp -o related_queries.o
+g++ -o related_queries related_queries.o /usr/local/lib/libglog.so -lpthread -lrt
+g++ -o split_model split_model.cpp
+g++ -O2 -c lda_shard.cpp -o lda_shard.o
+g++ -o lda_shard lda_shard.o /usr/local/lib/libglog.so -lpthread -lrt
+g++ -O2 -c sharded_infer.cpp -o sharded_infer.o
+g++ -o sharded_infer sharded_infer.o /usr/local/lib/libglog.so -lpthread -lrt
@@ -0,0 +1,140 @@
+#include "model.h"
+
+// accuracy of a compact model (convert_model ... 16|8) against the float
+// model it was made from, over a file of tokenized queries:
+//   expansion: both models extend the same inferred topic distribution,
+//              the overlap of the top_n words and the relative error of
+//              the weights show the effect of the quantized p(w|z) alone
+//   inference: L1 distance of the topic distributions inferred with the
+//              same seed by both models, next to the distance between two
+//              seeds of the float model, i.e. the sampling noise
+
+// L1 distance of two topic distributions
+static double TopicDistance(const Document& lhs, const Document& rhs)
+{
+    double distance = 0.0;
+    const vector<int>& lhs_topics = lhs._accumulate_topic_dist.Keys();
+    for (size_t i = 0; i < lhs_topics.size(); ++i)
+    {
+        int topic_id = lhs_topics[i];
+        distance += fabs(lhs._accumulate_topic_dist.Get(topic_id) - rhs._accumulate_topic_dist.Get(topic_id));
+    }
+    const vector<int>& rhs_topics = rhs._accumulate_topic_dist.Keys();
+    for (size_t i = 0; i < rhs_topics.size(); ++i)
+    {
+        int topic_id = rhs_topics[i];
+        if (lhs._accumulate_topic_dist.Get(topic_id) == 0)
+            distance += rhs._accumulate_topic_dist.Get(topic_id);
+    }
+    return distance;
+}
+
+struct WeightGreater
+{
+    bool operator()(const WordIdWeight& lhs, const WordIdWeight& rhs) const
+    {
+        return lhs.second > rhs.second;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr = 1;
+
+    if (argc < 5)
+    {
+        cout<<"Usage: "<<argv[0]<<" model_file compact_model_file alpha query_file [top_n]"<<endl;
+        return 0;
+    }
+
+    string model_file = argv[1];
+    string compact_file = argv[2];
+    double alpha = boost::lexical_cast<double>(argv[3]);
+    string query_file = argv[4];
+    size_t top_n = argc > 5 ? boost::lexical_cast<size_t>(argv[5]) : 20;
+
+    LDAQueryExtend extender(model_file, alpha, 0.0, 10, 50);
+    LdaInfer infer(model_file, alpha, 0.0, 10, 50);
+    LdaInfer compact_infer(compact_file, alpha, 0.0, 10, 50);
+    ModelPtr model = infer.GetModel();
+    ModelPtr compact_model = compact_infer.GetModel();
+    if (model->GetVocalNum() != compact_model->GetVocalNum())
+    {
+        cerr<<"the models have different vocabularies"<<endl;
+        return 1;
+    }
+
+    ifstream ifs(query_file.c_str());
+    string line;
+    vector<string> tokens;
+    Document doc, compact_doc, noise_doc;
+    ExtendWorkspace ws;
+    ExtendedQuery extended, compact_extended;
+    vector<double> compact_weight(model->GetVocalNum(), 0.0);
+    size_t num_query = 0, num_top = 0, num_overlap = 0;
+    double sum_error = 0.0, max_error = 0.0;
+    size_t num_weight = 0;
+    double sum_distance = 0.0, sum_noise = 0.0;
+    while (getline(ifs, line))
+    {
+        tokens.clear();
+        boost::split(tokens, line, boost::is_any_of(" "));
+        uint64_t seed = num_query + 1;
+        infer.Infer(tokens, &doc, seed);
+        compact_infer.Infer(tokens, &compact_doc, seed);
+        infer.Infer(tokens, &noise_doc, seed + 1000003);
+        sum_distance += TopicDistance(doc, compact_doc);
+        sum_noise += TopicDistance(doc, noise_doc);
+
+        extender.build_extended_query(model, doc, &ws, &extended);
+        extender.build_extended_query(compact_model, doc, &ws, &compact_extended);
+        for (size_t i = 0; i < compact_extended._words.size(); ++i)
+            if (compact_extended._words[i].first >= 0)
+                compact_weight[compact_extended._words[i].first] = compact_extended._words[i].second;
+        for (size_t i = 0; i < extended._words.size(); ++i)
+        {
+            int word_id = extended._words[i].first;
+            if (word_id < 0)  continue;
+            double error = fabs(compact_weight[word_id] - extended._words[i].second) / extended._words[i].second;
+            sum_error += error;
+            max_error = max(max_error, error);
+            ++num_weight;
+        }
+        for (size_t i = 0; i < compact_extended._words.size(); ++i)
+            if (compact_extended._words[i].first >= 0)
+                compact_weight[compact_extended._words[i].first] = 0.0;
+
+        // overlap of the top_n words
+        size_t top = min(top_n, min(extended._words.size(), compact_extended._words.size()));
+        partial_sort(extended._words.begin(), extended._words.begin() + top, extended._words.end(),
+                     WeightGreater());
+        partial_sort(compact_extended._words.begin(), compact_extended._words.begin() + top,
+                     compact_extended._words.end(), WeightGreater());
+        for (size_t i = 0; i < top; ++i)
+        {
+            for (size_t j = 0; j < top; ++j)
+            {
+                if (extended._words[i].first == compact_extended._words[j].first)
+                {
+                    ++num_overlap;
+                    break;
+                }
+            }
+        }
+        num_top += top;
+        ++num_query;
+    }
+    if (num_query == 0)  return 0;
+
+    cout<<"model bytes: "<<model->GetModelData().GetByteSize()
+        <<" compact bytes: "<<compact_model->GetModelData().GetByteSize()
+        <<" prob_bits: "<<compact_model->GetModelData().GetProbBits()<<endl;
+    cout<<"queries: "<<num_query<<endl;
+    cout<<"expansion top "<<top_n<<" overlap: "<<(num_top > 0 ? 1.0 * num_overlap / num_top : 1.0)<<endl;
+    cout<<"expansion weight relative error: mean "<<(num_weight > 0 ? sum_error / num_weight : 0.0)
+        <<" max "<<max_error<<endl;
+    cout<<"inference L1 distance: compact "<<sum_distance / num_query
+        <<" sampling noise "<<sum_noise / num_query<<endl;
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <iostream>
+#include <stdlib.h>
+#include "model_file.h"
+using namespace std;
+
+// convert the text model (topic_id \t word:count ...) to the binary model
+// format which Model / LdaModel / LDAQueryExtend mmap at startup. with
+// prob_bits 16 or 8 the model is written in the compact form, see
+// ModelData::Compact(); the input may also be a binary model then
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cout<<"Usage: "<<argv[0]<<" model_file binary_model_file [prob_bits]"<<endl;
+        return 0;
+    }
+
+    string text_file = argv[1];
+    string binary_file = argv[2];
+    int prob_bits = argc > 3 ? atoi(argv[3]) : 32;
+
+    ModelData model_data;
+    bool ok = ModelData::IsBinaryFile(text_file) ? model_data.Map(text_file)
+                                                 : model_data.LoadText(text_file);
+    if (!ok)
+    {
+        cerr<<"load model failed: "<<text_file<<endl;
+        return 1;
+    }
+    if (prob_bits != model_data.GetProbBits() && !model_data.Compact(prob_bits))
+    {
+        cerr<<"can not write a "<<prob_bits<<" bit model from "<<text_file<<endl;
+        return 1;
+    }
+    if (!model_data.Save(binary_file))
+    {
+        cerr<<"write binary model failed: "<<binary_file<<endl;
+        return 1;
+    }
+
+    ModelData mapped;
+    if (!mapped.Map(binary_file))
+    {
+        cerr<<"verify binary model failed: "<<binary_file<<endl;
+        return 1;
+    }
+    cout<<"num_topic="<<mapped.GetTopicNum()
+        <<" num_vocab="<<mapped.GetVocabNum()
+        <<" num_entry="<<mapped.GetEntryNum()
+        <<" prob_bits="<<mapped.GetProbBits()
+        <<" bytes="<<mapped.GetByteSize()<<endl;
+    return 0;
+}
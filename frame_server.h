@@ -0,0 +1,280 @@
+#ifndef FRAME_SERVER_H_
+#define FRAME_SERVER_H_
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <glog/logging.h>
+
+// the socket side of the daemons (lda_server, lda_shard) and of their
+// clients: every frame is a 4 byte big-endian length plus the payload, an
+// address is a unix socket path if it contains '/', a local tcp port
+// otherwise. a client may send any number of requests without waiting, the
+// responses of one connection come back in request order.
+
+inline void AppendFrame(const std::string& payload, std::string* out)
+{
+    uint32_t len = htonl(payload.size());
+    out->append(reinterpret_cast<const char*>(&len), sizeof(len));
+    out->append(payload);
+}
+
+// MSG_NOSIGNAL: a peer gone away fails the write, not the process
+inline bool SendAll(int fd, const char* data, size_t size)
+{
+    size_t pos = 0;
+    while (pos < size)
+    {
+        ssize_t n = send(fd, data + pos, size - pos, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)  continue;
+        if (n <= 0)  return false;
+        pos += n;
+    }
+    return true;
+}
+
+// payload as one frame, in a single write
+inline bool WriteFrame(int fd, const std::string& payload, std::string* buf)
+{
+    buf->clear();
+    AppendFrame(payload, buf);
+    return SendAll(fd, buf->data(), buf->size());
+}
+
+inline bool RecvAll(int fd, char* data, size_t size)
+{
+    size_t pos = 0;
+    while (pos < size)
+    {
+        ssize_t n = read(fd, data + pos, size - pos);
+        if (n < 0 && errno == EINTR)  continue;
+        if (n <= 0)  return false;
+        pos += n;
+    }
+    return true;
+}
+
+// blocks until a whole frame of at most max_size bytes is read into payload
+inline bool ReadFrame(int fd, size_t max_size, std::string* payload)
+{
+    uint32_t len;
+    if (!RecvAll(fd, reinterpret_cast<char*>(&len), sizeof(len)))  return false;
+    len = ntohl(len);
+    if (len > max_size)  return false;
+    payload->resize(len);
+    return len == 0 || RecvAll(fd, &(*payload)[0], len);
+}
+
+// a socket of the family of address, bound to it if bind, else connected
+inline int OpenSocket(const std::string& address, bool bind)
+{
+    int fd;
+    int ok;
+    if (address.find('/') != std::string::npos)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(addr.sun_path))  return -1;
+        strcpy(addr.sun_path, address.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)  return -1;
+        if (bind)  unlink(address.c_str());
+        ok = bind ? ::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))
+                  : connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    }
+    else
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(atoi(address.c_str()));
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)  return -1;
+        int on = 1;
+        if (bind)  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        ok = bind ? ::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))
+                  : connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    }
+    if (ok != 0)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+inline int ListenOn(const std::string& address)
+{
+    int fd = OpenSocket(address, true);
+    if (fd >= 0 && listen(fd, 128) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline int ConnectTo(const std::string& address)
+{
+    return OpenSocket(address, false);
+}
+
+// the requests of a FrameServer, HandleFrame() is called concurrently from
+// its worker threads
+class FrameHandler {
+public:
+    virtual ~FrameHandler() { }
+    // the response payload of one request payload, false closes the
+    // connection
+    virtual bool HandleFrame(const char* request, size_t size, std::string* response) = 0;
+};
+
+// serves the connections of a listening socket from a fixed set of worker
+// threads, however many clients there are: the connections are in one
+// epoll set, each armed for one event at a time, so a connection is served
+// by one worker at a time and its responses stay in order. every read takes
+// whatever the client has pipelined so far, all complete requests are
+// answered with a single write
+class FrameServer {
+public:
+    FrameServer(FrameHandler* handler, size_t max_frame_size)
+    : _handler(handler), _max_frame_size(max_frame_size), _epoll_fd(-1) { }
+
+    // accepts on listen_fd forever, false if the workers can not be started
+    bool Serve(int listen_fd, int num_threads)
+    {
+        _epoll_fd = epoll_create(1024);
+        if (_epoll_fd < 0)
+        {
+            LOG(ERROR)<<"epoll_create failed: "<<strerror(errno);
+            return false;
+        }
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        for (int i = 0; i < std::max(num_threads, 1); ++i)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, &attr, &FrameServer::WorkerMain, this) != 0)
+            {
+                LOG(ERROR)<<"pthread_create failed";
+                return false;
+            }
+        }
+        while (true)
+        {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd < 0)
+            {
+                if (errno != EINTR)  LOG(WARNING)<<"accept failed: "<<strerror(errno);
+                continue;
+            }
+            Connection* conn = new Connection();
+            conn->_fd = fd;
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLONESHOT;
+            event.data.ptr = conn;
+            if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+            {
+                LOG(WARNING)<<"epoll_ctl failed: "<<strerror(errno);
+                close(fd);
+                delete conn;
+            }
+        }
+        return true;
+    }
+
+private:
+    struct Connection
+    {
+        int _fd;
+        std::string _in;              // the start of a request not read in full yet
+    };
+
+    static void* WorkerMain(void* arg)
+    {
+        static_cast<FrameServer*>(arg)->Work();
+        return NULL;
+    }
+
+    void Work()
+    {
+        std::string out, response;
+        while (true)
+        {
+            struct epoll_event event;
+            if (epoll_wait(_epoll_fd, &event, 1, -1) != 1)  continue;
+            Connection* conn = static_cast<Connection*>(event.data.ptr);
+            if (!ServeRequests(conn, &out, &response))
+            {
+                // close() also takes it out of the epoll set
+                close(conn->_fd);
+                delete conn;
+                continue;
+            }
+            event.events = EPOLLIN | EPOLLONESHOT;
+            epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn->_fd, &event);
+        }
+    }
+
+    // false once the connection is to be closed
+    bool ServeRequests(Connection* conn, std::string* out, std::string* response)
+    {
+        char buf[64 * 1024];
+        ssize_t n = read(conn->_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)  return true;
+        if (n <= 0)  return false;
+        std::string& in = conn->_in;
+        in.append(buf, n);
+
+        size_t pos = 0;
+        out->clear();
+        while (in.size() - pos >= sizeof(uint32_t))
+        {
+            uint32_t len;
+            memcpy(&len, in.data() + pos, sizeof(len));
+            len = ntohl(len);
+            if (len > _max_frame_size)
+            {
+                LOG(WARNING)<<"frame too large: "<<len<<", closing connection";
+                return false;
+            }
+            if (in.size() - pos - sizeof(uint32_t) < len)  break;
+            response->clear();
+            if (!_handler->HandleFrame(in.data() + pos + sizeof(uint32_t), len, response))
+            {
+                LOG(WARNING)<<"malformed request, closing connection";
+                return false;
+            }
+            AppendFrame(*response, out);
+            pos += sizeof(uint32_t) + len;
+        }
+        in.erase(0, pos);
+        return out->empty() || SendAll(conn->_fd, out->data(), out->size());
+    }
+
+    // disallow copy and assignment
+    FrameServer(const FrameServer&);
+    FrameServer& operator = (const FrameServer&);
+
+private:
+    FrameHandler* _handler;
+    size_t _max_frame_size;
+    int _epoll_fd;
+};
+
+#endif
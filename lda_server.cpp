@@ -0,0 +1,166 @@
+#include "model.h"
+#include "frame_server.h"
+#include <signal.h>
+
+// Long lived query extension daemon: the model is loaded once, the queries
+// come over a unix domain socket or a local tcp port.
+//
+// protocol, every frame is a 4 byte big-endian length plus the payload
+//   request:  tokenized query, tokens separated by spaces
+//   response: word:weight word:weight ...\n      top extended query words
+//             topic:prob topic:prob ...\n        topic distribution
+// a client may send any number of requests without waiting, the responses
+// of one connection come back in request order. the connections are served
+// by num_threads worker threads, however many clients there are, see
+// frame_server.h.
+//
+// SIGHUP reloads model_file in the background (after the daily retraining
+// replaced it), the requests in flight finish on the previous model. a
+// binary model is mmap'ed, so replace the file with rename(), never rewrite
+// it in place.
+//
+// with cache_size > 0 the repeated queries are answered from a cache of
+// their topic distribution and extension, kept for cache_ttl seconds (0:
+// until evicted) and emptied by a reload. SIGUSR1 logs its hit rate.
+//
+// the queries of up to fold_in_tokens tokens are inferred with the
+// deterministic fold-in in place of the Gibbs sampler, see
+// LdaInfer::SetFoldIn(), 0 samples them all.
+
+static const uint32_t kMaxFrameSize = 1 << 20;
+
+struct ServerConfig
+{
+    LDAQueryExtend* _extender;
+    string _model_file;
+    size_t _max_words;
+};
+
+class QueryHandler : public FrameHandler {
+public:
+    explicit QueryHandler(const ServerConfig& config) : _config(config) { }
+
+    virtual bool HandleFrame(const char* request, size_t size, string* response)
+    {
+        ExtendedQuery& extended_query = *_extended_query.Get();
+        vector<string> tokens;
+        string query(request, size);
+        boost::split(tokens, query, boost::is_any_of(" "), boost::token_compress_on);
+        vector<TopicCountPair> topic_dist;
+        _config._extender->ExtendQueryTopN(tokens, _config._max_words, &extended_query, &topic_dist);
+
+        // the words are written straight from the model vocabulary
+        ostringstream oss;
+        const vector<WordIdWeight>& words = extended_query._words;
+        for (size_t i = 0; i < words.size(); ++i)
+        {
+            size_t len;
+            const char* word = _config._extender->GetWord(extended_query, words[i].first, &len);
+            if (i > 0)  oss<<" ";
+            oss.write(word, len);
+            oss<<":"<<words[i].second;
+        }
+        oss<<"\n";
+        for (size_t i = 0; i < topic_dist.size(); ++i)
+            oss<<(i == 0 ? "" : " ")<<topic_dist[i].first<<":"<<topic_dist[i].second;
+        oss<<"\n";
+        response->assign(oss.str());
+        // an idle worker must not pin the model across a reload
+        extended_query._model.reset();
+        return true;
+    }
+
+private:
+    const ServerConfig& _config;
+    // per worker thread
+    ThreadLocal<ExtendedQuery> _extended_query;
+};
+
+static void LogCacheStats(const ServerConfig& config)
+{
+    QueryCacheStats stats = config._extender->GetCacheStats();
+    uint64_t lookups = stats._hits + stats._misses;
+    LOG(INFO)<<"query cache: size "<<stats._size<<" hits "<<stats._hits<<" misses "<<stats._misses
+             <<" hit rate "<<(lookups > 0 ? 1.0 * stats._hits / lookups : 0.0)
+             <<" evictions "<<stats._evictions<<" expirations "<<stats._expirations;
+}
+
+// waits for SIGHUP and SIGUSR1, which are blocked in all the other threads
+static void* ReloadModel(void* arg)
+{
+    const ServerConfig& config = *static_cast<const ServerConfig*>(arg);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    while (true)
+    {
+        int signal_number;
+        if (sigwait(&signals, &signal_number) != 0)  continue;
+        if (signal_number == SIGUSR1)
+        {
+            LogCacheStats(config);
+            continue;
+        }
+        LogCacheStats(config);
+        LOG(INFO)<<"reloading "<<config._model_file;
+        if (config._extender->Reload(config._model_file))
+            LOG(INFO)<<"model reloaded";
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr = 1;
+
+    if (argc < 4)
+    {
+        cout<<"Usage: "<<argv[0]<<" model_file alpha socket_path|port [max_words] [cache_size] [cache_ttl] [fold_in_tokens] [num_threads]"<<endl;
+        return 0;
+    }
+
+    string model_file = argv[1];
+    double alpha = boost::lexical_cast<double>(argv[2]);
+    string address = argv[3];
+
+    signal(SIGPIPE, SIG_IGN);
+    // inherited by every thread created below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    LDAQueryExtend lda_query_extender(model_file, alpha, 0.0, 10, 50);
+    ServerConfig config;
+    config._extender = &lda_query_extender;
+    config._model_file = model_file;
+    config._max_words = argc > 4 ? boost::lexical_cast<size_t>(argv[4]) : 100;
+    size_t cache_size = argc > 5 ? boost::lexical_cast<size_t>(argv[5]) : 0;
+    double cache_ttl = argc > 6 ? boost::lexical_cast<double>(argv[6]) : 0.0;
+    if (cache_size > 0)  lda_query_extender.EnableCache(cache_size, cache_ttl);
+    int fold_in_tokens = argc > 7 ? boost::lexical_cast<int>(argv[7]) : 0;
+    lda_query_extender.SetFoldIn(fold_in_tokens);
+    int num_threads = argc > 8 ? boost::lexical_cast<int>(argv[8]) : 8;
+
+    int listen_fd = ListenOn(address);
+    if (listen_fd < 0)
+    {
+        LOG(ERROR)<<"listen on "<<address<<" failed: "<<strerror(errno);
+        return 1;
+    }
+    LOG(INFO)<<"serving on "<<address;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t reload_thread;
+    pthread_create(&reload_thread, &attr, &ReloadModel, &config);
+
+    QueryHandler handler(config);
+    FrameServer server(&handler, kMaxFrameSize);
+    if (!server.Serve(listen_fd, num_threads))  return 1;
+    return 0;
+}
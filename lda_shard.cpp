@@ -0,0 +1,108 @@
+#include "model.h"
+#include "model_shard.h"
+#include "frame_server.h"
+#include <signal.h>
+
+// one shard of a model split by word with split_model: serves the rows of
+// its words to the front ends (ShardedLdaInfer of sharded_model.h) over a
+// unix domain socket or a local tcp port, see model_shard.h for the
+// protocol. the connections are served by num_threads worker threads, see
+// frame_server.h.
+
+struct ShardConfig
+{
+    const ModelData* _model;
+    uint32_t _shard_index;
+    uint32_t _num_shards;
+};
+
+class ShardHandler : public FrameHandler {
+public:
+    explicit ShardHandler(const ShardConfig& config) : _config(config) { }
+
+    virtual bool HandleFrame(const char* request, size_t size, string* response)
+    {
+        const ModelData& model = *_config._model;
+        if (size == 1 && request[0] == 'I')
+        {
+            AppendShardUint32(_config._shard_index, response);
+            AppendShardUint32(_config._num_shards, response);
+            AppendShardUint32(model.GetTopicNum(), response);
+            for (int topic_id = 0; topic_id < model.GetTopicNum(); ++topic_id)
+                AppendShardDouble(model.GetTopicTotalCount(topic_id), response);
+            return true;
+        }
+        if (size == 0 || request[0] != 'R')  return false;
+
+        ShardReader reader(request + 1, size - 1);
+        uint32_t num_words;
+        if (!reader.ReadUint32(&num_words))  return false;
+        for (uint32_t i = 0; i < num_words; ++i)
+        {
+            uint32_t len;
+            const char* word;
+            if (!reader.ReadUint32(&len) || !reader.ReadBytes(len, &word))  return false;
+            int word_id = model.GetWordId(word, len);
+            if (word_id < 0)
+            {
+                AppendShardUint32(kUnknownRow, response);
+                continue;
+            }
+            WordTopicRow row = model.GetWordTopicRow(word_id);
+            AppendShardUint32(row._size, response);
+            for (int j = 0; j < row._size; ++j)
+            {
+                AppendShardUint32(row._topic[j], response);
+                AppendShardFloat(row._prob[j], response);
+            }
+        }
+        return reader.AtEnd();
+    }
+
+private:
+    const ShardConfig& _config;
+};
+
+int main(int argc, char *argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr = 1;
+
+    if (argc < 5)
+    {
+        cout<<"Usage: "<<argv[0]<<" shard_file shard_index num_shards socket_path|port [num_threads]"<<endl;
+        return 0;
+    }
+
+    string shard_file = argv[1];
+    ShardConfig config;
+    config._shard_index = boost::lexical_cast<uint32_t>(argv[2]);
+    config._num_shards = boost::lexical_cast<uint32_t>(argv[3]);
+    string address = argv[4];
+    int num_threads = argc > 5 ? boost::lexical_cast<int>(argv[5]) : 8;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    ModelData model;
+    if (!model.Map(shard_file))
+    {
+        LOG(ERROR)<<"load shard failed: "<<shard_file;
+        return 1;
+    }
+    config._model = &model;
+    LOG(INFO)<<"shard "<<config._shard_index<<" of "<<config._num_shards<<": num_topic="<<model.GetTopicNum()
+             <<" num_vocab="<<model.GetVocabNum();
+
+    int listen_fd = ListenOn(address);
+    if (listen_fd < 0)
+    {
+        LOG(ERROR)<<"listen on "<<address<<" failed: "<<strerror(errno);
+        return 1;
+    }
+    LOG(INFO)<<"serving on "<<address;
+
+    ShardHandler handler(config);
+    FrameServer server(&handler, kMaxShardFrameSize);
+    if (!server.Serve(listen_fd, num_threads))  return 1;
+    return 0;
+}
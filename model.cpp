@@ -1,4 +1,5 @@
 #include "model.h"
+#include "monotonic_clock.h"
 
 
 struct cmper {
@@ -15,23 +16,6 @@ ostream& operator<<(ostream& out, vector<pair<string, double> >& v)
     return out;
 }
 
-#define rdtsc(low,high) __asm__ \
-    __volatile__("rdtsc" : "=a" (low), "=d" (high))
-
-unsigned long long get_cycles()
-{
-    unsigned low, high;
-    unsigned long long val;
-    rdtsc(low,high);
-    val = high;
-    val = (val << 32) | low; //将 low 和 high 合成一个 64 位值
-    return val;
-}
-
-double mhz = 2128.054 * 1000;  // 核的频率，在/proc/cpuinfo中找
-
-
-
 int main(int argc, char *argv[])
 {
     google::InitGoogleLogging(argv[0]);
@@ -52,13 +36,18 @@ int main(int argc, char *argv[])
 
     LDAQueryExtend lda_query_extender(model_file, alpha, 0.0, 10, 50); 
     unordered_map<string, double> extended_query;
-
-    long long start, end;
-    start = get_cycles();
-    lda_query_extender.ExtendQuery(tokens, &extended_query); 
-    end = get_cycles();
-    double millisecond = (end - start) / mhz;
-
+    vector<TopicCountPair> topic_dist;
+
+    uint64_t start, end;
+    start = NowNs();
+    lda_query_extender.ExtendQuery(tokens, &extended_query, &topic_dist); 
+    end = NowNs();
+    double millisecond = (end - start) * 1e-6;
+
+    cout<<"------ topic distribution -------"<<endl;
+    for (size_t i = 0; i < topic_dist.size(); ++i)
+        cout<<topic_dist[i].first<<":"<<topic_dist[i].second<<endl;
+    cout<<"---------------------------------"<<endl;
     cout<<"cost "<<millisecond<<" ms"<<endl;
     cout<<"------ extended query --------"<<endl;    
     vector<pair<string, double> > rst(extended_query.begin(), extended_query.end());
@@ -13,7 +13,19 @@
 #include <ext/functional>
 #include <glog/logging.h>
 #include <stdio.h>
+#include <time.h>
 #include <map>
+#include "model_file.h"
+#include "thread_local.h"
+#include "alias_table.h"
+#include "thread_pool.h"
+#include "random.h"
+#include "snapshot.h"
+#include "posterior_kernel.h"
+#include "query_cache.h"
+#include "trace.h"
+#include "topic_vector.h"
+#include "monotonic_clock.h"
 using namespace std;
 using namespace __gnu_cxx;
 using tr1::unordered_map;
@@ -31,319 +43,1385 @@ inline void IncreaseKeyCount(unordered_map<KeyType, double>* hashmap, KeyType ke
         (*hashmap)[key] = value;
 }
 
+// dense id -> count table which remembers the ids it touched, so that it is
+// cleared in O(nonzeros) and reused without allocation. keyed by topic in
+// Document, by word id in the extended query accumulator
+class DenseCounter {
+public:
+    DenseCounter() { }
+
+    void Init(int size)
+    {
+        if (static_cast<int>(_count.size()) == size)  return;
+        _count.assign(size, 0.0);
+        _touched.assign(size, false);
+        _keys.clear();
+        _keys.reserve(size);
+    }
+
+    inline double Get(int key) const
+    {
+        return _count[key];
+    }
+
+    // the dense counts, for the SIMD kernels
+    inline const double* Data() const
+    {
+        return &_count[0];
+    }
+
+    inline void Add(int key, double value)
+    {
+        if (!_touched[key])
+        {
+            _touched[key] = true;
+            _keys.push_back(key);
+        }
+        _count[key] += value;
+    }
+
+    // touched ids in first touch order, the count of some of them may have
+    // dropped back to 0
+    inline const vector<int>& Keys() const
+    {
+        return _keys;
+    }
+
+    void Scale(double factor)
+    {
+        for (size_t i = 0; i < _keys.size(); ++i)
+            _count[_keys[i]] *= factor;
+    }
+
+    void Clear()
+    {
+        for (size_t i = 0; i < _keys.size(); ++i)
+        {
+            _count[_keys[i]] = 0.0;
+            _touched[_keys[i]] = false;
+        }
+        _keys.clear();
+    }
+
+private:
+    vector<double> _count;
+    vector<bool> _touched;
+    vector<int> _keys;
+};
+
+typedef DenseCounter TopicCounter;
+
+// one inference of a document, also the reusable workspace of LdaInfer:
+// Clear() keeps every buffer's capacity, so a warmed-up Document makes
+// Infer() run without heap allocation
 struct Document
 {
-    vector<string> _string_document;  // word_string vector
     vector<int> _document;            // word_id vector
     vector<int> _topic;               // corresponding topic id
-    TopicCountDist _topic_dist;       // topic count in document
-    TopicCountDist _accumulate_topic_dist;  // accumulated topic count since after burn-in
+    TopicCounter _topic_dist;         // topic count in document
+    TopicCounter _accumulate_topic_dist;  // accumulated topic count since after burn-in
     vector<string> _unknown_word;     // words unseen by model
+    vector<double> _posterior;        // scratch, topic posterior cdf of one token
+    vector<double> _gamma;            // fold-in topic distributions of the tokens, over their rows
+    Random _rng;                      // random stream of the sampler
+    int _num_sweeps;                  // sweeps (or fold-in passes) the last Infer() ran
+
+    Document() : _rng(NextRandomSeed()), _num_sweeps(0) { }
+
+    void Init(int num_topic)
+    {
+        _topic_dist.Init(num_topic);
+        _accumulate_topic_dist.Init(num_topic);
+    }
+
+    void Clear()
+    {
+        _document.clear();
+        _topic.clear();
+        _topic_dist.Clear();
+        _accumulate_topic_dist.Clear();
+        _unknown_word.clear();
+        _num_sweeps = 0;
+    }
+
+    // the top_k topics of _accumulate_topic_dist renormalized, top_k 0 for
+    // all of them, see SparseTopicVector
+    void GetTopics(size_t top_k, SparseTopicVector* topics) const
+    {
+        topics->Assign(_accumulate_topic_dist.Keys(), _accumulate_topic_dist.Data(), top_k);
+    }
 };
 
 class Model {
 public:
-    typedef unordered_map<int, TopicCountDist* >  WordTopicCountDist;
-    typedef unordered_map<string, int> Word2IDDict;
-    
-    Model (const string& model_file)
-    {
-        // topic_id \t word:count \t word:count ...
-        ifstream ifs(model_file.c_str());
-        string buf;
-        int n = 0;
-        while (getline(ifs, buf))
-        {
-            if (buf.size() == 0 && buf[0] == '\n') continue;
-
-            istringstream ss(buf);
-            int topic_id;
-            ss >> topic_id;
-            string item;
-            double topic_total_count = 0;
-            while (ss>>item)
-            {
-                vector<string> tokens;
-                boost::split(tokens, item, boost::is_any_of(":"));
-                string word = tokens[0];
-                double count = boost::lexical_cast<double>(tokens[1]);
+    Model() { }
 
-                if (_word2id_dict.find(word) == _word2id_dict.end())
-                {
-                    int size = _word2id_dict.size();
-                    _word2id_dict[word] = size;
-                } 
-                int word_id = _word2id_dict[word];
-                if (_wor2top.find(word_id) == _wor2top.end())
-                {
-                    _wor2top[word_id] = new TopicCountDist();
-                }
-                (*_wor2top[word_id])[topic_id] = count;
+    // model_file is either the text model.dat or its binary form written by
+    // convert_model, the binary form is mmap'ed read-only
+    bool Load(const string& model_file)
+    {
+        bool ok = ModelData::IsBinaryFile(model_file) ? _data.Map(model_file)
+                                                      : _data.LoadText(model_file);
+        if (!ok)  return false;
+        LOG(INFO)<<"Load Model over: num_topic="<<_data.GetTopicNum()
+                 <<" num_vocal="<<_data.GetVocabNum()
+                 <<" mapped="<<_data.IsMapped()<<endl;
+        return true;
+    }
 
-                topic_total_count += count; 
-            }
+    inline WordTopicRow GetWordTopicRow(int word_id) const
+    {
+        return _data.GetWordTopicRow(word_id);
+    }
 
-            _top_total[topic_id] = topic_total_count;
-        }
-        LOG(INFO)<<"Load Model over: num_topic="<<_top_total.size()
-                 <<" num_vocal="<<_word2id_dict.size()<<endl;
+    inline double GetTopicTotalCount(int topic_id) const
+    {
+        return _data.GetTopicTotalCount(topic_id);
     }
 
-    inline const TopicCountDist* GetWordTopicCountDist (int word_id)
+    // p(w|z) of any topic, 0 if it is not in the row of the word
+    inline float GetWordTopicProb(int word_id, int topic_id) const
     {
-        return _wor2top[word_id];
+        return _data.GetWordTopicProb(word_id, topic_id);
     }
 
-    inline double GetTopicTotalCount(int topic_id)
+    inline int GetTopicNum() const
     {
-        return _top_total[topic_id];
+        return _data.GetTopicNum();
     }
 
-    inline int GetTopicNum()
+    inline int GetVocalNum() const
     {
-        return _top_total.size();
+        return _data.GetVocabNum();
     }
 
-    inline int GetVocalNum()
+    // -1 if the word is unseen by model
+    inline int GetWordId(const string& word) const
     {
-        return _word2id_dict.size();
+        return _data.GetWordId(word);
     }
 
-    inline Word2IDDict* GetWord2IDDict()
+    inline const ModelData& GetModelData() const
     {
-        return &_word2id_dict;
+        return _data;
     }
 
-    ~Model()
-    {    
-        for (WordTopicCountDist::iterator iter = _wor2top.begin();
-             iter != _wor2top.end();
-             ++iter)
-        {
-            delete iter->second;
-            iter->second = NULL;
-        }
+    // a model of some rows of a larger one, see ModelData::BuildFromRows()
+    void BuildFromRows(const vector<string>& words, const vector<WordTopicRow>& rows,
+                       const vector<double>& topic_total)
+    {
+        _data.BuildFromRows(words, rows, topic_total);
     }
 
+    // per word alias tables, only needed by SAMPLER_ALIAS_MH
+    void BuildAliasTable()
+    {
+        if (!_alias_table.IsBuilt())  _alias_table.Build(_data);
+    }
+
+    inline const WordAliasTable& GetAliasTable() const
+    {
+        return _alias_table;
+    }
+
+private:
+    // disallow copy and assignment
+    Model(const Model&);
+    Model& operator = (const Model&);
+
 private:
-    WordTopicCountDist _wor2top;
-    TopicCountDist _top_total;
-    Word2IDDict _word2id_dict;
+    ModelData _data;
+    WordAliasTable _alias_table;
 };
 
+// a loaded model pinned for the duration of a request
+typedef tr1::shared_ptr<const Model> ModelPtr;
 
 
 
+
+// how LdaInfer draws the topic of a token
+enum SamplerType
+{
+    SAMPLER_LINEAR = 0,     // exact posterior over the word row, O(K_w) per token
+    SAMPLER_ALIAS_MH = 1    // Metropolis-Hastings with alias word proposal and doc proposal
+};
+
+// how LdaInfer infers a document, chosen per call
+enum InferMethod
+{
+    INFER_DEFAULT = 0,      // fold-in up to the query length set by SetFoldIn(), Gibbs above
+    INFER_GIBBS = 1,        // Gibbs sampling with the SamplerType of LdaInfer
+    INFER_FOLD_IN = 2       // deterministic fold-in, see LdaInfer::FoldIn()
+};
+
+// sweeps in a row that must pass the convergence test of LdaInfer
+static const int kStableSweeps = 5;
+// the fold-in stops once no token moved more than this in L1 distance
+static const double kFoldInTolerance = 1e-3;
+
 class LdaInfer {
 public:
-    LdaInfer(string model_file, double alpha, double beta, int burnin_iter, int max_iter) 
-    : _model(model_file), _alpha(alpha), _beta(beta), _burnin_iter(burnin_iter), _max_iter(max_iter)
-    {    _num_topic = _model.GetTopicNum(); }
+    LdaInfer(string model_file, double alpha, double beta, int burnin_iter, int max_iter,
+             SamplerType sampler = SAMPLER_LINEAR, int mh_steps = 2) 
+    : _alpha(alpha), _beta(beta), _max_iter(max_iter), _burnin_iter(burnin_iter),
+      _sampler(sampler), _mh_steps(mh_steps), _alias_table(sampler == SAMPLER_ALIAS_MH),
+      _posterior_cdf(GetPosteriorCdfKernel()), _tolerance(0.0), _time_budget(0),
+      _fold_in_max_tokens(0), _fold_in_iter(20)
+    {
+        Model* model = LoadModel(model_file);
+        if (model == NULL)  LOG(FATAL)<<"Load Model failed: "<<model_file;
+        _model.Publish(tr1::shared_ptr<Model>(model));
+    }
+
+    // without a model of its own, for the callers that pass the model to
+    // every Infer(), e.g. ShardedLdaInfer. GetModel() is NULL
+    LdaInfer(double alpha, double beta, int burnin_iter, int max_iter,
+             SamplerType sampler = SAMPLER_LINEAR, int mh_steps = 2)
+    : _alpha(alpha), _beta(beta), _max_iter(max_iter), _burnin_iter(burnin_iter),
+      _sampler(sampler), _mh_steps(mh_steps), _alias_table(sampler == SAMPLER_ALIAS_MH),
+      _posterior_cdf(GetPosteriorCdfKernel()), _tolerance(0.0), _time_budget(0),
+      _fold_in_max_tokens(0), _fold_in_iter(20)
+    {
+    }
+
+    // loads model_file and swaps it in for the following Infer() calls, the
+    // calls in flight finish on the model they started with, which is freed
+    // after the last of them. takes as long as a cold start, so call it from
+    // a background thread. the current model is kept if model_file can not
+    // be loaded
+    bool Reload(const string& model_file)
+    {
+        Model* model = LoadModel(model_file);
+        if (model == NULL)
+        {
+            LOG(ERROR)<<"Reload Model failed, keep the current one: "<<model_file;
+            return false;
+        }
+        _model.Publish(tr1::shared_ptr<Model>(model));
+        return true;
+    }
+
+    // same as Infer() with the random stream of doc restarted from seed,
+    // the result is reproducible for a given seed
+    void Infer(const vector<string>& string_doc, Document* doc, uint64_t seed)
+    {
+        doc->_rng.Seed(seed);
+        Infer(string_doc, doc);
+    }
 
+    // doc is cleared first, pass the same Document again to reuse its buffers
     void Infer(const vector<string>& string_doc, Document* doc)
     {
-        //Document doc;
-        InitTopicAssignment(string_doc, doc);
+        ModelPtr model = GetModel();
+        Infer(*model, string_doc, doc);
+    }
+
+    // with a model snapshot taken by the caller, the word ids of doc refer
+    // to its vocabulary
+    void Infer(const Model& model, const vector<string>& string_doc, Document* doc,
+               InferMethod method = INFER_DEFAULT)
+    {
+        doc->Init(model.GetTopicNum());
+        doc->Clear();
+        if (GetMethod(string_doc.size(), method) == INFER_FOLD_IN)
+        {
+            AddWords(model, string_doc, doc);
+            FoldIn(model, doc);
+            return;
+        }
+        InitTopicAssignment(model, string_doc, doc);
         if (doc->_document.size() == 0)  return;
+        Sample(model, _max_iter - _burnin_iter, doc);
+    }
 
-        int accumulate_count = _max_iter - _burnin_iter;
+    // for the long documents: num_chains independent Gibbs chains of
+    // string_doc on the threads of pool, each with its own random stream
+    // drawn from the one of doc and 1/num_chains of the accumulated sweeps,
+    // so the wall time goes down with the cores while theta, the average of
+    // the chains, keeps the number of samples. chains are the workspaces of
+    // the chains, resized to num_chains. returns the spread of the chains,
+    // the mean L1 distance of their theta to the average: near 0 once the
+    // chains agree, a large spread says that they did not converge. pool
+    // runs one call at a time, it must not be the pool the call runs on
+    double InferChains(const Model& model, const vector<string>& string_doc, int num_chains,
+                       ThreadPool* pool, vector<Document>* chains, Document* doc)
+    {
+        if (num_chains <= 1 || pool == NULL)
+        {
+            Infer(model, string_doc, doc, INFER_GIBBS);
+            return 0.0;
+        }
+        chains->resize(num_chains);
+        for (int c = 0; c < num_chains; ++c)
+            (*chains)[c]._rng.Seed(doc->_rng.Next());
+        int accumulate_count = max(_max_iter - _burnin_iter, 0);
+        ChainTask task(this, model, string_doc, (accumulate_count + num_chains - 1) / num_chains, chains);
+        pool->ParallelFor(num_chains, &task);
+
+        doc->Init(model.GetTopicNum());
+        doc->Clear();
+        AddWords(model, string_doc, doc);
+        if (doc->_document.size() == 0)  return 0.0;
+        // the assignment of the first chain, with its counts, as Infer()
+        // leaves it
+        doc->_topic = (*chains)[0]._topic;
+        const TopicCounter& chain_topic_dist = (*chains)[0]._topic_dist;
+        for (size_t i = 0; i < chain_topic_dist.Keys().size(); ++i)
+        {
+            int topic = chain_topic_dist.Keys()[i];
+            doc->_topic_dist.Add(topic, chain_topic_dist.Get(topic));
+        }
+        TopicCounter& theta = doc->_accumulate_topic_dist;
+        for (int c = 0; c < num_chains; ++c)
+        {
+            const TopicCounter& chain_theta = (*chains)[c]._accumulate_topic_dist;
+            const vector<int>& topics = chain_theta.Keys();
+            for (size_t i = 0; i < topics.size(); ++i)
+                theta.Add(topics[i], chain_theta.Get(topics[i]) / num_chains);
+            doc->_num_sweeps += (*chains)[c]._num_sweeps;
+        }
+
+        double spread = 0.0;
+        for (int c = 0; c < num_chains; ++c)
+        {
+            const TopicCounter& chain_theta = (*chains)[c]._accumulate_topic_dist;
+            const vector<int>& topics = theta.Keys();
+            for (size_t i = 0; i < topics.size(); ++i)
+                spread += fabs(chain_theta.Get(topics[i]) - theta.Get(topics[i]));
+        }
+        return spread / num_chains;
+    }
+
+    // adaptive number of sweeps: the burn-in ends early after kStableSweeps
+    // sweeps that change no assignment, and the sampling after it stops once
+    // the averaged topic distribution moved less than tolerance in L1
+    // distance over each of the last kStableSweeps sweeps. burnin_iter and
+    // max_iter stay the upper bounds, 0 keeps the fixed number of sweeps.
+    // call it before serving
+    void SetTolerance(double tolerance)
+    {
+        _tolerance = tolerance;
+    }
+
+    // caps the sampling of every Infer() at milliseconds, the topic
+    // distribution is the average of the sweeps done by then. 0 for none,
+    // call it before serving
+    void SetTimeBudget(double milliseconds)
+    {
+        _time_budget = static_cast<uint64_t>(milliseconds * 1e6);
+    }
+
+    // INFER_DEFAULT infers the queries of up to max_tokens tokens with
+    // FoldIn(), in at most max_iter passes, and the longer ones with Gibbs.
+    // max_tokens 0 (the default) always samples. call it before serving
+    void SetFoldIn(int max_tokens, int max_iter = 20)
+    {
+        _fold_in_max_tokens = max_tokens;
+        _fold_in_iter = max(max_iter, 1);
+    }
+
+    // the method Infer() runs for a query of num_tokens tokens
+    inline InferMethod GetMethod(size_t num_tokens, InferMethod method) const
+    {
+        if (method != INFER_DEFAULT)  return method;
+        return static_cast<int>(num_tokens) <= _fold_in_max_tokens ? INFER_FOLD_IN : INFER_GIBBS;
+    }
+
+    // doc with the words of string_doc and a topic distribution inferred
+    // before on the same model, e.g. kept by a cache, in place of sampling
+    void Restore(const Model& model, const vector<string>& string_doc,
+                 const vector<TopicCountPair>& topic_dist, Document* doc)
+    {
+        doc->Init(model.GetTopicNum());
+        doc->Clear();
+        AddWords(model, string_doc, doc);
+        for (size_t i = 0; i < topic_dist.size(); ++i)
+            doc->_accumulate_topic_dist.Add(topic_dist[i].first, topic_dist[i].second);
+    }
+
+    // snapshot of the current model, it stays valid across a Reload()
+    inline ModelPtr GetModel() const
+    {
+        return _model.Get();
+    }
+
+    // the alias tables of SAMPLER_ALIAS_MH, which the constructor builds
+    // already with that sampler, for the current model and the reloaded
+    // ones. not safe against concurrent Infer() calls, call it before serving
+    void BuildAliasTable()
+    {
+        _alias_table = true;
+        tr1::shared_ptr<Model> model = _model.Get();
+        if (model)  model->BuildAliasTable();
+    }
+
+private:
+    Model* LoadModel(const string& model_file) const
+    {
+        Model* model = new Model();
+        if (!model->Load(model_file))
+        {
+            delete model;
+            return NULL;
+        }
+        if (_alias_table)  model->BuildAliasTable();
+        return model;
+    }
+
+    // the Gibbs sweeps of Infer() from the random assignment of doc: the
+    // burn-in, then accumulate_count sweeps averaged into theta
+    void Sample(const Model& model, int accumulate_count, Document* doc)
+    {
+        uint64_t deadline = _time_budget > 0 ? NowNs() + _time_budget : 0;
         int doc_len = doc->_document.size();
-        TopicCountDist& accumulate_topic_dist = doc->_accumulate_topic_dist;
-        for (int n = 0; n < _max_iter; ++n)
+        TopicCounter& topic_dist = doc->_topic_dist;
+        TopicCounter& theta = doc->_accumulate_topic_dist;
+        bool adaptive = accumulate_count > 0 && (_tolerance > 0 || deadline > 0);
+        int accumulated = 0;
+        int stable = 0;                   // last sweeps below the tolerance
+        for (int n = 0; n < _burnin_iter + accumulate_count && accumulated < accumulate_count; ++n)
         {
-            UpdateTopicForDocument(doc);
+            int changed = UpdateTopicForDocument(model, doc);
+            ++doc->_num_sweeps;
+            bool out_of_time = deadline > 0 && NowNs() >= deadline;
+            // burn-in, cut short by kStableSweeps sweeps that change no assignment
+            bool burnin = n < _burnin_iter && accumulated == 0;
+            if (burnin)
+            {
+                stable = changed == 0 ? stable + 1 : 0;
+                if (!(adaptive && (out_of_time || (_tolerance > 0 && stable >= kStableSweeps))))
+                    continue;
+                stable = 0;
+            }
+
             //accumulate topic count
-            if ( n >= _burnin_iter)
+            const vector<int>& topics = topic_dist.Keys();
+            for (size_t i = 0; i < topics.size(); ++i)
             {
-                for (TopicCountDist::iterator iter = doc->_topic_dist.begin();
-                     iter != doc->_topic_dist.end();
-                     ++iter)
-                {
-                    IncreaseKeyCount(&(doc->_accumulate_topic_dist), 
-                                     iter->first, 
-                                     iter->second/ (accumulate_count*doc_len));
-                }
+                double count = topic_dist.Get(topics[i]);
+                if (count > 0)
+                    theta.Add(topics[i], count / (accumulate_count*doc_len));
+            }
+            ++accumulated;
+            if (out_of_time)  break;
+            if (_tolerance > 0 && accumulated > 1)
+            {
+                stable = ThetaDrift(*doc, accumulated, accumulate_count) < _tolerance ? stable + 1 : 0;
+                if (stable >= kStableSweeps)  break;
             }
         }
+        // theta is the average of the sweeps it really got
+        if (accumulated > 0 && accumulated != accumulate_count)
+            theta.Scale(1.0 * accumulate_count / accumulated);
     }
 
-private:
-    void UpdateTopicForDocument(Document* doc)
+    class ChainTask : public ParallelTask {
+    public:
+        ChainTask(LdaInfer* infer, const Model& model, const vector<string>& string_doc,
+                  int accumulate_count, vector<Document>* chains)
+        : _infer(infer), _model(model), _string_doc(string_doc),
+          _accumulate_count(accumulate_count), _chains(chains) { }
+
+        virtual void Run(int index)
+        {
+            Document* chain = &(*_chains)[index];
+            chain->Init(_model.GetTopicNum());
+            chain->Clear();
+            _infer->InitTopicAssignment(_model, _string_doc, chain);
+            if (chain->_document.size() > 0)
+                _infer->Sample(_model, _accumulate_count, chain);
+        }
+
+    private:
+        LdaInfer* _infer;
+        const Model& _model;
+        const vector<string>& _string_doc;
+        int _accumulate_count;
+        vector<Document>* _chains;
+    };
+
+    // one Gibbs sweep, returns the number of assignments it changed
+    int UpdateTopicForDocument(const Model& model, Document* doc)
     {
         int doc_size = doc->_document.size();
-        for (size_t i = 0; i < doc_size; ++i)
+        int changed = 0;
+        for (int i = 0; i < doc_size; ++i)
         {
-            // calculate topic posterior
-            TopicCountDist topic_count_dist;
-            CalcTopicPosterior(i, doc, &topic_count_dist);
-            // sample from topic distribution
-            int sampled_topic = SampleTopic(&topic_count_dist);
+            int sampled_topic;
+            if (_sampler == SAMPLER_ALIAS_MH)
+            {
+                sampled_topic = SampleTopicMH(model, i, doc);
+                doc->_topic_dist.Add(doc->_topic[i], -1);
+            }
+            else
+            {
+                // take the token out first, its posterior sees n_dz without it
+                doc->_topic_dist.Add(doc->_topic[i], -1);
+                sampled_topic = SampleTopic(model.GetWordTopicRow(doc->_document[i]), doc);
+            }
             // update topic assignment
-            IncreaseKeyCount(&(doc->_topic_dist), doc->_topic[i], -1);
+            if (sampled_topic != doc->_topic[i])  ++changed;
             doc->_topic[i] = sampled_topic;
-            IncreaseKeyCount(&(doc->_topic_dist), sampled_topic, 1);
+            doc->_topic_dist.Add(sampled_topic, 1);
+        }
+        return changed;
+    }
+
+    // L1 distance of the average topic distribution of the first accumulated
+    // sweeps and of the ones before the last. the sweeps are added to
+    // _accumulate_topic_dist with weight 1 / accumulate_count
+    static double ThetaDrift(const Document& doc, int accumulated, int accumulate_count)
+    {
+        const TopicCounter& theta = doc._accumulate_topic_dist;
+        const TopicCounter& topic_dist = doc._topic_dist;
+        double doc_len = doc._document.size();
+        double drift = 0.0;
+        const vector<int>& topics = theta.Keys();
+        for (size_t i = 0; i < topics.size(); ++i)
+        {
+            double sum = theta.Get(topics[i]) * accumulate_count;
+            double last = max(topic_dist.Get(topics[i]), 0.0) / doc_len;
+            drift += fabs(sum / accumulated - (sum - last) / (accumulated - 1));
         }
+        return drift;
     }
 
-    // p(z|w, \theta, \phi, alpha), we omit beta here cause it is not important
-    void CalcTopicPosterior(int word_id_index, Document* doc, TopicCountDist* topic_count_dist)
+    // cdf of p(z|w, \theta, \phi, alpha) over the row of the word, we omit
+    // beta here cause it is not important. the dense rows of frequent words
+    // go through the SIMD kernel
+    double CalcTopicPosterior(const WordTopicRow& row, Document* doc)
     {
+        vector<double>& cdf = doc->_posterior;
+        cdf.resize(row._size);
+        const int* topic = row._topic.Ints();
+        const float* prob = row._prob.Floats();
+        if (row._size >= kSimdRowSize && topic != NULL && prob != NULL)
+            return _posterior_cdf(topic, prob, doc->_topic_dist.Data(), _alpha, row._size, &cdf[0]);
+
+        double sum = 0.0;
+        for (int i = 0; i < row._size; ++i)
+        {
+            sum += row._prob[i] * (doc->_topic_dist.Get(row._topic[i]) + _alpha);
+            cdf[i] = sum;
+        }
+        return sum;
+    }
+
+    // binary search of the posterior cdf
+    int SampleTopic(const WordTopicRow& row, Document* doc)
+    {
+        double total = CalcTopicPosterior(row, doc);
+        double rdm = Uniform(doc) * total;
+        const vector<double>& cdf = doc->_posterior;
+        int index = lower_bound(cdf.begin(), cdf.end(), rdm) - cdf.begin();
+        return row._topic[min(index, row._size - 1)];
+    }
+
+    // Metropolis-Hastings chain on p(w|z) * (n_dz + alpha), alternating the
+    // word proposal p(w|z) drawn from the alias table and the doc proposal
+    // n_dz + alpha drawn from the topics of the document, see LightLDA.
+    // n_dz of the target excludes the current token, the doc proposal
+    // counts include it.
+    int SampleTopicMH(const Model& model, int word_id_index, Document* doc)
+    {
+        const WordAliasTable& alias_table = model.GetAliasTable();
+        int num_topic = model.GetTopicNum();
+        const TopicCounter& topic_dist = doc->_topic_dist;
         int word_id = doc->_document[word_id_index];
         int old_topic_id = doc->_topic[word_id_index];
-        const TopicCountDist* word_topic_count_dist = _model.GetWordTopicCountDist(word_id);
-        for (TopicCountDist::const_iterator iter = word_topic_count_dist->begin();
-             iter != word_topic_count_dist->end();
-             ++iter)
-        {
-           int topic_id = iter->first;
-           double topic_count = iter->second;
-           double topic_total_count = _model.GetTopicTotalCount(topic_id);
-           double p_w_z = topic_count / topic_total_count;
+        int doc_len = doc->_document.size();
+        WordTopicRow row = model.GetWordTopicRow(word_id);
 
-           double adjust = topic_id == old_topic_id ? 1 : 0;
-           TopicCountDist& topic_dist = doc->_topic_dist;
-           double doc_topic_count = topic_dist.find(topic_id) != topic_dist.end()\
-                                    ? topic_dist[topic_id] : 0.0;  
-           doc_topic_count -= adjust;
-           
-           (*topic_count_dist)[topic_id] = p_w_z * (doc_topic_count + _alpha);
+        int topic_id = old_topic_id;
+        double p_w_s = model.GetWordTopicProb(word_id, topic_id);
+        for (int step = 0; step < _mh_steps; ++step)
+        {
+            int candidate;
+            double p_w_t;
+            double n_s = topic_dist.Get(topic_id) - (topic_id == old_topic_id ? 1 : 0);
+            double accept;
+            if (step % 2 == 0)
+            {
+                // word proposal, p(w|z) cancels out
+                int index = alias_table.Sample(word_id, Uniform(doc));
+                candidate = row._topic[index];
+                p_w_t = row._prob[index];
+                double n_t = topic_dist.Get(candidate) - (candidate == old_topic_id ? 1 : 0);
+                accept = p_w_s <= 0 ? 1.0 : (n_t + _alpha) / (n_s + _alpha);
+            }
+            else
+            {
+                // doc proposal, topic of a random token or a uniform topic
+                double rdm = Uniform(doc) * (doc_len + num_topic * _alpha);
+                if (rdm < doc_len)
+                    candidate = doc->_topic[static_cast<int>(rdm)];
+                else
+                    candidate = min(static_cast<int>((rdm - doc_len) / _alpha), num_topic - 1);
+                p_w_t = model.GetWordTopicProb(word_id, candidate);
+                if (p_w_t <= 0)  continue;
+                double n_t = topic_dist.Get(candidate) - (candidate == old_topic_id ? 1 : 0);
+                accept = p_w_s <= 0 ? 1.0
+                       : p_w_t * (n_t + _alpha) * (topic_dist.Get(topic_id) + _alpha)
+                         / (p_w_s * (n_s + _alpha) * (topic_dist.Get(candidate) + _alpha));
+            }
+            if (accept >= 1.0 || Uniform(doc) < accept)
+            {
+                topic_id = candidate;
+                p_w_s = p_w_t;
+            }
         }
+        return topic_id;
     }
 
-    int SampleTopic(const TopicCountDist* topic_count_dist)
+    // uniform in [0, 1), from the random stream of the document
+    inline double Uniform(Document* doc)
     {
-        vector<TopicCountPair > topic_dist(topic_count_dist->begin(), topic_count_dist->end());
-        size_t size = topic_dist.size();
-        for (size_t i = 1; i < size; ++i)
-            topic_dist[i].second += topic_dist[i-1].second;
-        double rdm = rand() / static_cast<double>(RAND_MAX) * topic_dist[size-1].second;
-        vector<TopicCountPair >::iterator iter = find_if(topic_dist.begin(), topic_dist.end(),
-            compose1(bind1st(less_equal<double>(), rdm), _Select2nd<TopicCountPair >()));
-        return iter->first;
+        return doc->_rng.Uniform();
     }
 
-    int InitTopicAssignment(const vector<string>& string_doc, Document* doc)
+    void AddWords(const Model& model, const vector<string>& string_doc, Document* doc)
     {
         for (size_t i = 0; i < string_doc.size(); ++i)
         {
-            Model::Word2IDDict* p_word2id_dict = _model.GetWord2IDDict();
-            if (p_word2id_dict->find(string_doc[i]) == p_word2id_dict->end())
-            {
+            int word_id = model.GetWordId(string_doc[i]);
+            if (word_id < 0)
                 doc->_unknown_word.push_back(string_doc[i]);
-                continue;
-            }
-            doc->_string_document.push_back(string_doc[i]);
-            int word_id = (*p_word2id_dict)[string_doc[i]];
-            doc->_document.push_back(word_id);
-            int random_topic = static_cast<int>( rand() / static_cast<double>(RAND_MAX) * _num_topic);
+            else
+                doc->_document.push_back(word_id);
+        }
+    }
+
+    void InitTopicAssignment(const Model& model, const vector<string>& string_doc, Document* doc)
+    {
+        int num_topic = model.GetTopicNum();
+        AddWords(model, string_doc, doc);
+        for (size_t i = 0; i < doc->_document.size(); ++i)
+        {
+            int random_topic = doc->_rng.UniformInt(num_topic);
             doc->_topic.push_back(random_topic);
 
-            IncreaseKeyCount(&(doc->_topic_dist), random_topic, 1);
+            doc->_topic_dist.Add(random_topic, 1);
+        }
+    }
+
+    // deterministic fold-in on the fixed topics of the model, CVB0 (Asuncion
+    // et al., On Smoothing and Inference for Topic Models): every token keeps
+    // a distribution over the topics of its word row in place of a sampled
+    // topic, and _topic_dist holds the expected counts. a pass updates each
+    // token as the Gibbs sampler would, with the expected counts of the other
+    // tokens, from the same posterior kernel. the first pass starts from
+    // the tokens before, so no random start is needed and the same query
+    // always gets the same distribution. _topic gets the most likely topic
+    void FoldIn(const Model& model, Document* doc)
+    {
+        int doc_len = doc->_document.size();
+        if (doc_len == 0)  return;
+        TopicCounter& topic_dist = doc->_topic_dist;
+        vector<double>& gamma = doc->_gamma;
+        gamma.clear();
+        for (int i = 0; i < doc_len; ++i)
+            gamma.resize(gamma.size() + model.GetWordTopicRow(doc->_document[i])._size, 0.0);
+
+        for (int n = 0; n < _fold_in_iter; ++n)
+        {
+            ++doc->_num_sweeps;
+            double max_delta = 0.0;
+            size_t offset = 0;
+            for (int i = 0; i < doc_len; ++i)
+            {
+                WordTopicRow row = model.GetWordTopicRow(doc->_document[i]);
+                double* token_gamma = &gamma[offset];
+                offset += row._size;
+                // the token out of the counts, nothing to take out in the first pass
+                for (int k = 0; k < row._size && n > 0; ++k)
+                    topic_dist.Add(row._topic[k], -token_gamma[k]);
+                double total = CalcTopicPosterior(row, doc);
+                if (total <= 0)  continue;
+                const vector<double>& cdf = doc->_posterior;
+                double delta = 0.0;
+                double prev = 0.0;
+                for (int k = 0; k < row._size; ++k)
+                {
+                    double p = (cdf[k] - prev) / total;
+                    prev = cdf[k];
+                    delta += fabs(p - token_gamma[k]);
+                    token_gamma[k] = p;
+                    topic_dist.Add(row._topic[k], p);
+                }
+                max_delta = max(max_delta, delta);
+            }
+            if (n > 0 && max_delta < kFoldInTolerance)  break;
+        }
+
+        size_t offset = 0;
+        for (int i = 0; i < doc_len; ++i)
+        {
+            WordTopicRow row = model.GetWordTopicRow(doc->_document[i]);
+            const double* token_gamma = &gamma[offset];
+            offset += row._size;
+            int best = 0;
+            for (int k = 1; k < row._size; ++k)
+                if (token_gamma[k] > token_gamma[best])  best = k;
+            doc->_topic.push_back(row._size > 0 ? row._topic[best] : 0);
+        }
+        const vector<int>& topics = topic_dist.Keys();
+        for (size_t i = 0; i < topics.size(); ++i)
+        {
+            double count = topic_dist.Get(topics[i]);
+            if (count > 0)
+                doc->_accumulate_topic_dist.Add(topics[i], count / doc_len);
         }
     }
 
 private:
-    Model _model;
-    int _num_topic;
+    // current model, swapped by Reload()
+    SnapshotSlot<Model> _model;
     double _alpha;
     double _beta;
     int _max_iter;
     int _burnin_iter;
+    SamplerType _sampler;
+    int _mh_steps;
+    // whether the models need their alias tables
+    bool _alias_table;
+    // widest posterior kernel of the cpu
+    PosteriorCdfKernel _posterior_cdf;
+    // adaptive stopping, see SetTolerance() and SetTimeBudget()
+    double _tolerance;
+    uint64_t _time_budget;            // ns
+    // INFER_DEFAULT policy, see SetFoldIn()
+    int _fold_in_max_tokens;
+    int _fold_in_iter;
+};
+
+// share of the topic part in the extended query, the original query words get the rest
+static const double kTopicDistWeight = 0.5;
+// topics below this probability are left out of the extension
+static const double kMinTopicProb = 1e-4;
+// depth of the first block of topic rows read by ExtendQueryTopN
+static const int kTopNFirstDepth = 64;
+// up to this many words in the topic rows of a query, ExtendQueryTopN adds
+// them all up, above it stops early and looks up the weights of the top_n
+static const int kTopNDenseWords = 16384;
+
+typedef pair<int, double> WordIdWeight;
+
+// extended query keyed by word id, the strings stay in the vocabulary of the
+// model and are looked up lazily with LDAQueryExtend::GetWord(). the query
+// words unseen by the model have no id: the i-th of them gets id -1 - i and
+// its string is _unknown_word[i]
+struct ExtendedQuery
+{
+    vector<WordIdWeight> _words;
+    vector<string> _unknown_word;
+    ModelPtr _model;                  // the model the ids refer to
+
+    void Clear()
+    {
+        _words.clear();
+        _unknown_word.clear();
+    }
+};
+
+// what the query cache of LDAQueryExtend keeps of a query
+struct CachedQuery
+{
+    vector<TopicCountPair> _topic_dist;   // _accumulate_topic_dist, in key order
+    size_t _top_n;                        // top_n of _words, 0 if not extended yet
+    vector<WordIdWeight> _words;          // ExtendQueryTopN result
+    vector<string> _unknown_word;
+};
+
+typedef QueryCache<CachedQuery> ExtendQueryCache;
+
+// per thread workspace of LDAQueryExtend
+struct ExtendWorkspace
+{
+    DenseCounter _word_weight;            // word id -> weight, partial in the top_n merge of long rows
+    vector<TopicCountPair> _topics;       // topics of the query and their weight
+    vector<pair<double, int> > _candidates; // (weight, word id) candidates of the top_n merge
+    vector<double> _word_score;           // word id -> weight in the top_n merge, 0 between the queries
+    ExtendedQuery _extended_query;        // id result behind the string keyed calls
+    string _cache_key;
+    CachedQuery _cached;
+
+    void Init(int num_word)
+    {
+        _word_weight.Init(num_word);
+        _word_score.resize(num_word, 0.0);
+    }
+
+    void Clear()
+    {
+        _word_weight.Clear();
+        _topics.clear();
+        _candidates.clear();
+    }
 };
 
 class LDAQueryExtend {
 public:
     typedef pair<string, double> WordProb;
-    LDAQueryExtend(const string& model_file, double alpha, double beta, int burnin_iter, int max_iter)
-    : _infer(model_file, alpha, beta, burnin_iter, max_iter), _topic2word(6000)
-    {
-        ifstream ifs(model_file.c_str());
-        string buf;
-        int topic2word_size = _topic2word.size();
-        while (getline(ifs, buf))
-        {
-            if (buf.size() == 0 && buf[0] == '\n') continue;
-            istringstream ss(buf);
-            int topic_id;
-            ss >> topic_id;
-            if (topic2word_size <= topic_id) {
-                _topic2word.resize(topic2word_size * 2);
-                topic2word_size = _topic2word.size();
-            }
-            
-            string item;
-            double total_count = 0.0;
-            while (ss >> item)
+    LDAQueryExtend(const string& model_file, double alpha, double beta, int burnin_iter, int max_iter,
+                   SamplerType sampler = SAMPLER_LINEAR)
+    : _infer(model_file, alpha, beta, burnin_iter, max_iter, sampler), _cache(NULL),
+      _num_chains(1), _chain_min_tokens(0), _chain_pool(NULL)
+    {
+    }
+
+    ~LDAQueryExtend()
+    {
+        delete _cache;
+    }
+
+    // keeps the topic distribution (and the ExtendQueryTopN result) of the
+    // last capacity queries for ttl_seconds (<= 0: until evicted), a
+    // repeated query, with its words in any order, skips the inference.
+    // the cache is emptied by Reload(). call it before serving
+    void EnableCache(size_t capacity, double ttl_seconds, int num_shards = 16)
+    {
+        delete _cache;
+        _cache = new ExtendQueryCache(capacity, ttl_seconds, num_shards, _infer.GetModel());
+    }
+
+    // adaptive number of sweeps and time budget of the inference, see
+    // LdaInfer::SetTolerance() and LdaInfer::SetTimeBudget()
+    void SetTolerance(double tolerance)
+    {
+        _infer.SetTolerance(tolerance);
+    }
+
+    void SetTimeBudget(double milliseconds)
+    {
+        _infer.SetTimeBudget(milliseconds);
+    }
+
+    // deterministic fold-in of the short queries, see LdaInfer::SetFoldIn()
+    void SetFoldIn(int max_tokens, int max_iter = 20)
+    {
+        _infer.SetFoldIn(max_tokens, max_iter);
+    }
+
+    // the sampled queries of at least min_tokens tokens, e.g. whole product
+    // descriptions, run num_chains chains on the threads of pool, see
+    // LdaInfer::InferChains(). pool must not be the one of
+    // ExtendQueryBatch(), it is not owned. call it before serving
+    void SetChains(int num_chains, size_t min_tokens, ThreadPool* pool)
+    {
+        _num_chains = num_chains;
+        _chain_min_tokens = min_tokens;
+        _chain_pool = pool;
+    }
+
+    // all zero without a cache
+    QueryCacheStats GetCacheStats() const
+    {
+        return _cache != NULL ? _cache->GetStats() : QueryCacheStats();
+    }
+
+    // traces the topic distribution in the debug builds, see trace.h
+    void ExtendQuery(const vector<string>& tokens, unordered_map<string, double>* extended_query)
+    {
+        // per thread workspace, reused across queries
+        Document& doc = *_doc.Get();
+        ModelPtr model = _infer.GetModel();
+        infer(model, tokens, INFER_DEFAULT, _workspace.Get(), &doc);
+        build_extended_query(model, doc, extended_query);
+
+        if (DefaultTrace::kEnabled)
+        {
+            ostream& out = DefaultTrace::Sink();
+            out<<"------ topic distribution -------"<<endl;
+            const vector<int>& topics = doc._accumulate_topic_dist.Keys();
+            for (size_t i = 0; i < topics.size(); ++i)
             {
-                vector<string> tokens;
-                boost::split(tokens, item, boost::is_any_of(":"));
-                string word = tokens[0];
-                double count = boost::lexical_cast<double>(tokens[1]);
-                total_count += count;
-                _topic2word[topic_id].push_back(WordProb(word, count));
+                double prob_topic = doc._accumulate_topic_dist.Get(topics[i]);
+                if (prob_topic > kMinTopicProb)  out<<topics[i]<<":"<<prob_topic<<endl;
             }
-            
-            for (size_t i = 0; i<_topic2word[topic_id].size(); ++i)
-                _topic2word[topic_id][i].second /= total_count;
+            out<<"---------------------------------"<<endl;
         }
     }
 
-    void ExtendQuery(const vector<string>& tokens, unordered_map<string, double>* extended_query)
+    // same as above without printing, topic_dist gets the topics above 1e-4
+    // and may be NULL. safe to call from many threads at once
+    void ExtendQuery(const vector<string>& tokens, unordered_map<string, double>* extended_query,
+                     vector<TopicCountPair>* topic_dist)
+    {
+        Document& doc = *_doc.Get();
+        ModelPtr model = _infer.GetModel();
+        infer(model, tokens, INFER_DEFAULT, _workspace.Get(), &doc);
+        extended_query->clear();
+        build_extended_query(model, doc, extended_query);
+        if (topic_dist != NULL)  get_topic_dist(doc, topic_dist);
+    }
+
+    // the whole extended query by word id, in no particular order. the
+    // weights are accumulated in a dense per thread table, no string is
+    // hashed or copied. extended_query keeps the model snapshot its ids
+    // refer to. topic_dist may be NULL. method picks the inference of this
+    // query, see InferMethod
+    void ExtendQuery(const vector<string>& tokens, ExtendedQuery* extended_query,
+                     vector<TopicCountPair>* topic_dist, InferMethod method = INFER_DEFAULT)
+    {
+        Document& doc = *_doc.Get();
+        ModelPtr model = _infer.GetModel();
+        ExtendWorkspace* ws = _workspace.Get();
+        infer(model, tokens, method, ws, &doc);
+        build_extended_query(model, doc, ws, extended_query);
+        if (topic_dist != NULL)  get_topic_dist(doc, topic_dist);
+    }
+
+    // only the top_n words of the extended query, sorted by weight, the same
+    // weights ExtendQuery gives them. up to kTopNDenseWords words in the
+    // topic rows of the query, the rows are summed up in a plain dense array
+    // and the top_n selected from it, cheaper than the whole extended query.
+    // longer rows, which are sorted by p(w|z), are merged without random
+    // access (Fagin et al.): scanned to a growing depth until the rest of the
+    // rows can not change the top_n, then the top_n words are looked up for
+    // their exact weight, one binary search per topic each. topic_dist may
+    // be NULL, method as in ExtendQuery
+    void ExtendQueryTopN(const vector<string>& tokens, size_t top_n, ExtendedQuery* extended_query,
+                         vector<TopicCountPair>* topic_dist, InferMethod method = INFER_DEFAULT)
+    {
+        const Document& doc = extend_query_top_n(tokens, top_n, method, extended_query);
+        if (topic_dist != NULL)  get_topic_dist(doc, topic_dist);
+    }
+
+    // string form of the above
+    void ExtendQueryTopN(const vector<string>& tokens, size_t top_n, vector<WordProb>* extended_query,
+                         vector<TopicCountPair>* topic_dist, InferMethod method = INFER_DEFAULT)
+    {
+        ExtendedQuery& ids = _workspace.Get()->_extended_query;
+        ExtendQueryTopN(tokens, top_n, &ids, topic_dist, method);
+        extended_query->clear();
+        for (size_t i = 0; i < ids._words.size(); ++i)
+            extended_query->push_back(WordProb(GetWord(ids, ids._words[i].first), ids._words[i].second));
+        // don't pin the model in an idle thread across a reload
+        ids._model.reset();
+    }
+
+    // ExtendQueryTopN by word id, the topics as the renormalized top_k of the
+    // distribution, top_k 0 for all of them, see SparseTopicVector
+    void ExtendQueryTopN(const vector<string>& tokens, size_t top_n, ExtendedQuery* extended_query,
+                         size_t top_k, SparseTopicVector* topics, InferMethod method = INFER_DEFAULT)
+    {
+        extend_query_top_n(tokens, top_n, method, extended_query).GetTopics(top_k, topics);
+    }
+
+    // the inference alone, for the callers that keep the topics of a query
+    // or an item and not its extension. shares the cache of the extension
+    void InferTopics(const vector<string>& tokens, size_t top_k, SparseTopicVector* topics,
+                     InferMethod method = INFER_DEFAULT)
+    {
+        Document& doc = *_doc.Get();
+        ModelPtr model = _infer.GetModel();
+        infer(model, tokens, method, _workspace.Get(), &doc);
+        doc.GetTopics(top_k, topics);
+    }
+
+    // extends every query on the worker threads of pool, over the shared
+    // read-only model. each worker uses its own Document workspace and
+    // random stream. topic_dists gets the topics above 1e-4, may be NULL
+    void ExtendQueryBatch(const vector<vector<string> >& queries,
+                          vector<ExtendedQuery>* extended_queries,
+                          vector<vector<TopicCountPair> >* topic_dists,
+                          ThreadPool* pool)
+    {
+        extended_queries->resize(queries.size());
+        if (topic_dists != NULL)  topic_dists->resize(queries.size());
+        BatchTask task(this, queries, extended_queries, topic_dists);
+        pool->ParallelFor(queries.size(), &task);
+    }
+
+    // word of an id of extended_query, a pointer into the vocabulary of the
+    // model of extended_query for the known words
+    inline const char* GetWord(const ExtendedQuery& extended_query, int word_id, size_t* len) const
+    {
+        if (word_id < 0)
+        {
+            const string& word = extended_query._unknown_word[-1 - word_id];
+            *len = word.size();
+            return word.data();
+        }
+        return extended_query._model->GetModelData().GetWord(word_id, len);
+    }
+
+    // loads model_file in the calling thread and swaps it in, see
+    // LdaInfer::Reload(). the cached queries of the previous model are dropped
+    bool Reload(const string& model_file)
+    {
+        if (!_infer.Reload(model_file))  return false;
+        if (_cache != NULL)  _cache->Invalidate(_infer.GetModel());
+        return true;
+    }
+
+    inline string GetWord(const ExtendedQuery& extended_query, int word_id) const
+    {
+        size_t len;
+        const char* word = GetWord(extended_query, word_id, &len);
+        return string(word, len);
+    }
+
+    // sum_z p(z|d) p(w|z) * kTopicDistWeight over the topics of the document,
+    // plus the original query words, the previous content of extended_query
+    // is replaced. model is the one doc was inferred with
+    void build_extended_query(const ModelPtr& model, const Document& doc, ExtendWorkspace* ws,
+                              ExtendedQuery* extended_query)
     {
-        Document doc;
-        _infer.Infer(tokens, &doc);
-        build_extended_query(doc, extended_query);
-
-        cout<<"------ topic distribution -------"<<endl;
-        for (TopicCountDist::iterator iter = doc._accumulate_topic_dist.begin();
-             iter != doc._accumulate_topic_dist.end();
-             ++iter)
-            if (iter->second > 1e-4) cout<<iter->first<<":"<<iter->second<<endl;
-        cout<<"---------------------------------"<<endl;
-    }
-
-    void build_extended_query(Document& doc, unordered_map<string, double>* extended_query)
-    {
-        double topic_dist_weight = 0.5;
-        TopicCountDist& topic_dist = doc._accumulate_topic_dist;
-        // extend query
-        for (TopicCountDist::iterator iter = topic_dist.begin();
-             iter != topic_dist.end();
-             ++iter)
-        {
-            int topic_id = iter->first;
-            double prob_topic = iter->second;
-            if (prob_topic < 1e-4)  continue; // skip unlikely topic 
-            vector<WordProb>& one_topic = _topic2word[topic_id];
-            int topic_word_size = one_topic.size();
-            for (size_t i=0; i<topic_word_size; ++i)
+        const ModelData& model_data = model->GetModelData();
+        ws->Clear();
+        ws->Init(model_data.GetVocabNum());
+        DenseCounter& word_weight = ws->_word_weight;
+        const DenseCounter& topic_dist = doc._accumulate_topic_dist;
+        const vector<int>& topics = topic_dist.Keys();
+        for (size_t t = 0; t < topics.size(); ++t)
+        {
+            int topic_id = topics[t];
+            double prob_topic = topic_dist.Get(topic_id);
+            if (prob_topic < kMinTopicProb)  continue; // skip unlikely topic
+            const int* word;
+            ProbArray prob;
+            int size = model_data.GetTopicWords(topic_id, &word, &prob);
+            double weight = prob_topic * kTopicDistWeight;
+            for (int i = 0; i < size; ++i)
+                word_weight.Add(word[i], weight * prob[i]);
+        }
+
+        // the original query words, known words
+        double query_weight = original_word_weight(doc);
+        for (size_t i = 0; i < doc._document.size(); ++i)
+            word_weight.Add(doc._document[i], query_weight);
+
+        extended_query->Clear();
+        extended_query->_model = model;
+        const vector<int>& words = word_weight.Keys();
+        for (size_t i = 0; i < words.size(); ++i)
+            extended_query->_words.push_back(WordIdWeight(words[i], word_weight.Get(words[i])));
+        add_unknown_words(doc, query_weight, extended_query);
+    }
+
+    // string keyed form of the above, adds to extended_query
+    void build_extended_query(const ModelPtr& model, const Document& doc,
+                              unordered_map<string, double>* extended_query)
+    {
+        ExtendWorkspace* ws = _workspace.Get();
+        ExtendedQuery& ids = ws->_extended_query;
+        build_extended_query(model, doc, ws, &ids);
+        for (size_t i = 0; i < ids._words.size(); ++i)
+            IncreaseKeyCount(extended_query, GetWord(ids, ids._words[i].first), ids._words[i].second);
+        ids._model.reset();
+    }
+
+private:
+    template<typename KeyType>
+    struct WeightGreater
+    {
+        bool operator()(const pair<KeyType, double>& lhs, const pair<KeyType, double>& rhs) const
+        {
+            return lhs.second > rhs.second;
+        }
+    };
+
+    // infers tokens on model into doc, or restores doc from the cache if the
+    // same multiset of tokens was inferred on model with the same method
+    // before, ws->_cached then holds the entry. returns whether it came from
+    // the cache
+    bool infer(const ModelPtr& model, const vector<string>& tokens, InferMethod method,
+               ExtendWorkspace* ws, Document* doc)
+    {
+        method = _infer.GetMethod(tokens.size(), method);
+        if (_cache == NULL)
+        {
+            infer_document(*model, tokens, method, doc);
+            return false;
+        }
+        ExtendQueryCache::MakeKey(tokens, &ws->_cache_key);
+        // after the last '\0', a fold-in does not hit a sampled entry
+        if (method == INFER_FOLD_IN)  ws->_cache_key.push_back('F');
+        if (_cache->Lookup(ws->_cache_key, model, &ws->_cached))
+        {
+            _infer.Restore(*model, tokens, ws->_cached._topic_dist, doc);
+            return true;
+        }
+
+        infer_document(*model, tokens, method, doc);
+        CachedQuery& cached = ws->_cached;
+        cached._topic_dist.clear();
+        const vector<int>& topics = doc->_accumulate_topic_dist.Keys();
+        for (size_t i = 0; i < topics.size(); ++i)
+            cached._topic_dist.push_back(TopicCountPair(topics[i], doc->_accumulate_topic_dist.Get(topics[i])));
+        cached._top_n = 0;
+        cached._words.clear();
+        cached._unknown_word.clear();
+        _cache->Insert(ws->_cache_key, model, cached);
+        return false;
+    }
+
+    // ExtendQueryTopN, returns the Document of the query, a per thread
+    // workspace valid until the next query of the thread
+    const Document& extend_query_top_n(const vector<string>& tokens, size_t top_n, InferMethod method,
+                                       ExtendedQuery* extended_query)
+    {
+        Document& doc = *_doc.Get();
+        ModelPtr model = _infer.GetModel();
+        ExtendWorkspace& ws = *_workspace.Get();
+        bool cached = infer(model, tokens, method, &ws, &doc);
+        extended_query->Clear();
+        extended_query->_model = model;
+        if (top_n == 0)  return doc;
+        if (cached && ws._cached._top_n >= top_n)
+        {
+            // the first top_n of a longer list are the same words
+            extended_query->_words.assign(ws._cached._words.begin(),
+                                          ws._cached._words.begin() + min(top_n, ws._cached._words.size()));
+            extended_query->_unknown_word = ws._cached._unknown_word;
+            return doc;
+        }
+        build_extended_query_top_n(model, doc, top_n, &ws, extended_query);
+
+        if (_cache != NULL)
+        {
+            ws._cached._top_n = top_n;
+            ws._cached._words = extended_query->_words;
+            ws._cached._unknown_word = extended_query->_unknown_word;
+            _cache->Insert(ws._cache_key, model, ws._cached);
+        }
+        return doc;
+    }
+
+    // the top_n words of build_extended_query
+    void build_extended_query_top_n(const ModelPtr& model, const Document& doc, size_t top_n,
+                                    ExtendWorkspace* ws_ptr, ExtendedQuery* extended_query)
+    {
+        ExtendWorkspace& ws = *ws_ptr;
+        const ModelData& model_data = model->GetModelData();
+        ws.Clear();
+        ws.Init(model_data.GetVocabNum());
+        const vector<int>& topics = doc._accumulate_topic_dist.Keys();
+        for (size_t i = 0; i < topics.size(); ++i)
+        {
+            double prob_topic = doc._accumulate_topic_dist.Get(topics[i]);
+            if (prob_topic >= kMinTopicProb)
+                ws._topics.push_back(TopicCountPair(topics[i], prob_topic * kTopicDistWeight));
+        }
+
+        // the first top_n words of a row weigh at least the contribution of
+        // the last of them, the lighter words are never in the top_n
+        int num_words = 0;
+        double cutoff = 0.0;
+        for (size_t t = 0; t < ws._topics.size(); ++t)
+        {
+            const int* word;
+            ProbArray prob;
+            int size = model_data.GetTopicWords(ws._topics[t].first, &word, &prob);
+            num_words += size;
+            if (size >= static_cast<int>(top_n))
+                cutoff = max(cutoff, ws._topics[t].second * prob[top_n - 1]);
+        }
+        vector<pair<double, int> >& candidates = ws._candidates;
+        DenseCounter& partial = ws._word_weight;
+
+        // the short rows in full into a plain dense array, which costs
+        // less than the key bookkeeping of the DenseCounter. the sums are
+        // in the order of build_extended_query, so the weights are exact. a
+        // second pass over the rows collects the candidates and zeroes the
+        // array behind it. the query words keep their weight in partial
+        bool small = num_words <= kTopNDenseWords;
+        if (small)
+        {
+            vector<double>& score = ws._word_score;
+            for (size_t t = 0; t < ws._topics.size(); ++t)
             {
-                const string& word = one_topic[i].first;
-                double prob_topic2word = one_topic[i].second;
-                IncreaseKeyCount(extended_query, word, prob_topic * prob_topic2word * topic_dist_weight);
+                const int* word;
+                ProbArray prob;
+                int size = model_data.GetTopicWords(ws._topics[t].first, &word, &prob);
+                double weight = ws._topics[t].second;
+                for (int i = 0; i < size; ++i)
+                    score[word[i]] += weight * prob[i];
+            }
+            for (size_t i = 0; i < doc._document.size(); ++i)
+            {
+                int word_id = doc._document[i];
+                if (partial.Get(word_id) == 0.0)  partial.Add(word_id, score[word_id]);
+            }
+            for (size_t t = 0; t < ws._topics.size(); ++t)
+            {
+                const int* word;
+                ProbArray prob;
+                int size = model_data.GetTopicWords(ws._topics[t].first, &word, &prob);
+                for (int i = 0; i < size; ++i)
+                {
+                    double value = score[word[i]];
+                    if (value == 0.0)  continue;
+                    if (value >= cutoff)  candidates.push_back(make_pair(value, word[i]));
+                    score[word[i]] = 0.0;
+                }
+            }
+            if (candidates.size() > top_n)
+            {
+                nth_element(candidates.begin(), candidates.begin() + top_n - 1, candidates.end(),
+                            greater<pair<double, int> >());
+                candidates.resize(top_n);
             }
         }
 
-        // modify orignal query weight, known words
-        int sz = doc._string_document.size();
-        int doc_len = doc._string_document.size() + doc._unknown_word.size();
-        for (size_t i=0; i<sz; ++i)
+        // the long rows by blocks of doubling depth into the partial weights,
+        // a lower bound of the weight of every word. a word gets at most
+        // threshold more from the rows past the block, so once the top_n
+        // partial weights are above the next one plus threshold they are the
+        // top_n. every check is linear in the words read so far, as is the
+        // block before it
+        bool exact = small;
+        for (int begin = 0, end = max<int>(top_n, kTopNFirstDepth); !small; begin = end, end *= 2)
         {
-            const string& word = doc._string_document[i];
-            IncreaseKeyCount(extended_query, word, 1.0 / doc_len * (1-topic_dist_weight));
+            double threshold = 0.0;
+            for (size_t t = 0; t < ws._topics.size(); ++t)
+            {
+                const int* word;
+                ProbArray prob;
+                int size = model_data.GetTopicWords(ws._topics[t].first, &word, &prob);
+                double weight = ws._topics[t].second;
+                for (int i = begin; i < min(end, size); ++i)
+                    partial.Add(word[i], weight * prob[i]);
+                if (end < size)  threshold += weight * prob[end];
+            }
+            // the top_n + 1 largest partial weights above cutoff, descending
+            const vector<int>& keys = partial.Keys();
+            candidates.clear();
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                double value = partial.Get(keys[i]);
+                if (value >= cutoff)  candidates.push_back(make_pair(value, keys[i]));
+            }
+            if (candidates.size() > top_n + 1)
+            {
+                nth_element(candidates.begin(), candidates.begin() + top_n, candidates.end(),
+                            greater<pair<double, int> >());
+                candidates.resize(top_n + 1);
+            }
+            sort(candidates.begin(), candidates.end(), greater<pair<double, int> >());
+            // all the rows read
+            if (threshold == 0.0)
+            {
+                exact = begin == 0;
+                break;
+            }
+            if (candidates.size() < top_n)  continue;
+            double next = candidates.size() > top_n ? candidates[top_n].first : cutoff;
+            if (candidates[top_n - 1].first >= next + threshold)  break;
         }
-        // modify orignal query weight, known words
-        sz = doc._unknown_word.size();
-        for (size_t i=0; i<sz; ++i)
+        size_t num_candidates = min(top_n, candidates.size());
+
+        // the original query words, as in build_extended_query
+        vector<WordIdWeight>& words = extended_query->_words;
+        for (size_t i = 0; i < num_candidates; ++i)
         {
-            const string& word = doc._unknown_word[i];
-            IncreaseKeyCount(extended_query, word, 1.0 / doc_len * (1-topic_dist_weight));
+            int word_id = candidates[i].second;
+            words.push_back(WordIdWeight(word_id, exact ? candidates[i].first : topic_weight(*model, ws, word_id)));
         }
+        double query_weight = original_word_weight(doc);
+        for (size_t i = 0; i < doc._document.size(); ++i)
+        {
+            int word_id = doc._document[i];
+            size_t j = 0;
+            while (j < words.size() && words[j].first != word_id)  ++j;
+            if (j == words.size())
+                words.push_back(WordIdWeight(word_id, exact ? partial.Get(word_id) : topic_weight(*model, ws, word_id)));
+            words[j].second += query_weight;
+        }
+        add_unknown_words(doc, query_weight, extended_query);
+        size_t top = min(top_n, words.size());
+        partial_sort(words.begin(), words.begin() + top, words.end(), WeightGreater<int>());
+        words.resize(top);
     }
 
+    // one chain, or several for the long sampled queries, see SetChains()
+    void infer_document(const Model& model, const vector<string>& tokens, InferMethod method, Document* doc)
+    {
+        if (method == INFER_GIBBS && _chain_pool != NULL && tokens.size() >= _chain_min_tokens)
+            _infer.InferChains(model, tokens, _num_chains, _chain_pool, _chains.Get(), doc);
+        else
+            _infer.Infer(model, tokens, doc, method);
+    }
+
+    // weight of one occurrence of a query word
+    static inline double original_word_weight(const Document& doc)
+    {
+        int doc_len = doc._document.size() + doc._unknown_word.size();
+        return 1.0 / doc_len * (1 - kTopicDistWeight);
+    }
+
+    // the query words unseen by the model, appended after the known ones
+    static void add_unknown_words(const Document& doc, double query_weight, ExtendedQuery* extended_query)
+    {
+        vector<string>& unknown = extended_query->_unknown_word;
+        size_t base = extended_query->_words.size();
+        for (size_t i = 0; i < doc._unknown_word.size(); ++i)
+        {
+            size_t j = find(unknown.begin(), unknown.end(), doc._unknown_word[i]) - unknown.begin();
+            if (j == unknown.size())
+            {
+                unknown.push_back(doc._unknown_word[i]);
+                extended_query->_words.push_back(WordIdWeight(-1 - static_cast<int>(j), 0.0));
+            }
+            extended_query->_words[base + j].second += query_weight;
+        }
+    }
+
+    // sum_z p(z|d) p(w|z) * kTopicDistWeight over the topics of the query
+    inline double topic_weight(const Model& model, const ExtendWorkspace& ws, int word_id) const
+    {
+        double weight = 0.0;
+        for (size_t t = 0; t < ws._topics.size(); ++t)
+            weight += ws._topics[t].second * model.GetWordTopicProb(word_id, ws._topics[t].first);
+        return weight;
+    }
+
+    // topics above kMinTopicProb
+    void get_topic_dist(const Document& doc, vector<TopicCountPair>* topic_dist) const
+    {
+        topic_dist->clear();
+        const vector<int>& topics = doc._accumulate_topic_dist.Keys();
+        for (size_t i = 0; i < topics.size(); ++i)
+        {
+            double prob_topic = doc._accumulate_topic_dist.Get(topics[i]);
+            if (prob_topic > kMinTopicProb)  topic_dist->push_back(TopicCountPair(topics[i], prob_topic));
+        }
+    }
+
+    class BatchTask : public ParallelTask {
+    public:
+        BatchTask(LDAQueryExtend* extender, const vector<vector<string> >& queries,
+                  vector<ExtendedQuery>* extended_queries,
+                  vector<vector<TopicCountPair> >* topic_dists)
+        : _extender(extender), _queries(queries),
+          _extended_queries(extended_queries), _topic_dists(topic_dists) { }
+
+        virtual void Run(int index)
+        {
+            _extender->ExtendQuery(_queries[index], &(*_extended_queries)[index],
+                                   _topic_dists != NULL ? &(*_topic_dists)[index] : NULL);
+        }
+
+    private:
+        LDAQueryExtend* _extender;
+        const vector<vector<string> >& _queries;
+        vector<ExtendedQuery>* _extended_queries;
+        vector<vector<TopicCountPair> >* _topic_dists;
+    };
+
 private:
-    vector<vector<WordProb > > _topic2word; 
     LdaInfer _infer;
+    ThreadLocal<Document> _doc;
+    ThreadLocal<ExtendWorkspace> _workspace;
+    // NULL unless EnableCache()
+    ExtendQueryCache* _cache;
+    // multi-chain inference of the long queries, see SetChains()
+    int _num_chains;
+    size_t _chain_min_tokens;
+    ThreadPool* _chain_pool;
+    ThreadLocal<vector<Document> > _chains;
 };
 
 #endif
@@ -1,73 +1,374 @@
 #include "model.h"
+#include "blocking_queue.h"
+#include <errno.h>
+#include <fcntl.h>
 
+// batch query extension of a query log, file to file:
+//   reader thread -> num_threads inference threads -> writer (main thread)
+// the log is read in blocks of whole lines, each block is extended by one
+// inference thread and written back in input order. a fixed set of blocks
+// circulates between the stages, so the memory stays constant whatever the
+// size of the log, and the output is written a block at a time.
+//
+// output, one record per query line
+//   tsv: query \t word:weight word:weight ... \t topic:prob topic:prob ...\n
+//   bin: uint32 query_len, query, uint32 num_words,
+//        num_words * (uint32 word_len, word, float weight), then
+//        uint32 num_topics, num_topics * (int32 topic, float prob)
+//        or, with top_k_topics > 0, the top_k_topics topics as a
+//        SparseTopicVector of AppendTopicVector() (topic_vector.h)
+//        in host byte order, but for the SparseTopicVector
+// the tsv topics are the top_k_topics topics with top_k_topics > 0, the
+// topics above 1e-4 otherwise.
+// input_file and output_file may be - for stdin and stdout.
 
-struct cmper {
-    bool operator()(const pair<string, double>& lhs, const pair<string, double>& rhs)
-    {
-        return lhs.second > rhs.second;
-    }
+// bytes of input per block, the output of a block is about ten times larger
+static const size_t kBlockSize = 1 << 18;
+
+enum OutputFormat
+{
+    OUTPUT_TSV = 0,
+    OUTPUT_BINARY = 1
 };
 
+// a block of whole input lines and their output
+struct Batch
+{
+    uint64_t _seq;
+    string _input;
+    string _output;
+    size_t _lines;
+};
 
-#define rdtsc(low,high) __asm__ \
-    __volatile__("rdtsc" : "=a" (low), "=d" (high))
+struct Pipeline
+{
+    LDAQueryExtend* _extender;
+    size_t _top_n;
+    size_t _top_k_topics;             // 0 for the topics above 1e-4
+    OutputFormat _format;
+    int _input_fd;
+    BlockingQueue<Batch*>* _free;     // empty batches, the reader blocks on it
+    BlockingQueue<Batch*>* _todo;     // read, not extended yet
+    BlockingQueue<Batch*>* _done;     // extended, in any order
+    bool _read_error;
+};
 
-unsigned long long get_cycles()
+static inline void AppendUint32(uint32_t value, string* out)
 {
-    unsigned low, high;
-    unsigned long long val;
-    rdtsc(low,high);
-    val = high;
-    val = (val << 32) | low; //将 low 和 high 合成一个 64 位值
-    return val;
+    out->append(reinterpret_cast<const char*>(&value), sizeof(value));
 }
 
-double mhz = 2128.054 * 1000;  // 核的频率，在/proc/cpuinfo中找
+static inline void AppendFloat(float value, string* out)
+{
+    out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
 
+// same digits as the default ostream precision
+static inline void AppendNumber(double value, string* out)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%g", value);
+    out->append(buf, len);
+}
 
+// fills batches with kBlockSize bytes of whole lines, the partial last line
+// of a read moves on to the next batch
+static void* ReadInput(void* arg)
+{
+    Pipeline& pipeline = *static_cast<Pipeline*>(arg);
+    string carry;
+    uint64_t seq = 0;
+    bool eof = false;
+    while (!eof)
+    {
+        Batch* batch;
+        if (!pipeline._free->Pop(&batch))  break;
+        batch->_seq = seq++;
+        batch->_input.swap(carry);
+        carry.clear();
+        size_t last_line_end = string::npos;
+        while (batch->_input.size() < kBlockSize || last_line_end == string::npos)
+        {
+            size_t size = batch->_input.size();
+            batch->_input.resize(max(size + kBlockSize / 4, kBlockSize));
+            ssize_t n = read(pipeline._input_fd, &batch->_input[size], batch->_input.size() - size);
+            if (n < 0 && errno == EINTR)
+            {
+                batch->_input.resize(size);
+                continue;
+            }
+            if (n < 0)
+            {
+                LOG(ERROR)<<"read failed: "<<strerror(errno);
+                pipeline._read_error = true;
+            }
+            batch->_input.resize(size + max<ssize_t>(n, 0));
+            if (n <= 0)
+            {
+                eof = true;
+                break;
+            }
+            size_t pos = batch->_input.rfind('\n');
+            if (pos != string::npos && pos >= size)  last_line_end = pos;
+        }
+        if (!eof)
+        {
+            carry.assign(batch->_input, last_line_end + 1, string::npos);
+            batch->_input.resize(last_line_end + 1);
+        }
+        pipeline._todo->Push(batch);
+    }
+    pipeline._todo->Close();
+    return NULL;
+}
+
+static void FormatQuery(const Pipeline& pipeline, const char* query, size_t query_len,
+                        const ExtendedQuery& extended_query, const vector<TopicCountPair>& topic_dist,
+                        const SparseTopicVector& topics, string* out)
+{
+    const vector<WordIdWeight>& words = extended_query._words;
+    if (pipeline._format == OUTPUT_TSV)
+    {
+        out->append(query, query_len);
+        out->push_back('\t');
+        for (size_t i = 0; i < words.size(); ++i)
+        {
+            size_t len;
+            const char* word = pipeline._extender->GetWord(extended_query, words[i].first, &len);
+            if (i > 0)  out->push_back(' ');
+            out->append(word, len);
+            out->push_back(':');
+            AppendNumber(words[i].second, out);
+        }
+        out->push_back('\t');
+        if (pipeline._top_k_topics > 0)
+        {
+            for (size_t i = 0; i < topics.Size(); ++i)
+            {
+                if (i > 0)  out->push_back(' ');
+                AppendNumber(topics._topic[i], out);
+                out->push_back(':');
+                AppendNumber(topics._weight[i], out);
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < topic_dist.size(); ++i)
+            {
+                if (i > 0)  out->push_back(' ');
+                AppendNumber(topic_dist[i].first, out);
+                out->push_back(':');
+                AppendNumber(topic_dist[i].second, out);
+            }
+        }
+        out->push_back('\n');
+        return;
+    }
+
+    AppendUint32(query_len, out);
+    out->append(query, query_len);
+    AppendUint32(words.size(), out);
+    for (size_t i = 0; i < words.size(); ++i)
+    {
+        size_t len;
+        const char* word = pipeline._extender->GetWord(extended_query, words[i].first, &len);
+        AppendUint32(len, out);
+        out->append(word, len);
+        AppendFloat(words[i].second, out);
+    }
+    if (pipeline._top_k_topics > 0)
+    {
+        AppendTopicVector(topics, out);
+        return;
+    }
+    AppendUint32(topic_dist.size(), out);
+    for (size_t i = 0; i < topic_dist.size(); ++i)
+    {
+        AppendUint32(topic_dist[i].first, out);
+        AppendFloat(topic_dist[i].second, out);
+    }
+}
+
+// splits line at the spaces into tokens, reusing their strings
+static void SplitTokens(const char* line, size_t len, vector<string>* tokens)
+{
+    size_t num_tokens = 0;
+    size_t begin = 0;
+    while (begin < len)
+    {
+        size_t end = begin;
+        while (end < len && line[end] != ' ')  ++end;
+        if (end > begin)
+        {
+            if (num_tokens == tokens->size())  tokens->push_back(string());
+            (*tokens)[num_tokens++].assign(line + begin, end - begin);
+        }
+        begin = end + 1;
+    }
+    tokens->resize(num_tokens);
+}
+
+static void* ExtendQueries(void* arg)
+{
+    Pipeline& pipeline = *static_cast<Pipeline*>(arg);
+    vector<string> tokens;
+    ExtendedQuery extended_query;
+    vector<TopicCountPair> topic_dist;
+    SparseTopicVector topics;
+    Batch* batch;
+    while (pipeline._todo->Pop(&batch))
+    {
+        const string& input = batch->_input;
+        batch->_output.clear();
+        batch->_lines = 0;
+        size_t begin = 0;
+        while (begin < input.size())
+        {
+            size_t end = input.find('\n', begin);
+            if (end == string::npos)  end = input.size();
+            size_t len = end - begin;
+            if (len > 0 && input[begin + len - 1] == '\r')  --len;
+            SplitTokens(input.data() + begin, len, &tokens);
+            if (pipeline._top_k_topics > 0)
+                pipeline._extender->ExtendQueryTopN(tokens, pipeline._top_n, &extended_query,
+                                                    pipeline._top_k_topics, &topics);
+            else
+                pipeline._extender->ExtendQueryTopN(tokens, pipeline._top_n, &extended_query, &topic_dist);
+            FormatQuery(pipeline, input.data() + begin, len, extended_query, topic_dist, topics, &batch->_output);
+            ++batch->_lines;
+            begin = end + 1;
+        }
+        pipeline._done->Push(batch);
+    }
+    // don't keep the last model alive
+    extended_query._model.reset();
+    pipeline._done->Push(NULL);
+    return NULL;
+}
+
+static bool WriteAll(int fd, const string& buf)
+{
+    size_t pos = 0;
+    while (pos < buf.size())
+    {
+        ssize_t n = write(fd, buf.data() + pos, buf.size() - pos);
+        if (n < 0 && errno == EINTR)  continue;
+        if (n <= 0)  return false;
+        pos += n;
+    }
+    return true;
+}
 
 int main(int argc, char *argv[])
 {
     google::InitGoogleLogging(argv[0]);
     FLAGS_logtostderr = 1;
 
-    if (argc < 2)
+    if (argc < 5)
     {
-        cout<<"Usage: "<<argv[0]<<"model_file alpha input_file"<<endl;
+        cout<<"Usage: "<<argv[0]<<" model_file alpha input_file output_file [num_threads] [top_n] [tsv|bin] [top_k_topics]"<<endl;
         return 0;
     }
 
     string model_file = argv[1];
     double alpha = boost::lexical_cast<double>(argv[2]);
-    string file_name = argv[3];
+    string input_file = argv[3];
+    string output_file = argv[4];
+    int num_threads = argc > 5 ? boost::lexical_cast<int>(argv[5]) : 1;
+    size_t top_n = argc > 6 ? boost::lexical_cast<size_t>(argv[6]) : 100;
+    OutputFormat format = argc > 7 && string(argv[7]) == "bin" ? OUTPUT_BINARY : OUTPUT_TSV;
+    size_t top_k_topics = argc > 8 ? boost::lexical_cast<size_t>(argv[8]) : 0;
+    if (num_threads < 1)  num_threads = 1;
 
-    ifstream ifs(file_name.c_str());
-    string buf;
-    LDAQueryExtend lda_query_extender(model_file, alpha, 0.0, 10, 100); 
-    int n = 0;
-    while (getline(ifs, buf))
+    int input_fd = input_file == "-" ? 0 : open(input_file.c_str(), O_RDONLY);
+    if (input_fd < 0)
     {
-        if (n % 10 == 0)    cerr<<n<<endl;
-        n++;
-
-        cout<<buf<<endl;
-        vector<string> tokens;
-        boost::split(tokens, buf, boost::is_any_of(" "));
-        unordered_map<string, double> extended_query;
-
-        long long start, end;
-        start = get_cycles();
-        lda_query_extender.ExtendQuery(tokens, &extended_query); 
-        end = get_cycles();
-        double millisecond = (end - start) / mhz;
-        cout<<"-----------------------------"<<endl;
+        LOG(ERROR)<<"open "<<input_file<<" failed: "<<strerror(errno);
+        return 1;
     }
-    //cout<<"cost "<<millisecond<<" ms"<<endl;
-
-    //cout<<"------ extended query --------"<<endl;    
-    //vector<pair<string, double> > rst(extended_query.begin(), extended_query.end());
-    //sort(rst.begin(), rst.end(), cmper()); 
-    //cout<<rst<<endl;
-    
-    return 0;
+    int output_fd = output_file == "-" ? 1 : open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0)
+    {
+        LOG(ERROR)<<"open "<<output_file<<" failed: "<<strerror(errno);
+        return 1;
+    }
+    posix_fadvise(input_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    LDAQueryExtend lda_query_extender(model_file, alpha, 0.0, 10, 100);
+
+    // two blocks per inference thread keep every stage busy
+    size_t num_batches = 2 * num_threads + 2;
+    vector<Batch> batches(num_batches);
+    BlockingQueue<Batch*> free_batches(num_batches);
+    BlockingQueue<Batch*> todo(num_batches);
+    BlockingQueue<Batch*> done(num_batches + num_threads);
+    for (size_t i = 0; i < num_batches; ++i)
+        free_batches.Push(&batches[i]);
+
+    Pipeline pipeline;
+    pipeline._extender = &lda_query_extender;
+    pipeline._top_n = top_n;
+    pipeline._top_k_topics = top_k_topics;
+    pipeline._format = format;
+    pipeline._input_fd = input_fd;
+    pipeline._free = &free_batches;
+    pipeline._todo = &todo;
+    pipeline._done = &done;
+    pipeline._read_error = false;
+
+    uint64_t start = NowNs();
+    pthread_t reader;
+    pthread_create(&reader, NULL, &ReadInput, &pipeline);
+    vector<pthread_t> workers(num_threads);
+    for (int i = 0; i < num_threads; ++i)
+        pthread_create(&workers[i], NULL, &ExtendQueries, &pipeline);
+
+    // the writer, puts the batches back in input order
+    vector<Batch*> pending;
+    uint64_t next_seq = 0;
+    uint64_t num_lines = 0;
+    size_t num_running = num_threads;
+    bool write_error = false;
+    Batch* batch;
+    while (num_running > 0 || !pending.empty())
+    {
+        // a NULL batch is the end mark of one inference thread
+        if (!done.Pop(&batch))  break;
+        if (batch == NULL)
+        {
+            --num_running;
+            continue;
+        }
+        pending.push_back(batch);
+        for (size_t i = 0; i < pending.size(); )
+        {
+            if (pending[i]->_seq != next_seq)
+            {
+                ++i;
+                continue;
+            }
+            Batch* ready = pending[i];
+            if (!write_error && !WriteAll(output_fd, ready->_output))
+            {
+                LOG(ERROR)<<"write failed: "<<strerror(errno);
+                write_error = true;
+            }
+            num_lines += ready->_lines;
+            if (num_lines / 1000000 != (num_lines - ready->_lines) / 1000000)
+                LOG(INFO)<<num_lines<<" lines";
+            pending[i] = pending.back();
+            pending.pop_back();
+            free_batches.Push(ready);
+            ++next_seq;
+            i = 0;
+        }
+    }
+
+    pthread_join(reader, NULL);
+    for (int i = 0; i < num_threads; ++i)
+        pthread_join(workers[i], NULL);
+    if (output_fd != 1 && close(output_fd) != 0)  write_error = true;
+    double seconds = (NowNs() - start) * 1e-9;
+    LOG(INFO)<<num_lines<<" lines in "<<seconds<<" s, "<<(seconds > 0 ? num_lines / seconds : 0)<<" lines/s";
+    return pipeline._read_error || write_error ? 1 : 0;
 }
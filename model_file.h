@@ -0,0 +1,955 @@
+#ifndef MODEL_FILE_H_
+#define MODEL_FILE_H_
+
+#include <tr1/unordered_map>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "thread_pool.h"
+
+// Binary model file, converted offline from the text model.dat by
+// convert_model and mmap'ed read-only at startup, so that every process on
+// a box shares the same physical pages.
+//
+// layout (every section starts on an 8 byte boundary):
+//   ModelFileHeader
+//   double   topic_total[num_topic]      total word count of each topic
+//   uint32   word_offset[num_word + 1]   word->topic table in CSR form
+//   int32    word_topic[num_entry]       rows sorted by p(w|z), descending
+//   prob     word_prob[num_entry]        p(w|z)
+//   int32    word_order[num_entry]       positions in each word row, by topic
+//   uint32   topic_offset[num_topic + 1] topic->word table (the transpose)
+//   int32    topic_word[num_entry]       rows sorted by p(w|z), descending
+//   prob     topic_prob[num_entry]       p(w|z)
+//   uint32   vocab_offset[num_word + 1]  word id -> offset into vocab_arena
+//   uint32   vocab_sorted[num_word]      word ids ordered by word string
+//   char     vocab_arena[vocab_bytes]
+//   float    codebook[1 << prob_bits]    compact form only
+//
+// prob is a float, or in the compact form (prob_bits 16 or 8) a code of
+// log p(w|z) quantized over the range of the model, decoded by codebook.
+// the compact form also stores word_topic and word_order as uint16.
+// word_order gives the p(w|z) of any (word, topic) by a binary search over
+// the row, with no private copy of the model, see GetWordTopicProb().
+
+static const char kModelFileMagic[8] = {'L', 'D', 'A', 'M', 'O', 'D', 'E', 'L'};
+static const uint32_t kModelFileVersion = 5;
+// the topic ids of a text model are below, the topic arrays are sized by
+// the largest one so a corrupt id must not get through
+static const int kMaxTopicNum = 1 << 24;
+
+struct ModelFileHeader
+{
+    char _magic[8];
+    uint32_t _version;
+    uint32_t _num_topic;
+    uint32_t _num_word;
+    uint32_t _prob_bits;        // 32: float, 16 or 8: compact form
+    uint64_t _num_entry;
+    uint64_t _vocab_bytes;
+    uint64_t _file_size;
+};
+
+// p(w|z) of a table, floats or codes of the compact form
+class ProbArray {
+public:
+    ProbArray() : _data(NULL), _bits(32), _codebook(NULL) { }
+    ProbArray(const void* data, int bits, const float* codebook)
+    : _data(data), _bits(bits), _codebook(codebook) { }
+
+    inline float operator[](size_t i) const
+    {
+        if (_bits == 16)  return _codebook[static_cast<const uint16_t*>(_data)[i]];
+        if (_bits == 8)  return _codebook[static_cast<const uint8_t*>(_data)[i]];
+        return static_cast<const float*>(_data)[i];
+    }
+
+    inline ProbArray operator + (size_t offset) const
+    {
+        return ProbArray(static_cast<const char*>(_data) + offset * (_bits / 8), _bits, _codebook);
+    }
+
+    // the floats themselves, NULL for codes
+    inline const float* Floats() const
+    {
+        return _bits == 32 ? static_cast<const float*>(_data) : NULL;
+    }
+
+private:
+    const void* _data;
+    int _bits;
+    const float* _codebook;
+};
+
+// topic ids of the word->topic table, int32 or uint16 in the compact form
+class TopicIdArray {
+public:
+    TopicIdArray() : _data(NULL), _bits(32) { }
+    TopicIdArray(const void* data, int bits) : _data(data), _bits(bits) { }
+
+    inline int operator[](size_t i) const
+    {
+        if (_bits == 16)  return static_cast<const uint16_t*>(_data)[i];
+        return static_cast<const int*>(_data)[i];
+    }
+
+    inline TopicIdArray operator + (size_t offset) const
+    {
+        return TopicIdArray(static_cast<const char*>(_data) + offset * (_bits / 8), _bits);
+    }
+
+    // the int32 ids themselves, NULL for uint16
+    inline const int* Ints() const
+    {
+        return _bits == 32 ? static_cast<const int*>(_data) : NULL;
+    }
+
+private:
+    const void* _data;
+    int _bits;
+};
+
+// one row of the word->topic table: the topics of a word and p(w|z),
+// sorted by p(w|z) in descending order
+struct WordTopicRow
+{
+    TopicIdArray _topic;
+    ProbArray _prob;
+    int _size;
+
+    WordTopicRow() : _size(0) { }
+    WordTopicRow(const TopicIdArray& topic, const ProbArray& prob, int size)
+    : _topic(topic), _prob(prob), _size(size) { }
+};
+
+// The loaded model, shared read-only by all predictors (LdaInfer,
+// RtLdaPredictor, SparseLdaPredictor). p(w|z) is precomputed, so the inner
+// sampling loop is a linear scan over one word row.
+class ModelData {
+public:
+    ModelData() : _map_addr(NULL), _map_size(0) { Attach(NULL); }
+
+    ~ModelData() { Unmap(); }
+
+    static bool IsBinaryFile(const std::string& file_name)
+    {
+        std::ifstream ifs(file_name.c_str(), std::ios::binary);
+        char magic[sizeof(kModelFileMagic)];
+        if (!ifs.read(magic, sizeof(magic)))  return false;
+        return memcmp(magic, kModelFileMagic, sizeof(magic)) == 0;
+    }
+
+    // topic_id \t word:count \t word:count ...
+    // the file is split into line aligned chunks which are parsed on
+    // num_threads threads (0: one per cpu) and merged. the word ids follow
+    // the first appearance of the words in the file, as a sequential parse
+    bool LoadText(const std::string& model_file, int num_threads = 0)
+    {
+        int fd = open(model_file.c_str(), O_RDONLY);
+        if (fd < 0)  return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        if (st.st_size == 0)
+        {
+            close(fd);
+            Build(std::vector<WordRef>(), std::vector<Entry>(), NULL);
+            return true;
+        }
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)  return false;
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        bool ok = ParseText(static_cast<const char*>(addr), st.st_size, num_threads);
+        munmap(addr, st.st_size);
+        return ok;
+    }
+
+    bool Map(const std::string& model_file)
+    {
+        Unmap();
+        int fd = open(model_file.c_str(), O_RDONLY);
+        if (fd < 0)  return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(ModelFileHeader)))
+        {
+            close(fd);
+            return false;
+        }
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)  return false;
+
+        _map_addr = addr;
+        _map_size = st.st_size;
+        if (!Attach(static_cast<const char*>(addr), st.st_size))
+        {
+            Unmap();
+            return false;
+        }
+        madvise(addr, st.st_size, MADV_WILLNEED);
+        return true;
+    }
+
+    bool Save(const std::string& model_file) const
+    {
+        std::ofstream ofs(model_file.c_str(), std::ios::binary | std::ios::trunc);
+        ofs.write(reinterpret_cast<const char*>(_header), _header->_file_size);
+        return ofs.good();
+    }
+
+    // re-encodes the model in the compact form: the topic ids of the word
+    // rows as uint16, p(w|z) as prob_bits (16 or 8) bit codes of log p(w|z),
+    // spread evenly between the smallest and the largest p(w|z) of the
+    // model, code 0 is p = 0. the relative error of p(w|z) is at most
+    // half a step, e.g. about 1e-4 for 16 bits and 3% for 8 bits over a
+    // range of 1e-8 .. 1. false if the model is compact already or has more
+    // than 65536 topics
+    bool Compact(int prob_bits)
+    {
+        if ((prob_bits != 16 && prob_bits != 8) || _header->_prob_bits != 32
+            || _header->_num_topic > 65536)
+            return false;
+
+        const ModelFileHeader& old_header = *_header;
+        const char* old_base = reinterpret_cast<const char*>(_header);
+        Layout old_layout(old_header);
+        const float* word_prob = reinterpret_cast<const float*>(old_base + old_layout._word_prob);
+        const float* topic_prob = reinterpret_cast<const float*>(old_base + old_layout._topic_prob);
+        const int* word_topic = reinterpret_cast<const int*>(old_base + old_layout._word_topic);
+        const int* word_order = reinterpret_cast<const int*>(old_base + old_layout._word_order);
+
+        ModelFileHeader header = old_header;
+        header._prob_bits = prob_bits;
+        Layout layout(header);
+        header._file_size = layout._file_size;
+        std::vector<uint64_t> image(layout._file_size / sizeof(uint64_t), 0);
+        char* base = reinterpret_cast<char*>(&image[0]);
+        memcpy(base, &header, sizeof(header));
+        // the sections which keep their encoding
+        memcpy(base + layout._topic_total, old_base + old_layout._topic_total, sizeof(double) * header._num_topic);
+        memcpy(base + layout._word_offset, old_base + old_layout._word_offset,
+               sizeof(uint32_t) * (header._num_word + 1));
+        memcpy(base + layout._topic_offset, old_base + old_layout._topic_offset,
+               sizeof(uint32_t) * (header._num_topic + 1));
+        memcpy(base + layout._topic_word, old_base + old_layout._topic_word, sizeof(int32_t) * header._num_entry);
+        memcpy(base + layout._vocab_offset, old_base + old_layout._vocab_offset,
+               sizeof(uint32_t) * (header._num_word + 1));
+        memcpy(base + layout._vocab_sorted, old_base + old_layout._vocab_sorted, sizeof(uint32_t) * header._num_word);
+        memcpy(base + layout._vocab_arena, old_base + old_layout._vocab_arena, header._vocab_bytes);
+
+        double log_min = 0.0, log_max = 0.0;
+        bool first = true;
+        for (uint64_t i = 0; i < header._num_entry; ++i)
+        {
+            if (word_prob[i] <= 0)  continue;
+            double log_prob = log(word_prob[i]);
+            if (first || log_prob < log_min)  log_min = log_prob;
+            if (first || log_prob > log_max)  log_max = log_prob;
+            first = false;
+        }
+        uint32_t max_code = (1u << prob_bits) - 1;
+        double step = (log_max - log_min) / (max_code - 1);
+        float* codebook = reinterpret_cast<float*>(base + layout._codebook);
+        codebook[0] = 0.0f;
+        for (uint32_t code = 1; code <= max_code; ++code)
+            codebook[code] = exp(log_min + (code - 1) * step);
+
+        uint16_t* topic16 = reinterpret_cast<uint16_t*>(base + layout._word_topic);
+        uint16_t* order16 = reinterpret_cast<uint16_t*>(base + layout._word_order);
+        for (uint64_t i = 0; i < header._num_entry; ++i)
+        {
+            topic16[i] = word_topic[i];
+            order16[i] = word_order[i];
+            uint32_t word_code = EncodeProb(word_prob[i], log_min, step, max_code);
+            uint32_t topic_code = EncodeProb(topic_prob[i], log_min, step, max_code);
+            if (prob_bits == 16)
+            {
+                reinterpret_cast<uint16_t*>(base + layout._word_prob)[i] = word_code;
+                reinterpret_cast<uint16_t*>(base + layout._topic_prob)[i] = topic_code;
+            }
+            else
+            {
+                reinterpret_cast<uint8_t*>(base + layout._word_prob)[i] = word_code;
+                reinterpret_cast<uint8_t*>(base + layout._topic_prob)[i] = topic_code;
+            }
+        }
+
+        Unmap();
+        _image.swap(image);
+        return Attach(reinterpret_cast<const char*>(&_image[0]), layout._file_size);
+    }
+
+    inline bool IsMapped() const { return _map_addr != NULL; }
+
+    inline int GetTopicNum() const { return _header->_num_topic; }
+
+    inline int GetVocabNum() const { return _header->_num_word; }
+
+    inline uint64_t GetEntryNum() const { return _header->_num_entry; }
+
+    // 32 for float p(w|z), 16 or 8 for the compact form
+    inline int GetProbBits() const { return _header->_prob_bits; }
+
+    // size of the file image, i.e. the memory the model takes
+    inline uint64_t GetByteSize() const { return _header->_file_size; }
+
+    inline double GetTopicTotalCount(int topic_id) const { return _topic_total[topic_id]; }
+
+    inline WordTopicRow GetWordTopicRow(int word_id) const
+    {
+        uint32_t begin = _word_offset[word_id];
+        return WordTopicRow(_word_topic + begin, _word_prob + begin,
+                            static_cast<int>(_word_offset[word_id + 1] - begin));
+    }
+
+    // p(w|z) of any topic, 0 if the topic is not in the row of the word: a
+    // binary search over the row in topic order, through word_order
+    inline float GetWordTopicProb(int word_id, int topic_id) const
+    {
+        uint32_t begin = _word_offset[word_id];
+        int lo = 0, hi = static_cast<int>(_word_offset[word_id + 1] - begin);
+        while (lo < hi)
+        {
+            int mid = lo + (hi - lo) / 2;
+            int pos = begin + _word_order[begin + mid];
+            int topic = _word_topic[pos];
+            if (topic == topic_id)  return _word_prob[pos];
+            if (topic < topic_id)  lo = mid + 1;
+            else  hi = mid;
+        }
+        return 0.0f;
+    }
+
+    // words of one topic and their p(w|z), sorted by p(w|z) in descending order
+    inline int GetTopicWords(int topic_id, const int** word, ProbArray* prob) const
+    {
+        uint32_t begin = _topic_offset[topic_id];
+        *word = _topic_word + begin;
+        *prob = _topic_prob + begin;
+        return _topic_offset[topic_id + 1] - begin;
+    }
+
+    inline const char* GetWord(int word_id, size_t* len) const
+    {
+        *len = _vocab_offset[word_id + 1] - _vocab_offset[word_id];
+        return _vocab_arena + _vocab_offset[word_id];
+    }
+
+    inline std::string GetWord(int word_id) const
+    {
+        size_t len;
+        const char* word = GetWord(word_id, &len);
+        return std::string(word, len);
+    }
+
+    // word id of the given word, -1 if unseen by the model
+    int GetWordId(const char* word, size_t len) const
+    {
+        int lo = 0, hi = _header->_num_word;
+        while (lo < hi)
+        {
+            int mid = lo + (hi - lo) / 2;
+            size_t mid_len;
+            const char* mid_word = GetWord(_vocab_sorted[mid], &mid_len);
+            int cmp = Compare(mid_word, mid_len, word, len);
+            if (cmp == 0)  return _vocab_sorted[mid];
+            if (cmp < 0)  lo = mid + 1;
+            else  hi = mid;
+        }
+        return -1;
+    }
+
+    inline int GetWordId(const std::string& word) const
+    {
+        return GetWordId(word.data(), word.size());
+    }
+
+    // a model of the given words only, rows[i] the p(w|z) of words[i] as in
+    // a larger model whose topics total topic_total: a shard of a model
+    // split by word, or the rows of the words of one query fetched from the
+    // shards. the words are distinct, the rows may be in any order
+    void BuildFromRows(const std::vector<std::string>& words, const std::vector<WordTopicRow>& rows,
+                       const std::vector<double>& topic_total)
+    {
+        std::vector<WordRef> refs(words.size());
+        std::vector<Entry> entries;
+        for (size_t i = 0; i < words.size(); ++i)
+        {
+            refs[i]._data = words[i].data();
+            refs[i]._size = words[i].size();
+            for (int j = 0; j < rows[i]._size; ++j)
+            {
+                Entry entry = { static_cast<int>(i), rows[i]._topic[j], rows[i]._prob[j] };
+                entries.push_back(entry);
+            }
+        }
+        Build(refs, entries, NULL, &topic_total);
+    }
+
+private:
+    struct Entry
+    {
+        int _word;
+        int _topic;
+        float _count;
+    };
+
+    struct Layout
+    {
+        uint64_t _topic_total;
+        uint64_t _word_offset;
+        uint64_t _word_topic;
+        uint64_t _word_prob;
+        uint64_t _word_order;
+        uint64_t _topic_offset;
+        uint64_t _topic_word;
+        uint64_t _topic_prob;
+        uint64_t _vocab_offset;
+        uint64_t _vocab_sorted;
+        uint64_t _vocab_arena;
+        uint64_t _codebook;
+        uint64_t _file_size;
+
+        Layout(const ModelFileHeader& h)
+        {
+            uint64_t pos = Align(sizeof(ModelFileHeader));
+            _topic_total = pos;  pos = Align(pos + sizeof(double) * h._num_topic);
+            _word_offset = pos;  pos = Align(pos + sizeof(uint32_t) * (h._num_word + 1));
+            uint64_t id_bytes = h._prob_bits == 32 ? sizeof(int32_t) : sizeof(uint16_t);
+            uint64_t prob_bytes = h._prob_bits / 8;
+            _word_topic = pos;   pos = Align(pos + id_bytes * h._num_entry);
+            _word_prob = pos;    pos = Align(pos + prob_bytes * h._num_entry);
+            _word_order = pos;   pos = Align(pos + id_bytes * h._num_entry);
+            _topic_offset = pos; pos = Align(pos + sizeof(uint32_t) * (h._num_topic + 1));
+            _topic_word = pos;   pos = Align(pos + sizeof(int32_t) * h._num_entry);
+            _topic_prob = pos;   pos = Align(pos + prob_bytes * h._num_entry);
+            _vocab_offset = pos; pos = Align(pos + sizeof(uint32_t) * (h._num_word + 1));
+            _vocab_sorted = pos; pos = Align(pos + sizeof(uint32_t) * h._num_word);
+            _vocab_arena = pos;  pos = Align(pos + h._vocab_bytes);
+            _codebook = pos;     pos = Align(pos + (h._prob_bits == 32 ? 0 : sizeof(float) << h._prob_bits));
+            _file_size = pos;
+        }
+
+        static inline uint64_t Align(uint64_t pos) { return (pos + 7) & ~static_cast<uint64_t>(7); }
+    };
+
+    struct WordLess
+    {
+        const ModelData* _data;
+        explicit WordLess(const ModelData* data) : _data(data) { }
+        bool operator()(uint32_t lhs, uint32_t rhs) const
+        {
+            size_t lhs_len, rhs_len;
+            const char* lhs_word = _data->GetWord(lhs, &lhs_len);
+            const char* rhs_word = _data->GetWord(rhs, &rhs_len);
+            return Compare(lhs_word, lhs_len, rhs_word, rhs_len) < 0;
+        }
+    };
+
+    // positions of a row by the id at the position
+    struct IdLess
+    {
+        const int* _id;
+        explicit IdLess(const int* id) : _id(id) { }
+        bool operator()(int lhs, int rhs) const
+        {
+            return _id[lhs] < _id[rhs];
+        }
+    };
+
+    struct ProbGreater
+    {
+        const int* _id;
+        const float* _prob;
+        ProbGreater(const int* id, const float* prob) : _id(id), _prob(prob) { }
+        bool operator()(uint32_t lhs, uint32_t rhs) const
+        {
+            if (_prob[lhs] != _prob[rhs])  return _prob[lhs] > _prob[rhs];
+            return _id[lhs] < _id[rhs];
+        }
+    };
+
+    static inline int Compare(const char* lhs, size_t lhs_len, const char* rhs, size_t rhs_len)
+    {
+        int cmp = memcmp(lhs, rhs, std::min(lhs_len, rhs_len));
+        if (cmp != 0)  return cmp;
+        return lhs_len < rhs_len ? -1 : (lhs_len > rhs_len ? 1 : 0);
+    }
+
+    // a word inside the text being parsed, not owned
+    struct WordRef
+    {
+        const char* _data;
+        uint32_t _size;
+
+        bool operator == (const WordRef& rhs) const
+        {
+            return _size == rhs._size && memcmp(_data, rhs._data, _size) == 0;
+        }
+    };
+
+    // FNV-1a
+    struct WordRefHash
+    {
+        size_t operator()(const WordRef& word) const
+        {
+            uint32_t hash = 2166136261u;
+            for (uint32_t i = 0; i < word._size; ++i)
+                hash = (hash ^ static_cast<unsigned char>(word._data[i])) * 16777619u;
+            return hash;
+        }
+    };
+
+    typedef std::tr1::unordered_map<WordRef, int, WordRefHash> WordRefIndex;
+
+    // one line aligned piece of the text model, the word ids of _entries
+    // are local to the chunk until the merge
+    struct TextChunk
+    {
+        const char* _begin;
+        const char* _end;
+        bool _ok;
+        WordRefIndex _word2id;
+        std::vector<WordRef> _words;
+        std::vector<int> _global_id;
+        std::vector<Entry> _entries;
+    };
+
+    class ParseTask : public ParallelTask {
+    public:
+        explicit ParseTask(std::vector<TextChunk>* chunks) : _chunks(chunks) { }
+        virtual void Run(int index)
+        {
+            TextChunk& chunk = (*_chunks)[index];
+            chunk._ok = ParseChunk(&chunk);
+        }
+    private:
+        std::vector<TextChunk>* _chunks;
+    };
+
+    class RemapTask : public ParallelTask {
+    public:
+        explicit RemapTask(std::vector<TextChunk>* chunks) : _chunks(chunks) { }
+        virtual void Run(int index)
+        {
+            TextChunk& chunk = (*_chunks)[index];
+            for (size_t i = 0; i < chunk._entries.size(); ++i)
+                chunk._entries[i]._word = chunk._global_id[chunk._entries[i]._word];
+        }
+    private:
+        std::vector<TextChunk>* _chunks;
+    };
+
+    bool ParseText(const char* text, size_t size, int num_threads)
+    {
+        // below this a chunk is not worth a task
+        static const size_t kMinChunkBytes = 1 << 20;
+        if (num_threads <= 0)  num_threads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+        // a few chunks per thread even out the uneven lines
+        size_t num_chunk = std::min<size_t>(num_threads * 4, size / kMinChunkBytes + 1);
+        const char* end = text + size;
+        std::vector<TextChunk> chunks(num_chunk);
+        const char* pos = text;
+        for (size_t i = 0; i < num_chunk; ++i)
+        {
+            const char* chunk_end = end;
+            if (i + 1 < num_chunk)
+            {
+                chunk_end = std::max(pos, text + size / num_chunk * (i + 1));
+                const char* newline = static_cast<const char*>(memchr(chunk_end, '\n', end - chunk_end));
+                chunk_end = newline == NULL ? end : newline + 1;
+            }
+            chunks[i]._begin = pos;
+            chunks[i]._end = chunk_end;
+            pos = chunk_end;
+        }
+
+        ThreadPool pool(std::min<size_t>(num_threads, num_chunk));
+        ParseTask parse_task(&chunks);
+        pool.ParallelFor(num_chunk, &parse_task);
+
+        // global ids in chunk order, then first appearance in the chunk
+        WordRefIndex word2id;
+        std::vector<WordRef> words;
+        size_t num_entry = 0;
+        for (size_t c = 0; c < num_chunk; ++c)
+        {
+            TextChunk& chunk = chunks[c];
+            if (!chunk._ok)  return false;
+            chunk._global_id.resize(chunk._words.size());
+            for (size_t i = 0; i < chunk._words.size(); ++i)
+            {
+                std::pair<WordRefIndex::iterator, bool> inserted
+                    = word2id.insert(std::make_pair(chunk._words[i], static_cast<int>(words.size())));
+                if (inserted.second)  words.push_back(chunk._words[i]);
+                chunk._global_id[i] = inserted.first->second;
+            }
+            WordRefIndex().swap(chunk._word2id);
+            num_entry += chunk._entries.size();
+        }
+        RemapTask remap_task(&chunks);
+        pool.ParallelFor(num_chunk, &remap_task);
+
+        std::vector<Entry> entries;
+        entries.reserve(num_entry);
+        for (size_t c = 0; c < num_chunk; ++c)
+        {
+            entries.insert(entries.end(), chunks[c]._entries.begin(), chunks[c]._entries.end());
+            std::vector<Entry>().swap(chunks[c]._entries);
+        }
+        Build(words, entries, &pool);
+        return true;
+    }
+
+    static bool ParseChunk(TextChunk* chunk)
+    {
+        const char* pos = chunk->_begin;
+        while (pos < chunk->_end)
+        {
+            const char* line_end = static_cast<const char*>(memchr(pos, '\n', chunk->_end - pos));
+            if (line_end == NULL)  line_end = chunk->_end;
+            if (!ParseLine(pos, line_end, chunk))  return false;
+            pos = line_end + 1;
+        }
+        return true;
+    }
+
+    // one topic line, no allocation besides the growth of the chunk tables
+    static bool ParseLine(const char* pos, const char* end, TextChunk* chunk)
+    {
+        pos = SkipSpace(pos, end);
+        if (pos == end)  return true;
+
+        // digits only, so no negative id
+        int topic_id = 0;
+        const char* digit = pos;
+        while (pos < end && *pos >= '0' && *pos <= '9')
+        {
+            topic_id = topic_id * 10 + (*pos++ - '0');
+            if (topic_id >= kMaxTopicNum)  return false;
+        }
+        if (pos == digit || (pos < end && !IsSpace(*pos)))  return false;
+
+        while ((pos = SkipSpace(pos, end)) < end)
+        {
+            const char* item_end = pos;
+            while (item_end < end && !IsSpace(*item_end))  ++item_end;
+            const char* colon = static_cast<const char*>(memchr(pos, ':', item_end - pos));
+            if (colon == NULL || memchr(colon + 1, ':', item_end - colon - 1) != NULL)  return false;
+            float count;
+            if (!ParseFloat(colon + 1, item_end, &count))  return false;
+
+            WordRef word = { pos, static_cast<uint32_t>(colon - pos) };
+            std::pair<WordRefIndex::iterator, bool> inserted
+                = chunk->_word2id.insert(std::make_pair(word, static_cast<int>(chunk->_words.size())));
+            if (inserted.second)  chunk->_words.push_back(word);
+            Entry entry = { inserted.first->second, topic_id, count };
+            chunk->_entries.push_back(entry);
+            pos = item_end;
+        }
+        return true;
+    }
+
+    static inline bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+    }
+
+    static inline const char* SkipSpace(const char* pos, const char* end)
+    {
+        while (pos < end && IsSpace(*pos))  ++pos;
+        return pos;
+    }
+
+    // [+-]digits[.digits][e[+-]digits], the whole of [pos, end)
+    static bool ParseFloat(const char* pos, const char* end, float* value)
+    {
+        bool negative = false;
+        if (pos < end && (*pos == '+' || *pos == '-'))  negative = *pos++ == '-';
+        double mantissa = 0.0;
+        int digits = 0, exponent = 0;
+        for (; pos < end && *pos >= '0' && *pos <= '9'; ++pos, ++digits)
+            mantissa = mantissa * 10 + (*pos - '0');
+        if (pos < end && *pos == '.')
+        {
+            for (++pos; pos < end && *pos >= '0' && *pos <= '9'; ++pos, ++digits, --exponent)
+                mantissa = mantissa * 10 + (*pos - '0');
+        }
+        if (digits == 0)  return false;
+        if (pos < end && (*pos == 'e' || *pos == 'E'))
+        {
+            ++pos;
+            bool exp_negative = false;
+            if (pos < end && (*pos == '+' || *pos == '-'))  exp_negative = *pos++ == '-';
+            int exp = 0;
+            const char* exp_digit = pos;
+            for (; pos < end && *pos >= '0' && *pos <= '9'; ++pos)
+                exp = std::min(exp * 10 + (*pos - '0'), 1000);
+            if (pos == exp_digit)  return false;
+            exponent += exp_negative ? -exp : exp;
+        }
+        if (pos != end)  return false;
+        // dividing by an exact power of ten rounds better than multiplying by its inverse
+        if (exponent < 0)  mantissa /= pow(10.0, -exponent);
+        else if (exponent > 0)  mantissa *= pow(10.0, exponent);
+        *value = static_cast<float>(negative ? -mantissa : mantissa);
+        return true;
+    }
+
+    // nearest code of prob in the codebook of Compact(), monotonic in prob
+    static inline uint32_t EncodeProb(float prob, double log_min, double step, uint32_t max_code)
+    {
+        if (prob <= 0)  return 0;
+        if (step <= 0)  return 1;
+        double code = 1 + floor((log(prob) - log_min) / step + 0.5);
+        return static_cast<uint32_t>(std::max(1.0, std::min(code, static_cast<double>(max_code))));
+    }
+
+    template<typename T>
+    inline T* Section(uint64_t offset) { return reinterpret_cast<T*>(reinterpret_cast<char*>(&_image[0]) + offset); }
+
+    // build the file image in memory, the same bytes Save() writes out. the
+    // rows are sorted on the threads of pool, if not NULL. the _count of the
+    // entries are the p(w|z) themselves if topic_total, the totals of the
+    // topics over the whole model, is given
+    void Build(const std::vector<WordRef>& words, const std::vector<Entry>& entries, ThreadPool* pool,
+               const std::vector<double>* topic_total_of_model = NULL)
+    {
+        Unmap();
+        ModelFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header._magic, kModelFileMagic, sizeof(kModelFileMagic));
+        header._version = kModelFileVersion;
+        header._prob_bits = 32;
+        header._num_word = words.size();
+        header._num_entry = entries.size();
+        for (size_t i = 0; i < words.size(); ++i)
+            header._vocab_bytes += words[i]._size;
+        for (size_t i = 0; i < entries.size(); ++i)
+            header._num_topic = std::max<uint32_t>(header._num_topic, entries[i]._topic + 1);
+        if (topic_total_of_model != NULL)
+            header._num_topic = std::max<uint32_t>(header._num_topic, topic_total_of_model->size());
+
+        Layout layout(header);
+        header._file_size = layout._file_size;
+        _image.assign(layout._file_size / sizeof(uint64_t), 0);
+        memcpy(&_image[0], &header, sizeof(header));
+
+        double* topic_total = Section<double>(layout._topic_total);
+        uint32_t* word_offset = Section<uint32_t>(layout._word_offset);
+        int* word_topic = Section<int>(layout._word_topic);
+        float* word_prob = Section<float>(layout._word_prob);
+        int* word_order = Section<int>(layout._word_order);
+        uint32_t* topic_offset = Section<uint32_t>(layout._topic_offset);
+        int* topic_word = Section<int>(layout._topic_word);
+        float* topic_prob = Section<float>(layout._topic_prob);
+        uint32_t* vocab_offset = Section<uint32_t>(layout._vocab_offset);
+        uint32_t* vocab_sorted = Section<uint32_t>(layout._vocab_sorted);
+        char* vocab_arena = Section<char>(layout._vocab_arena);
+
+        // counting sort of the entries into word rows and topic rows
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            ++word_offset[entries[i]._word + 1];
+            ++topic_offset[entries[i]._topic + 1];
+            if (topic_total_of_model == NULL)  topic_total[entries[i]._topic] += entries[i]._count;
+        }
+        if (topic_total_of_model != NULL)
+            std::copy(topic_total_of_model->begin(), topic_total_of_model->end(), topic_total);
+        for (uint32_t i = 0; i < header._num_word; ++i)
+            word_offset[i + 1] += word_offset[i];
+        for (uint32_t i = 0; i < header._num_topic; ++i)
+            topic_offset[i + 1] += topic_offset[i];
+
+        std::vector<uint32_t> word_pos(word_offset, word_offset + header._num_word);
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            uint32_t pos = word_pos[entries[i]._word]++;
+            word_topic[pos] = entries[i]._topic;
+            word_prob[pos] = topic_total_of_model != NULL ? entries[i]._count
+                                                          : entries[i]._count / topic_total[entries[i]._topic];
+        }
+        SortRowsByProb(word_offset, header._num_word, word_topic, word_prob, word_order, pool);
+
+        std::vector<uint32_t> topic_pos(topic_offset, topic_offset + header._num_topic);
+        for (uint32_t word_id = 0; word_id < header._num_word; ++word_id)
+        {
+            for (uint32_t i = word_offset[word_id]; i < word_offset[word_id + 1]; ++i)
+            {
+                int topic_id = word_topic[i];
+                uint32_t pos = topic_pos[topic_id]++;
+                topic_word[pos] = word_id;
+                topic_prob[pos] = word_prob[i];
+            }
+        }
+        SortRowsByProb(topic_offset, header._num_topic, topic_word, topic_prob, NULL, pool);
+
+        for (uint32_t i = 0; i < header._num_word; ++i)
+        {
+            memcpy(vocab_arena + vocab_offset[i], words[i]._data, words[i]._size);
+            vocab_offset[i + 1] = vocab_offset[i] + words[i]._size;
+            vocab_sorted[i] = i;
+        }
+
+        Attach(reinterpret_cast<const char*>(&_image[0]), layout._file_size);
+        std::sort(vocab_sorted, vocab_sorted + header._num_word, WordLess(this));
+    }
+
+    // sorts rows [begin_row, end_row) of a CSR table by prob, descending, ties
+    // by id. order_by_id, if not NULL, gets the positions in each row by id
+    static void SortRowsByProb(const uint32_t* offset, uint32_t begin_row, uint32_t end_row, int* id, float* prob,
+                               int* order_by_id)
+    {
+        std::vector<uint32_t> order;
+        std::vector<int> row_id;
+        std::vector<float> row_prob;
+        for (uint32_t r = begin_row; r < end_row; ++r)
+        {
+            uint32_t begin = offset[r], end = offset[r + 1];
+            order.resize(end - begin);
+            for (uint32_t i = 0; i < order.size(); ++i)  order[i] = begin + i;
+            std::sort(order.begin(), order.end(), ProbGreater(id, prob));
+            row_id.resize(order.size());
+            row_prob.resize(order.size());
+            for (uint32_t i = 0; i < order.size(); ++i)
+            {
+                row_id[i] = id[order[i]];
+                row_prob[i] = prob[order[i]];
+            }
+            std::copy(row_id.begin(), row_id.end(), id + begin);
+            std::copy(row_prob.begin(), row_prob.end(), prob + begin);
+            if (order_by_id == NULL)  continue;
+            for (uint32_t i = 0; i < order.size(); ++i)  order_by_id[begin + i] = i;
+            std::sort(order_by_id + begin, order_by_id + end, IdLess(id + begin));
+        }
+    }
+
+    class SortRowsTask : public ParallelTask {
+    public:
+        SortRowsTask(const uint32_t* offset, uint32_t num_row, int* id, float* prob, int* order_by_id,
+                     int num_block)
+        : _offset(offset), _num_row(num_row), _id(id), _prob(prob), _order_by_id(order_by_id),
+          _num_block(num_block) { }
+        virtual void Run(int index)
+        {
+            SortRowsByProb(_offset, static_cast<uint64_t>(_num_row) * index / _num_block,
+                           static_cast<uint64_t>(_num_row) * (index + 1) / _num_block, _id, _prob, _order_by_id);
+        }
+    private:
+        const uint32_t* _offset;
+        uint32_t _num_row;
+        int* _id;
+        float* _prob;
+        int* _order_by_id;
+        int _num_block;
+    };
+
+    // all rows, in blocks on the threads of pool if not NULL
+    static void SortRowsByProb(const uint32_t* offset, uint32_t num_row, int* id, float* prob, int* order_by_id,
+                               ThreadPool* pool)
+    {
+        if (pool == NULL)
+        {
+            SortRowsByProb(offset, 0, num_row, id, prob, order_by_id);
+            return;
+        }
+        int num_block = pool->Size() * 4;
+        SortRowsTask task(offset, num_row, id, prob, order_by_id, num_block);
+        pool->ParallelFor(num_block, &task);
+    }
+
+    // point the section pointers at a file image, NULL attaches an empty model
+    bool Attach(const char* base, size_t size = 0)
+    {
+        static const ModelFileHeader empty_header = ModelFileHeader();
+        static const uint32_t zero_offset = 0;
+        if (base == NULL)
+        {
+            _header = &empty_header;
+            _topic_total = NULL;
+            _word_offset = _topic_offset = _vocab_offset = &zero_offset;
+            _word_topic = _word_order = TopicIdArray();
+            _topic_word = NULL;
+            _word_prob = _topic_prob = ProbArray();
+            _vocab_sorted = NULL;
+            _vocab_arena = NULL;
+            return true;
+        }
+
+        const ModelFileHeader* header = reinterpret_cast<const ModelFileHeader*>(base);
+        if (memcmp(header->_magic, kModelFileMagic, sizeof(kModelFileMagic)) != 0
+            || header->_version != kModelFileVersion)
+            return false;
+        int bits = header->_prob_bits;
+        if (bits != 32 && bits != 16 && bits != 8)  return false;
+        Layout layout(*header);
+        if (header->_file_size != layout._file_size || size < layout._file_size)
+            return false;
+
+        _header = header;
+        _topic_total = reinterpret_cast<const double*>(base + layout._topic_total);
+        _word_offset = reinterpret_cast<const uint32_t*>(base + layout._word_offset);
+        const float* codebook = reinterpret_cast<const float*>(base + layout._codebook);
+        _word_topic = TopicIdArray(base + layout._word_topic, bits == 32 ? 32 : 16);
+        _word_prob = ProbArray(base + layout._word_prob, bits, codebook);
+        _word_order = TopicIdArray(base + layout._word_order, bits == 32 ? 32 : 16);
+        _topic_offset = reinterpret_cast<const uint32_t*>(base + layout._topic_offset);
+        _topic_word = reinterpret_cast<const int*>(base + layout._topic_word);
+        _topic_prob = ProbArray(base + layout._topic_prob, bits, codebook);
+        _vocab_offset = reinterpret_cast<const uint32_t*>(base + layout._vocab_offset);
+        _vocab_sorted = reinterpret_cast<const uint32_t*>(base + layout._vocab_sorted);
+        _vocab_arena = base + layout._vocab_arena;
+        return _word_offset[header->_num_word] == header->_num_entry
+            && _topic_offset[header->_num_topic] == header->_num_entry
+            && _vocab_offset[header->_num_word] == header->_vocab_bytes;
+    }
+
+    void Unmap()
+    {
+        if (_map_addr != NULL)
+        {
+            munmap(_map_addr, _map_size);
+            _map_addr = NULL;
+            _map_size = 0;
+        }
+        _image.clear();
+        Attach(NULL);
+    }
+
+    // disallow copy and assignment
+    ModelData(const ModelData&);
+    ModelData& operator = (const ModelData&);
+
+private:
+    // file image, either mmap'ed or built in memory from a text model
+    void* _map_addr;
+    size_t _map_size;
+    std::vector<uint64_t> _image;
+
+    const ModelFileHeader* _header;
+    const double* _topic_total;
+    const uint32_t* _word_offset;
+    TopicIdArray _word_topic;
+    ProbArray _word_prob;
+    TopicIdArray _word_order;         // positions of each word row, by topic
+    const uint32_t* _topic_offset;
+    const int* _topic_word;
+    ProbArray _topic_prob;
+    const uint32_t* _vocab_offset;
+    const uint32_t* _vocab_sorted;
+    const char* _vocab_arena;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef MODEL_SHARD_H_
+#define MODEL_SHARD_H_
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "model_file.h"
+
+// a model split by word over num_shards shard processes, for the models
+// larger than the memory of one host. shard i holds the rows of the words
+// of ShardOfWord() i, with p(w|z) as in the whole model, as a regular
+// model file written by split_model and served by lda_shard. the front end,
+// ShardedLdaInfer of sharded_model.h, fetches the rows of the words of a
+// query and infers on a model of those rows only.
+//
+// protocol, every frame is a 4 byte big-endian length plus the payload, see
+// frame_server.h, and every number is big-endian, the floats and doubles as
+// their IEEE bits
+//   request:  'I'                                  shard info
+//             'R' uint32 num_words, num_words * (uint32 len, word)
+//   response: to 'I', uint32 shard_index, uint32 num_shards,
+//             uint32 num_topic, num_topic * double topic_total
+//             to 'R', num_words * (uint32 size, size * (uint32 topic,
+//             float prob)), the rows by p(w|z) descending, size
+//             kUnknownRow for a word unseen by the model
+// a shard closes the connection on a malformed request.
+
+static const uint32_t kUnknownRow = ~static_cast<uint32_t>(0);
+static const uint32_t kMaxShardFrameSize = 1 << 28;
+
+// the shard of a word, FNV-1a of its bytes
+inline int ShardOfWord(const char* word, size_t len, int num_shards)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+        hash = (hash ^ static_cast<unsigned char>(word[i])) * 16777619u;
+    return hash % num_shards;
+}
+
+inline int ShardOfWord(const std::string& word, int num_shards)
+{
+    return ShardOfWord(word.data(), word.size(), num_shards);
+}
+
+// shard shard_index of num_shards of model into shard. p(w|z) is decoded
+// from the compact form, the shards are written as floats
+inline void BuildModelShard(const ModelData& model, int shard_index, int num_shards, ModelData* shard)
+{
+    std::vector<std::string> words;
+    std::vector<WordTopicRow> rows;
+    for (int word_id = 0; word_id < model.GetVocabNum(); ++word_id)
+    {
+        size_t len;
+        const char* word = model.GetWord(word_id, &len);
+        if (ShardOfWord(word, len, num_shards) != shard_index)  continue;
+        words.push_back(std::string(word, len));
+        rows.push_back(model.GetWordTopicRow(word_id));
+    }
+    std::vector<double> topic_total(model.GetTopicNum());
+    for (int topic_id = 0; topic_id < model.GetTopicNum(); ++topic_id)
+        topic_total[topic_id] = model.GetTopicTotalCount(topic_id);
+    shard->BuildFromRows(words, rows, topic_total);
+}
+
+inline void AppendShardUint32(uint32_t value, std::string* out)
+{
+    value = htonl(value);
+    out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline void AppendShardFloat(float value, std::string* out)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    AppendShardUint32(bits, out);
+}
+
+inline void AppendShardDouble(double value, std::string* out)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    AppendShardUint32(bits >> 32, out);
+    AppendShardUint32(bits & 0xffffffffu, out);
+}
+
+// reads the payloads of the protocol above, each call moves past what it
+// read. false once the payload runs out, and from then on
+class ShardReader {
+public:
+    ShardReader(const char* data, size_t size) : _data(data), _size(size), _pos(0), _failed(false) { }
+
+    bool ReadUint32(uint32_t* value)
+    {
+        const char* bytes;
+        if (!ReadBytes(sizeof(uint32_t), &bytes))  return false;
+        memcpy(value, bytes, sizeof(uint32_t));
+        *value = ntohl(*value);
+        return true;
+    }
+
+    bool ReadFloat(float* value)
+    {
+        uint32_t bits;
+        if (!ReadUint32(&bits))  return false;
+        memcpy(value, &bits, sizeof(bits));
+        return true;
+    }
+
+    bool ReadDouble(double* value)
+    {
+        uint32_t high, low;
+        if (!ReadUint32(&high) || !ReadUint32(&low))  return false;
+        uint64_t bits = static_cast<uint64_t>(high) << 32 | low;
+        memcpy(value, &bits, sizeof(bits));
+        return true;
+    }
+
+    // len bytes, pointing into the payload
+    bool ReadBytes(size_t len, const char** bytes)
+    {
+        if (_failed || _size - _pos < len)
+        {
+            _failed = true;
+            return false;
+        }
+        *bytes = _data + _pos;
+        _pos += len;
+        return true;
+    }
+
+    // the whole payload was read, and nothing more
+    inline bool AtEnd() const
+    {
+        return !_failed && _pos == _size;
+    }
+
+private:
+    const char* _data;
+    size_t _size;
+    size_t _pos;
+    bool _failed;
+};
+
+#endif
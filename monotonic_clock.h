@@ -0,0 +1,16 @@
+#ifndef MONOTONIC_CLOCK_H_
+#define MONOTONIC_CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+// CLOCK_MONOTONIC in ns, for the timeouts, ttls and latencies: unaffected
+// by changes of the wall clock, and the same on every machine unlike the tsc
+inline uint64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+#endif
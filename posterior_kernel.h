@@ -0,0 +1,255 @@
+#ifndef POSTERIOR_KERNEL_H_
+#define POSTERIOR_KERNEL_H_
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POSTERIOR_KERNEL_X86 1
+#endif
+
+// p(w|z) * (n_dz + alpha) over the dense arrays of one word row, the inner
+// loop of the samplers for the words with thousands of topics. the AVX-512
+// and AVX2 versions are compiled with target attributes and picked once at
+// run time from the cpu, the scalar versions are the fallback and the
+// reference, and the only ones off x86.
+
+// word rows from this size on go through the kernels, the shorter ones
+// stay with the plain loops of the callers
+static const int kSimdRowSize = 16;
+
+// cdf[i] = sum_{j <= i} prob[j] * (count[topic[j]] + alpha), returns the total
+typedef double (*PosteriorCdfKernel)(const int* topic, const float* prob, const double* count,
+                                     double alpha, int size, double* cdf);
+
+// index of the largest prob[i] * (theta_i + alpha) over the topics with
+// theta_i = count[topic[i]] - (topic[i] == adjust_topic) > 0, the first one
+// on ties, -1 if there is none above 0. *max_weight gets the weight
+typedef int (*PosteriorArgMaxKernel)(const int* topic, const float* prob, const int* count, int adjust_topic,
+                                     float alpha, int size, float* max_weight);
+
+inline double PosteriorCdfScalar(const int* topic, const float* prob, const double* count,
+                                 double alpha, int size, double* cdf)
+{
+    double sum = 0.0;
+    for (int i = 0; i < size; ++i)
+    {
+        sum += prob[i] * (count[topic[i]] + alpha);
+        cdf[i] = sum;
+    }
+    return sum;
+}
+
+inline int PosteriorArgMaxScalar(const int* topic, const float* prob, const int* count, int adjust_topic,
+                                 float alpha, int size, float* max_weight)
+{
+    int max_index = -1;
+    float max_phi = 0.0f;
+    for (int i = 0; i < size; ++i)
+    {
+        int theta = count[topic[i]] - (topic[i] == adjust_topic ? 1 : 0);
+        if (theta <= 0)  continue;
+        float phi = prob[i] * (theta + alpha);
+        if (phi > max_phi)
+        {
+            max_phi = phi;
+            max_index = i;
+        }
+    }
+    *max_weight = max_phi;
+    return max_index;
+}
+
+#ifdef POSTERIOR_KERNEL_X86
+// in register prefix sum: log2(lanes) adds of the vector shifted by 1, 2
+// (and 4) lanes, plus the carry of the previous blocks. the carry is a
+// running sum of the block totals, so the blocks do not wait on each other.
+// the counts are read with plain loads, a gather of doubles is slower than
+// the scalar loop on the cpus with the gather data sampling microcode
+__attribute__((target("avx2")))
+inline double PosteriorCdfAvx2(const int* topic, const float* prob, const double* count,
+                               double alpha, int size, double* cdf)
+{
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d alpha4 = _mm256_set1_pd(alpha);
+    __m256d carry = zero;
+    int i = 0;
+    for (; i + 4 <= size; i += 4)
+    {
+        __m256d n = _mm256_setr_pd(count[topic[i]], count[topic[i + 1]], count[topic[i + 2]], count[topic[i + 3]]);
+        __m256d x = _mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(prob + i)), _mm256_add_pd(n, alpha4));
+        x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1));
+        x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3));
+        _mm256_storeu_pd(cdf + i, _mm256_add_pd(x, carry));
+        carry = _mm256_add_pd(carry, _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3)));
+    }
+    double sum = _mm256_cvtsd_f64(carry);
+    for (; i < size; ++i)
+    {
+        sum += prob[i] * (count[topic[i]] + alpha);
+        cdf[i] = sum;
+    }
+    return sum;
+}
+
+// the AVX-512 intrinsics are the masked and zeroing forms: the plain ones of
+// gcc 12 start from an undefined vector, which -Wall reports as used
+// uninitialized in every caller
+__attribute__((target("avx512f")))
+inline double PosteriorCdfAvx512(const int* topic, const float* prob, const double* count,
+                                 double alpha, int size, double* cdf)
+{
+    const __m512d alpha8 = _mm512_set1_pd(alpha);
+    const __m512i shift1 = _mm512_set_epi64(6, 5, 4, 3, 2, 1, 0, 0);
+    const __m512i shift2 = _mm512_set_epi64(5, 4, 3, 2, 1, 0, 0, 0);
+    const __m512i shift4 = _mm512_set_epi64(3, 2, 1, 0, 0, 0, 0, 0);
+    const __m512i last = _mm512_set1_epi64(7);
+    __m512d carry = _mm512_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        __m512d n = _mm512_setr_pd(count[topic[i]], count[topic[i + 1]], count[topic[i + 2]], count[topic[i + 3]],
+                                   count[topic[i + 4]], count[topic[i + 5]], count[topic[i + 6]], count[topic[i + 7]]);
+        __m512d x = _mm512_mul_pd(_mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(prob + i)), _mm512_add_pd(n, alpha8));
+        x = _mm512_add_pd(x, _mm512_maskz_permutexvar_pd(0xFE, shift1, x));
+        x = _mm512_add_pd(x, _mm512_maskz_permutexvar_pd(0xFC, shift2, x));
+        x = _mm512_add_pd(x, _mm512_maskz_permutexvar_pd(0xF0, shift4, x));
+        _mm512_storeu_pd(cdf + i, _mm512_add_pd(x, carry));
+        carry = _mm512_add_pd(carry, _mm512_maskz_permutexvar_pd(0xFF, last, x));
+    }
+    double carry_lanes[8];
+    _mm512_storeu_pd(carry_lanes, carry);
+    double sum = carry_lanes[0];
+    for (; i < size; ++i)
+    {
+        sum += prob[i] * (count[topic[i]] + alpha);
+        cdf[i] = sum;
+    }
+    return sum;
+}
+
+// per lane maximum and its index, reduced at the end; a strict > in the
+// lanes and the smallest index among equal maxima keep the scalar result.
+// the int gather pays off here, there is no prefix dependency to hide it
+__attribute__((target("avx2")))
+inline int PosteriorArgMaxAvx2(const int* topic, const float* prob, const int* count, int adjust_topic,
+                               float alpha, int size, float* max_weight)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i adjust = _mm256_set1_epi32(adjust_topic);
+    const __m256 alpha8 = _mm256_set1_ps(alpha);
+    __m256 best = _mm256_setzero_ps();
+    __m256i best_index = _mm256_set1_epi32(-1);
+    __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+    int i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(topic + i));
+        // theta = count - 1 on the adjusted topic, the compare gives -1 there
+        __m256i theta = _mm256_add_epi32(_mm256_i32gather_epi32(count, t, 4), _mm256_cmpeq_epi32(t, adjust));
+        __m256 phi = _mm256_mul_ps(_mm256_loadu_ps(prob + i), _mm256_add_ps(_mm256_cvtepi32_ps(theta), alpha8));
+        __m256 better = _mm256_and_ps(_mm256_cmp_ps(phi, best, _CMP_GT_OQ),
+                                      _mm256_castsi256_ps(_mm256_cmpgt_epi32(theta, zero)));
+        best = _mm256_blendv_ps(best, phi, better);
+        best_index = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_index),
+                                                          _mm256_castsi256_ps(lane_index), better));
+        lane_index = _mm256_add_epi32(lane_index, step);
+    }
+    float lane_best[8];
+    int lane_best_index[8];
+    _mm256_storeu_ps(lane_best, best);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lane_best_index), best_index);
+    int max_index = -1;
+    float max_phi = 0.0f;
+    for (int lane = 0; lane < 8; ++lane)
+    {
+        if (lane_best_index[lane] < 0)  continue;
+        if (lane_best[lane] > max_phi || (lane_best[lane] == max_phi && lane_best_index[lane] < max_index))
+        {
+            max_phi = lane_best[lane];
+            max_index = lane_best_index[lane];
+        }
+    }
+    float tail_phi;
+    int tail_index = PosteriorArgMaxScalar(topic + i, prob + i, count, adjust_topic, alpha, size - i, &tail_phi);
+    if (tail_index >= 0 && tail_phi > max_phi)
+    {
+        max_phi = tail_phi;
+        max_index = i + tail_index;
+    }
+    *max_weight = max_phi;
+    return max_index;
+}
+
+__attribute__((target("avx512f")))
+inline int PosteriorArgMaxAvx512(const int* topic, const float* prob, const int* count, int adjust_topic,
+                                 float alpha, int size, float* max_weight)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i adjust = _mm512_set1_epi32(adjust_topic);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512 alpha16 = _mm512_set1_ps(alpha);
+    __m512 best = _mm512_setzero_ps();
+    __m512i best_index = _mm512_set1_epi32(-1);
+    __m512i lane_index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i step = _mm512_set1_epi32(16);
+    int i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m512i t = _mm512_loadu_si512(topic + i);
+        __m512i theta = _mm512_mask_i32gather_epi32(zero, 0xFFFF, t, count, 4);
+        theta = _mm512_mask_sub_epi32(theta, _mm512_cmpeq_epi32_mask(t, adjust), theta, one);
+        __m512 phi = _mm512_mul_ps(_mm512_loadu_ps(prob + i), _mm512_add_ps(_mm512_maskz_cvtepi32_ps(0xFFFF, theta), alpha16));
+        __mmask16 better = _mm512_cmp_ps_mask(phi, best, _CMP_GT_OQ) & _mm512_cmpgt_epi32_mask(theta, zero);
+        best = _mm512_mask_mov_ps(best, better, phi);
+        best_index = _mm512_mask_mov_epi32(best_index, better, lane_index);
+        lane_index = _mm512_add_epi32(lane_index, step);
+    }
+    float lane_best[16];
+    int lane_best_index[16];
+    _mm512_storeu_ps(lane_best, best);
+    _mm512_storeu_si512(lane_best_index, best_index);
+    int max_index = -1;
+    float max_phi = 0.0f;
+    for (int lane = 0; lane < 16; ++lane)
+    {
+        if (lane_best_index[lane] < 0)  continue;
+        if (lane_best[lane] > max_phi || (lane_best[lane] == max_phi && lane_best_index[lane] < max_index))
+        {
+            max_phi = lane_best[lane];
+            max_index = lane_best_index[lane];
+        }
+    }
+    float tail_phi;
+    int tail_index = PosteriorArgMaxScalar(topic + i, prob + i, count, adjust_topic, alpha, size - i, &tail_phi);
+    if (tail_index >= 0 && tail_phi > max_phi)
+    {
+        max_phi = tail_phi;
+        max_index = i + tail_index;
+    }
+    *max_weight = max_phi;
+    return max_index;
+}
+#endif
+
+// the widest version the cpu runs
+inline PosteriorCdfKernel GetPosteriorCdfKernel()
+{
+#ifdef POSTERIOR_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))  return &PosteriorCdfAvx512;
+    if (__builtin_cpu_supports("avx2"))  return &PosteriorCdfAvx2;
+#endif
+    return &PosteriorCdfScalar;
+}
+
+inline PosteriorArgMaxKernel GetPosteriorArgMaxKernel()
+{
+#ifdef POSTERIOR_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))  return &PosteriorArgMaxAvx512;
+    if (__builtin_cpu_supports("avx2"))  return &PosteriorArgMaxAvx2;
+#endif
+    return &PosteriorArgMaxScalar;
+}
+
+#endif
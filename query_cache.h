@@ -0,0 +1,208 @@
+#ifndef QUERY_CACHE_H_
+#define QUERY_CACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <algorithm>
+#include <list>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+#include <tr1/unordered_map>
+#include "monotonic_clock.h"
+
+struct QueryCacheStats
+{
+    uint64_t _hits;
+    uint64_t _misses;
+    uint64_t _evictions;          // dropped for capacity
+    uint64_t _expirations;        // dropped for their ttl
+    size_t _size;
+
+    QueryCacheStats() : _hits(0), _misses(0), _evictions(0), _expirations(0), _size(0) { }
+};
+
+// concurrent LRU cache of per query results, keyed by the normalized query
+// (see MakeKey). the keys are hashed over independent shards, each with
+// its own lock and LRU list, so the threads of a server rarely contend.
+// every entry belongs to a version, e.g. the model it was computed with:
+// Invalidate() drops all entries and from then on takes only the ones of
+// the new version, a result computed on the previous model by a request
+// in flight is neither returned nor stored
+template<typename Value>
+class QueryCache {
+public:
+    typedef std::tr1::shared_ptr<const void> Version;
+
+    // ttl_seconds <= 0 keeps the entries until they are evicted
+    QueryCache(size_t capacity, double ttl_seconds, int num_shards, const Version& version)
+    : _ttl(ttl_seconds > 0 ? static_cast<uint64_t>(ttl_seconds * 1e9) : 0)
+    {
+        if (num_shards < 1)  num_shards = 1;
+        size_t shard_capacity = (capacity + num_shards - 1) / num_shards;
+        _shards.resize(num_shards);
+        for (int i = 0; i < num_shards; ++i)
+            _shards[i] = new Shard(std::max<size_t>(shard_capacity, 1), version);
+    }
+
+    ~QueryCache()
+    {
+        for (size_t i = 0; i < _shards.size(); ++i)
+            delete _shards[i];
+    }
+
+    // the tokens as a sorted multiset, so that the queries with the same
+    // words in another order share their entry
+    static void MakeKey(const std::vector<std::string>& tokens, std::string* key)
+    {
+        std::vector<std::string> sorted(tokens);
+        std::sort(sorted.begin(), sorted.end());
+        key->clear();
+        for (size_t i = 0; i < sorted.size(); ++i)
+        {
+            key->append(sorted[i]);
+            key->push_back('\0');
+        }
+    }
+
+    // copies the entry of key to value, false if there is none for version
+    bool Lookup(const std::string& key, const Version& version, Value* value)
+    {
+        Shard& shard = GetShard(key);
+        uint64_t now = NowNs();
+        pthread_mutex_lock(&shard._mutex);
+        typename Index::iterator iter = shard._index.find(key);
+        bool found = iter != shard._index.end() && shard._version == version;
+        if (found && _ttl > 0 && iter->second->_expire <= now)
+        {
+            shard._lru.erase(iter->second);
+            shard._index.erase(iter);
+            ++shard._stats._expirations;
+            found = false;
+        }
+        if (found)
+        {
+            // most recently used at the front
+            shard._lru.splice(shard._lru.begin(), shard._lru, iter->second);
+            *value = iter->second->_value;
+            ++shard._stats._hits;
+        }
+        else
+        {
+            ++shard._stats._misses;
+        }
+        pthread_mutex_unlock(&shard._mutex);
+        return found;
+    }
+
+    // adds or replaces the entry of key, ignored if version is not the
+    // current one
+    void Insert(const std::string& key, const Version& version, const Value& value)
+    {
+        Shard& shard = GetShard(key);
+        uint64_t expire = _ttl > 0 ? NowNs() + _ttl : 0;
+        pthread_mutex_lock(&shard._mutex);
+        if (shard._version == version)
+        {
+            typename Index::iterator iter = shard._index.find(key);
+            if (iter != shard._index.end())
+            {
+                shard._lru.splice(shard._lru.begin(), shard._lru, iter->second);
+            }
+            else
+            {
+                if (shard._index.size() >= shard._capacity)
+                {
+                    shard._index.erase(shard._lru.back()._key);
+                    shard._lru.pop_back();
+                    ++shard._stats._evictions;
+                }
+                shard._lru.push_front(Entry());
+                shard._lru.front()._key = key;
+                shard._index[key] = shard._lru.begin();
+            }
+            shard._lru.front()._value = value;
+            shard._lru.front()._expire = expire;
+        }
+        pthread_mutex_unlock(&shard._mutex);
+    }
+
+    // drops every entry, only version is accepted from now on
+    void Invalidate(const Version& version)
+    {
+        for (size_t i = 0; i < _shards.size(); ++i)
+        {
+            Shard& shard = *_shards[i];
+            std::list<Entry> entries;
+            pthread_mutex_lock(&shard._mutex);
+            shard._version = version;
+            shard._index.clear();
+            entries.swap(shard._lru);
+            pthread_mutex_unlock(&shard._mutex);
+            // the entries are freed outside of the lock
+        }
+    }
+
+    // summed over the shards
+    QueryCacheStats GetStats() const
+    {
+        QueryCacheStats stats;
+        for (size_t i = 0; i < _shards.size(); ++i)
+        {
+            Shard& shard = *_shards[i];
+            pthread_mutex_lock(&shard._mutex);
+            stats._hits += shard._stats._hits;
+            stats._misses += shard._stats._misses;
+            stats._evictions += shard._stats._evictions;
+            stats._expirations += shard._stats._expirations;
+            stats._size += shard._index.size();
+            pthread_mutex_unlock(&shard._mutex);
+        }
+        return stats;
+    }
+
+private:
+    struct Entry
+    {
+        std::string _key;
+        Value _value;
+        uint64_t _expire;             // monotonic ns
+    };
+
+    typedef std::tr1::unordered_map<std::string, typename std::list<Entry>::iterator> Index;
+
+    struct Shard
+    {
+        Shard(size_t capacity, const Version& version) : _capacity(capacity), _version(version)
+        {
+            pthread_mutex_init(&_mutex, NULL);
+        }
+
+        ~Shard()
+        {
+            pthread_mutex_destroy(&_mutex);
+        }
+
+        pthread_mutex_t _mutex;
+        size_t _capacity;
+        Version _version;
+        std::list<Entry> _lru;
+        Index _index;
+        QueryCacheStats _stats;
+    };
+
+    inline Shard& GetShard(const std::string& key) const
+    {
+        return *_shards[std::tr1::hash<std::string>()(key) % _shards.size()];
+    }
+
+    // disallow copy and assignment
+    QueryCache(const QueryCache&);
+    QueryCache& operator = (const QueryCache&);
+
+private:
+    uint64_t _ttl;                    // ns, 0 for none
+    std::vector<Shard*> _shards;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef RANDOM_H_
+#define RANDOM_H_
+
+#include <stdint.h>
+
+// xoshiro256** (Blackman & Vigna), a small and fast PRNG. Not thread-safe
+// on purpose: every thread / workspace owns one, so there is no shared state
+// and no lock as with rand(), and a given seed reproduces the same stream.
+class Random {
+public:
+    explicit Random(uint64_t seed = 0) { Seed(seed); }
+
+    // the state is filled by splitmix64, as recommended by the authors
+    void Seed(uint64_t seed)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            seed += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            _s[i] = z ^ (z >> 31);
+        }
+    }
+
+    inline uint64_t Next()
+    {
+        uint64_t result = Rotl(_s[1] * 5, 7) * 9;
+        uint64_t t = _s[1] << 17;
+        _s[2] ^= _s[0];
+        _s[3] ^= _s[1];
+        _s[1] ^= _s[2];
+        _s[0] ^= _s[3];
+        _s[2] ^= t;
+        _s[3] = Rotl(_s[3], 45);
+        return result;
+    }
+
+    // uniform in [0, 1)
+    inline double Uniform()
+    {
+        return (Next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // uniform in [0, n)
+    inline int UniformInt(int n)
+    {
+        return static_cast<int>((Next() >> 32) * static_cast<uint64_t>(n) >> 32);
+    }
+
+private:
+    static inline uint64_t Rotl(uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+private:
+    uint64_t _s[4];
+};
+
+// distinct default seed for every Random that is not seeded explicitly
+inline uint64_t NextRandomSeed()
+{
+    static uint64_t counter = 0;
+    return __sync_add_and_fetch(&counter, 1) * 0x9e3779b97f4a7c15ULL;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#include "model.h"
+#include "topic_index.h"
+
+// related queries by topic mixture: the queries of corpus_tsv, the tsv
+// output of model2, are indexed by their topic distributions, then every
+// query read from stdin is inferred as model2 does and answered with the
+// top_k corpus queries of the closest distribution, by cosine:
+//   query \t related:score related:score ...\n
+// the queries of stdin are tokenized, the words separated by spaces.
+
+// topics of a "topic:prob topic:prob ..." field
+static void ParseTopics(const string& field, vector<TopicIndex::TopicWeight>* topics)
+{
+    topics->clear();
+    size_t begin = 0;
+    while (begin < field.size())
+    {
+        size_t end = field.find(' ', begin);
+        if (end == string::npos)  end = field.size();
+        size_t colon = field.find(':', begin);
+        if (colon != string::npos && colon < end)
+        {
+            int topic = atoi(field.c_str() + begin);
+            double prob = atof(field.c_str() + colon + 1);
+            topics->push_back(TopicIndex::TopicWeight(topic, prob));
+        }
+        begin = end + 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr = 1;
+
+    if (argc < 4)
+    {
+        cout<<"Usage: "<<argv[0]<<" model_file alpha corpus_tsv [top_k]"<<endl;
+        return 0;
+    }
+
+    string model_file = argv[1];
+    double alpha = boost::lexical_cast<double>(argv[2]);
+    string corpus_file = argv[3];
+    size_t top_k = argc > 4 ? boost::lexical_cast<size_t>(argv[4]) : 10;
+
+    LdaInfer infer(model_file, alpha, 0.0, 10, 100);
+    ModelPtr model = infer.GetModel();
+
+    ifstream ifs(corpus_file.c_str());
+    if (!ifs)
+    {
+        LOG(ERROR)<<"open "<<corpus_file<<" failed";
+        return 1;
+    }
+    vector<string> queries;
+    vector<vector<TopicIndex::TopicWeight> > docs;
+    string line;
+    while (getline(ifs, line))
+    {
+        size_t query_end = line.find('\t');
+        size_t words_end = query_end == string::npos ? string::npos : line.find('\t', query_end + 1);
+        if (words_end == string::npos)  continue;
+        queries.push_back(line.substr(0, query_end));
+        docs.push_back(vector<TopicIndex::TopicWeight>());
+        ParseTopics(line.substr(words_end + 1), &docs.back());
+    }
+    TopicIndex index;
+    index.Build(docs, model->GetTopicNum());
+    LOG(INFO)<<index.GetDocNum()<<" queries, "<<index.GetPostingNum()<<" postings, "
+             <<index.GetMemorySize()<<" bytes";
+    // the corpus is in the index now
+    vector<vector<TopicIndex::TopicWeight> >().swap(docs);
+
+    Document doc;
+    vector<string> tokens;
+    vector<TopicIndex::TopicWeight> query_topics;
+    TopicSearchWorkspace ws;
+    vector<TopicIndex::DocScore> results;
+    while (getline(cin, line))
+    {
+        boost::split(tokens, line, boost::is_any_of(" "), boost::token_compress_on);
+        infer.Infer(*model, tokens, &doc);
+        query_topics.clear();
+        const vector<int>& topics = doc._accumulate_topic_dist.Keys();
+        for (size_t i = 0; i < topics.size(); ++i)
+            query_topics.push_back(TopicIndex::TopicWeight(topics[i], doc._accumulate_topic_dist.Get(topics[i])));
+        index.Search(query_topics, top_k, &ws, &results);
+
+        cout<<line<<'\t';
+        for (size_t i = 0; i < results.size(); ++i)
+            cout<<(i > 0 ? " " : "")<<queries[results[i].first]<<':'<<results[i].second;
+        cout<<'\n';
+    }
+    return 0;
+}
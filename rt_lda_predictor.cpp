@@ -6,12 +6,22 @@
 #include <string>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include "model_file.h"
+#include "random.h"
+#include "snapshot.h"
+#include "posterior_kernel.h"
+#include "trace.h"
+#include "benchmark.h"
 using namespace std;
 using tr1::unordered_map;
 
 
 namespace lda {
 
+// row entries per SIMD call of RtLdaPredictor, between two checks of the
+// early stop bound
+static const int kScanBlock = 64;
+
 ostream& operator<<(ostream& out, vector<int>& v)
 {
     for (size_t i=0; i<v.size(); ++i)
@@ -20,107 +30,77 @@ ostream& operator<<(ostream& out, vector<int>& v)
 }
 
 
+class LdaModel;
+// a loaded model, pinned by a predictor for the duration of predict()
+typedef tr1::shared_ptr<const LdaModel> LdaModelPtr;
+// the model being served. a retrained model is loaded in the background
+// with LdaModel::load() and swapped in with Publish(), the predictions in
+// flight finish on the previous one
+typedef SnapshotSlot<const LdaModel> LdaModelSlot;
+
 class LdaModel {
 public:
-    static inline LdaModel* get_instance(string model_file, int num_topic, float alpha)
+    // NULL if model_file can not be loaded
+    static LdaModelPtr load(const string& model_file, int num_topic, float alpha)
     {
-        if (NULL == _p_lda_model)
+        LdaModel* lda_model = new LdaModel(num_topic, alpha);
+        if (!lda_model->load_model(model_file, num_topic))
         {
-            //string model_file = "";
-            //int num_topic = 0;
-            //float alpha = 1.0; 
-            _p_lda_model = new LdaModel(model_file, num_topic, alpha);
+            delete lda_model;
+            return LdaModelPtr();
         }
-        return _p_lda_model;
+        lda_model->calc_r();
+        if (DefaultTrace::kEnabled)  lda_model->print_model_info(DefaultTrace::Sink());
+        return LdaModelPtr(lda_model);
     }
 
 private:
-    LdaModel(const string& model_file, int num_topic, float alpha) 
-     : _num_topic(num_topic), _alpha(alpha)
-    {
-        load_model(model_file, num_topic);
-        calc_r();
-        print_model_info();
-    }
+    LdaModel(int num_topic, float alpha) 
+     : _num_topic(num_topic), _alpha(alpha) { }
 
-    // load model file
-    // format:  topic_id  \t  wordid:count space word:count ...
+    // load model file, either the text format
+    //   topic_id  \t  wordid:count space word:count ...
+    // or its binary form written by convert_model
     bool load_model(const string& model_file, int num_topic)
     {
-        _num_topic = num_topic;
-        _top2wor.resize(_num_topic, NULL);
-        _topsum.resize(_num_topic, 0.0f);
+        bool ok = ModelData::IsBinaryFile(model_file) ? _model_data.Map(model_file)
+                                                      : _model_data.LoadText(model_file);
+        if (!ok)  return false;
+        _num_topic = max(num_topic, _model_data.GetTopicNum());
 
-        ifstream ifs(model_file.c_str());
-        string buf;
-        while(getline(ifs, buf))
+        // the words of the model are wordids, map them to rows of the word->topic table
+        for (int i = 0; i < _model_data.GetVocabNum(); ++i)
         {
-            istringstream ss(buf);
-            int topic_id;
-            ss >> topic_id;
-            _top2wor[topic_id] = new unordered_map<int, float>();
-
-            string item;
-            while(ss >> item)  
-            {
-                vector<string> tokens;
-                boost::split(tokens, item, boost::is_any_of(":"));
-                int wordid = boost::lexical_cast<int>(tokens[0]);
-                float count = boost::lexical_cast<float>(tokens[1]);
-                (*_top2wor[topic_id])[wordid] = count;
-                _topsum[topic_id] += count;
-
-                if (_wor2top.find(wordid) == _wor2top.end())
-                {
-                    _wor2top[wordid] = new unordered_map<int, float>(); 
-                }
-                (*_wor2top[wordid])[topic_id] = count;
-            }
+            int wordid = boost::lexical_cast<int>(_model_data.GetWord(i));
+            if (wordid >= static_cast<int>(_word_index.size()))
+                _word_index.resize(wordid + 1, -1);
+            _word_index[wordid] = i;
         }
+        return true;
     }
    
     void calc_r()
     {
-        // find max p(w_i | z_k) for each word_i
-        for(int i=0; i< _num_topic; ++i)
-        {
-            float sum_count = _topsum[i];
-            unordered_map<int, float>* one_topic = _top2wor[i];
-            for (unordered_map<int, float>::iterator iter = one_topic->begin();
-                 iter != one_topic->end();
-                 ++iter)
-            {
-                int wordid = iter->first;
-                float p = iter->second / sum_count;
-                if (_R.find(wordid) == _R.end())
-                {
-                    _R.insert(std::make_pair<int, pair<int, float> >(wordid, pair<int, float>(i, p)));
-                }
-                else if (_R[wordid].second < p)
-                {
-                    _R[wordid].first = i;
-                    _R[wordid].second = p;
-                }
-            }
-        }
-        // multiply alpha
-        for(unordered_map<int, pair<int, float> >::iterator iter = _R.begin();
-            iter != _R.end();
-            ++iter)
+        // max p(w_i | z_k) for each word_i is the head of its row, multiply alpha
+        _r_topic.assign(_word_index.size(), 0);
+        _r_value.assign(_word_index.size(), 0.0f);
+        for (size_t wordid = 0; wordid < _word_index.size(); ++wordid)
         {
-            (iter->second).second *= _alpha;
+            WordTopicRow row = word_topic_row(wordid);
+            if (row._size == 0)  continue;
+            _r_topic[wordid] = row._topic[0];
+            _r_value[wordid] = row._prob[0] * _alpha;
         }
     }
    
-    void print_model_info()
+    void print_model_info(ostream& out)
     {
-        cout<<"num_topic="<<_num_topic<<endl;
-        cout<<"------- R -------"<<endl;
-        for (unordered_map<int, pair<int, float> >::iterator iter = _R.begin();
-             iter != _R.end();
-             ++iter)
+        out<<"num_topic="<<_num_topic<<endl;
+        out<<"------- R -------"<<endl;
+        for (size_t wordid = 0; wordid < _word_index.size(); ++wordid)
         {
-            cout<<"word:"<<iter->first<<" topic:"<<(iter->second).first<<"  R="<<(iter->second).second<<endl;
+            if (_word_index[wordid] < 0)  continue;
+            out<<"word:"<<wordid<<" topic:"<<_r_topic[wordid]<<"  R="<<_r_value[wordid]<<endl;
         }
     }
     
@@ -129,30 +109,91 @@ private:
     LdaModel& operator = (const LdaModel&);
 
 public:
-    // topic_id   wordid:count
-    vector<unordered_map<int, float>* > _top2wor;
-    // wordid  topicid::count
-    unordered_map<int, unordered_map<int, float>* > _wor2top;
-    // topic's total word count 
-    vector<float> _topsum; 
-    // R vector, wordid  <topic_id, p(z|w)> see wangyi's paper
-    unordered_map<int, pair<int, float> > _R;
+    // topics of wordid and their p(w|z), empty if the word is unseen by model
+    inline WordTopicRow word_topic_row(int wordid) const
+    {
+        if (wordid < 0 || wordid >= static_cast<int>(_word_index.size()) || _word_index[wordid] < 0)
+            return WordTopicRow();
+        return _model_data.GetWordTopicRow(_word_index[wordid]);
+    }
+
+    // R value of wordid, <0, 0> if unseen
+    inline pair<int, float> r_value(int wordid) const
+    {
+        if (wordid < 0 || wordid >= static_cast<int>(_r_value.size()))
+            return pair<int, float>(0, 0.0f);
+        return pair<int, float>(_r_topic[wordid], _r_value[wordid]);
+    }
+
+    // word->topic table, shared with the other predictors. its rows are
+    // CSR, sorted by p(w|z) in descending order
+    ModelData _model_data;
+    // wordid -> row of _model_data, -1 if unseen
+    vector<int> _word_index;
+    // R vector, wordid -> <topic_id, max_k p(w|z_k) * alpha> see wangyi's
+    // paper, as two flat arrays indexed by wordid
+    vector<int> _r_topic;
+    vector<float> _r_value;
         
     int _num_topic;
     float _alpha;
-
-    static LdaModel* _p_lda_model;
 };
 
-LdaModel* LdaModel::_p_lda_model = NULL;
-
+// Trace is the trace level, see trace.h
+template<typename Trace = DefaultTrace>
 class RtLdaPredictor
 {
 public:
-    RtLdaPredictor(LdaModel* p_lda_model) : _p_lda_model(p_lda_model) { }
+    // one predictor per thread, they can share one LdaModelSlot. every
+    // predict() runs on the model published at its start
+    RtLdaPredictor(const LdaModelSlot& lda_models, uint64_t seed = NextRandomSeed())
+     : _lda_models(lda_models), _rng(seed), _len(0),
+       _posterior_argmax(GetPosteriorArgMaxKernel()) { }
+
+    // restart the random stream, the result is reproducible for a given seed
+    void seed(uint64_t seed)
+    {
+        _rng.Seed(seed);
+    }
+
+    // forget the previous document, predict() starts with it
+    void reset()
+    {
+        // only the topics of the previous document are counted
+        for (size_t i = 0; i < _wor2top.size(); ++i)
+            _doc2top[_wor2top[i]] = 0;
+        _doc.clear();
+        _wor2top.clear();
+        _len = 0;
+    }
 
+    // topic_vector gets the topic of every word of word_vector
     void predict(const vector<int>& word_vector, int max_step, vector<int>& topic_vector)
     {
+        _p_lda_model = _lda_models.Get();
+        predict_document(word_vector, max_step, topic_vector);
+        // don't keep an old model alive between the predictions
+        _p_lda_model.reset();
+    }
+
+    // predict() of every document of docs on one model snapshot, the
+    // topics of docs[i] go to (*topic_vectors)[i]
+    void predict_batch(const vector<vector<int> >& docs, int max_step, vector<vector<int> >* topic_vectors)
+    {
+        _p_lda_model = _lda_models.Get();
+        topic_vectors->resize(docs.size());
+        for (size_t i = 0; i < docs.size(); ++i)
+        {
+            (*topic_vectors)[i].clear();
+            predict_document(docs[i], max_step, (*topic_vectors)[i]);
+        }
+        _p_lda_model.reset();
+    }
+
+private:
+    void predict_document(const vector<int>& word_vector, int max_step, vector<int>& topic_vector)
+    {
+       reset();
        copy(word_vector.begin(), word_vector.end(), back_inserter<vector<int> >(_doc)); 
        _len = _doc.size();
 
@@ -166,71 +207,40 @@ public:
            {
                int old_topic = _wor2top[i];
                int word = _doc[i];
-               cout<<"-------- step "<<step<<", word "<<word<<", old_topic "<<old_topic<<"-----------"<<endl;
-               cout<<_wor2top<<endl;
+               if (Trace::kEnabled)
+               {
+                   Trace::Sink()<<"-------- step "<<step<<", word "<<word<<", old_topic "<<old_topic<<"-----------"<<endl;
+                   Trace::Sink()<<_wor2top<<endl;
+               }
 
                int max_topic = 0;
                float max_phi = 0.0;
 
                // max_k p(w|z_k) * (theta_k + alpha)
-               unordered_map<int, float> *p_top_of_wor = _p_lda_model->_wor2top[word];
-               for (unordered_map<int, float>::iterator iter = p_top_of_wor->begin();
-                    iter != p_top_of_wor->end();
-                    ++iter)
-               {
-                   int cur_topic = iter->first;
-                   // \theta_k = 0, do not need process
-                   if (_doc2top.find(cur_topic) == _doc2top.end() || 0 == _doc2top[cur_topic] )
-                   {
-                       cout<<"cur_topic["<<cur_topic<<"] not in _doc2top,  continue..."<<endl;
-                       continue;
-                   }
-                   int adjust = cur_topic == old_topic ? 1 : 0;
-                   int theta = _doc2top[cur_topic] - adjust;
-                   if (theta == 0)
-                   {
-                       cout<<"theta=0, continue...  "
-                           <<" _doc2top["<<cur_topic<<"]="<<_doc2top[cur_topic]
-                           <<" adjust="<<adjust<<endl;
-                       continue;
-                   }
-                   float phi = iter->second / _p_lda_model->_topsum[cur_topic] * (theta + _p_lda_model->_alpha);
-                   cout<<"cur_topic="<<cur_topic
-                       <<" theta="<<theta
-                       <<" phi="<<phi
-                       <<" max_phi="<<max_phi
-                       <<" _R[word]="<<_p_lda_model->_R[word].second
-                       <<endl;
-                   if (phi > max_phi)
-                   {
-                       max_phi = phi;
-                       max_topic = cur_topic;
-                   }
-               }
+               pair<int, float> r = _p_lda_model->r_value(word);
+               WordTopicRow row = _p_lda_model->word_topic_row(word);
+               int j = scan_row(row, old_topic, r.second, &max_phi);
+               if (j >= 0)  max_topic = row._topic[j];
               
                // max_k { R, above value } 
-               if (_p_lda_model->_R[word].second > max_phi)
+               if (r.second > max_phi)
                {
-                   max_phi = _p_lda_model->_R[word].second;
-                   max_topic = _p_lda_model->_R[word].first;
+                   max_phi = r.second;
+                   max_topic = r.first;
                }
-               cout<<"max_topic:"<<max_topic<<" max_phi="<<max_phi<<endl;
+               if (Trace::kEnabled)  Trace::Sink()<<"max_topic:"<<max_topic<<" max_phi="<<max_phi<<endl;
                // adjust topic assignment
                if (old_topic != max_topic)
                {
                    _wor2top[i] = max_topic;
                    _doc2top[old_topic]--;
-                   if (_doc2top.find(max_topic) != _doc2top.end())
-                   {
-                       _doc2top[max_topic] ++;
-                   }
-                   else
-                   {
-                       _doc2top[max_topic] = 1;
-                   }
+                   _doc2top[max_topic]++;
+               }
+               if (Trace::kEnabled)
+               {
+                   Trace::Sink()<<"after adjust"<<endl;
+                   Trace::Sink()<<_wor2top<<endl;
                }
-               cout<<"after adjust"<<endl;
-               cout<<_wor2top<<endl;
                
            }// end for
            step++;
@@ -239,53 +249,219 @@ public:
        copy(_wor2top.begin(), _wor2top.end(), back_inserter<vector<int> >(topic_vector)); 
     }
 
-private:
-    void init_predictor()
+    // index of max_k p(w|z_k) * (theta_k + alpha) in row, -1 if no topic of
+    // row is in the document. the row is sorted by p(w|z) and theta_k is at
+    // most _len - 1, so the scan stops once p(w|z) * (_len - 1 + alpha) can
+    // not beat the best so far, nor r, the R value of the word, which wins
+    // over the rest then. the result is the one of the whole row
+    int scan_row(const WordTopicRow& row, int old_topic, float r, float* max_phi)
     {
-        _wor2top.resize(_len); 
-        for (int i = 0; i<_len; ++i)
+        float alpha = _p_lda_model->_alpha;
+        float max_theta = (_len - 1) + alpha;
+        int max_index = -1;
+        *max_phi = 0.0f;
+        const int* row_topic = row._topic.Ints();
+        const float* row_prob = row._prob.Floats();
+        if (row._size >= kSimdRowSize && row_topic != NULL && row_prob != NULL)
         {
-            int topic = random_topic();
-            _wor2top[i] = topic;
-            cout<<"init topic "<<topic<<endl;
-            if (_doc2top.find(topic) == _doc2top.end())
+            // the long rows of frequent words in SIMD blocks, the bound
+            // is checked between the blocks
+            for (int begin = 0; begin < row._size; begin += kScanBlock)
             {
-                _doc2top[topic] = 1;
+                float bound = row_prob[begin] * max_theta;
+                if (bound <= *max_phi || bound < r)  break;
+                float phi;
+                int j = _posterior_argmax(row_topic + begin, row_prob + begin, &_doc2top[0], old_topic,
+                                          alpha, min(kScanBlock, row._size - begin), &phi);
+                if (j >= 0 && phi > *max_phi)
+                {
+                    *max_phi = phi;
+                    max_index = begin + j;
+                }
+            }
+            return max_index;
+        }
+
+        for (int j = 0; j < row._size; ++j)
+        {
+            float bound = row._prob[j] * max_theta;
+            if (bound <= *max_phi || bound < r)  break;
+            int cur_topic = row._topic[j];
+            // \theta_k = 0, do not need process
+            if (0 == _doc2top[cur_topic])
+            {
+                if (Trace::kEnabled)
+                    Trace::Sink()<<"cur_topic["<<cur_topic<<"] not in doc,  continue..."<<endl;
+                continue;
             }
-            else
+            int adjust = cur_topic == old_topic ? 1 : 0;
+            int theta = _doc2top[cur_topic] - adjust;
+            if (theta == 0)
             {
-                _doc2top[topic] += 1;
+                if (Trace::kEnabled)
+                    Trace::Sink()<<"theta=0, continue...  "
+                                 <<" _doc2top["<<cur_topic<<"]="<<_doc2top[cur_topic]
+                                 <<" adjust="<<adjust<<endl;
+                continue;
+            }
+            float phi = row._prob[j] * (theta + alpha);
+            if (Trace::kEnabled)
+                Trace::Sink()<<"cur_topic="<<cur_topic
+                             <<" theta="<<theta
+                             <<" phi="<<phi
+                             <<" max_phi="<<*max_phi
+                             <<" _R[word]="<<r
+                             <<endl;
+            if (phi > *max_phi)
+            {
+                *max_phi = phi;
+                max_index = j;
             }
         }
-        cout<<_wor2top<<endl;
+        return max_index;
     }
 
+    void init_predictor()
+    {
+        _wor2top.resize(_len); 
+        // zero but for the topics of the previous document, see reset()
+        if (static_cast<int>(_doc2top.size()) != _p_lda_model->_num_topic)
+            _doc2top.assign(_p_lda_model->_num_topic, 0);
+        for (int i = 0; i<_len; ++i)
+        {
+            int topic = random_topic();
+            _wor2top[i] = topic;
+            if (Trace::kEnabled)  Trace::Sink()<<"init topic "<<topic<<endl;
+            _doc2top[topic] += 1;
+        }
+        if (Trace::kEnabled)  Trace::Sink()<<_wor2top<<endl;
+    }
 
     inline int random_topic()
     {
-        return static_cast<int>(rand() / static_cast<double>(RAND_MAX) * _p_lda_model->_num_topic);
+        return _rng.UniformInt(_p_lda_model->_num_topic);
     }
 
 private:
 
-    LdaModel* _p_lda_model;
+    const LdaModelSlot& _lda_models;
+    // model of the running predict()
+    LdaModelPtr _p_lda_model;
+    Random _rng;
 
     vector<int> _doc;
     vector<int> _wor2top;
     int _len;
-    // topic -> count
-    unordered_map<int, int> _doc2top;
+    // topic -> count, dense so that the SIMD kernel can gather from it
+    vector<int> _doc2top;
+    // widest posterior kernel of the cpu
+    PosteriorArgMaxKernel _posterior_argmax;
 };
 
 }
 
 using namespace lda;
 
+// one predict() per query, for the benchmark
+class PredictTask : public ParallelTask {
+public:
+    PredictTask(RtLdaPredictor<>* predictor, const vector<vector<int> >& queries, int max_step)
+    : _predictor(predictor), _queries(queries), _max_step(max_step) { }
+
+    virtual void Run(int index)
+    {
+        _output.clear();
+        _predictor->predict(_queries[index % _queries.size()], _max_step, _output);
+    }
+
+private:
+    RtLdaPredictor<>* _predictor;
+    const vector<vector<int> >& _queries;
+    int _max_step;
+    vector<int> _output;
+};
+
+// queries per predict_batch() of the benchmark
+static const size_t kBenchBatchSize = 64;
+
+// one predict_batch() of kBenchBatchSize queries per call, the latency is
+// the one of the whole batch
+class PredictBatchTask : public ParallelTask {
+public:
+    PredictBatchTask(RtLdaPredictor<>* predictor, const vector<vector<int> >& queries, int max_step)
+    : _predictor(predictor), _queries(queries), _max_step(max_step) { }
+
+    virtual void Run(int index)
+    {
+        // the copies reuse the capacity of the previous batch
+        _batch.resize(kBenchBatchSize);
+        for (size_t i = 0; i < kBenchBatchSize; ++i)
+            _batch[i] = _queries[(index * kBenchBatchSize + i) % _queries.size()];
+        _predictor->predict_batch(_batch, _max_step, &_output);
+    }
+
+private:
+    RtLdaPredictor<>* _predictor;
+    const vector<vector<int> >& _queries;
+    int _max_step;
+    vector<vector<int> > _batch;
+    vector<vector<int> > _output;
+};
+
+// model load and predict() latency over synthetic queries and the wordid
+// lines of query_file, see benchmark.h
+static int RunBenchmark(float alpha, int num_topic, const string& model_file, int max_step,
+                        const string& query_file, const string& json_file, size_t num_queries)
+{
+    BenchmarkReport report;
+    uint64_t start = NowNs();
+    LdaModelPtr lda_model = LdaModel::load(model_file, num_topic, alpha);
+    if (!lda_model)
+    {
+        cout<<"load model failed: "<<model_file<<endl;
+        return 1;
+    }
+    report.AddTime("rt_model_load", (NowNs() - start) * 1e-9);
+    LdaModelSlot lda_models(lda_model);
+    RtLdaPredictor<> predictor(lda_models, 1);
+
+    vector<vector<int> > queries;
+    MakeSyntheticQueries(lda_model->_model_data, num_queries, 8, 1, &queries);
+    for (size_t i = 0; i < queries.size(); ++i)
+        for (size_t j = 0; j < queries[i].size(); ++j)
+            queries[i][j] = boost::lexical_cast<int>(lda_model->_model_data.GetWord(queries[i][j]));
+    PredictTask task(&predictor, queries, max_step);
+    report.Run("rt_predict", "synthetic", &task, num_queries, num_queries / 10 + 1);
+    size_t num_batches = max<size_t>(num_queries / kBenchBatchSize, 1);
+    PredictBatchTask batch_task(&predictor, queries, max_step);
+    report.Run("rt_predict_batch", "synthetic", &batch_task, num_batches, num_batches / 10 + 1);
+
+    if (query_file != "-")
+    {
+        vector<vector<string> > lines;
+        if (!ReadQueries(query_file, &lines) || lines.empty())
+        {
+            cout<<"read queries failed: "<<query_file<<endl;
+            return 1;
+        }
+        queries.assign(lines.size(), vector<int>());
+        for (size_t i = 0; i < lines.size(); ++i)
+            for (size_t j = 0; j < lines[i].size(); ++j)
+                queries[i].push_back(boost::lexical_cast<int>(lines[i][j]));
+        PredictTask replay_task(&predictor, queries, max_step);
+        report.Run("rt_predict", "replay", &replay_task, queries.size(), queries.size() / 10 + 1);
+    }
+
+    report.Print(cerr);
+    return report.WriteJson(json_file) ? 0 : 1;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 5)
     {
         cout<<"Usage : "<< argv[0]<<" alpha num_topic model_file query"<<endl;
+        cout<<"        "<< argv[0]<<" alpha num_topic model_file --bench [query_file|-] [json_file|-] [num_queries]"<<endl;
         return 0;
     }
 
@@ -296,9 +472,22 @@ int main(int argc, char *argv[])
 
     int max_step = 10;
 
-    LdaModel* p_lda_model = LdaModel::get_instance(model_file, num_topic, alpha);
+    if (query == "--bench")
+    {
+        return RunBenchmark(alpha, num_topic, model_file, max_step,
+                            argc > 5 ? argv[5] : "-", argc > 6 ? argv[6] : "-",
+                            argc > 7 ? boost::lexical_cast<size_t>(argv[7]) : 10000);
+    }
+
+    LdaModelPtr lda_model = LdaModel::load(model_file, num_topic, alpha);
+    if (!lda_model)
+    {
+        cout<<"load model failed: "<<model_file<<endl;
+        return 1;
+    }
+    LdaModelSlot lda_models(lda_model);
 
-    RtLdaPredictor predictor(p_lda_model);
+    RtLdaPredictor<> predictor(lda_models, time(NULL));
 
     vector<int> input;
     istringstream iss(query);
@@ -310,5 +499,7 @@ int main(int argc, char *argv[])
     
     vector<int> output;
     predictor.predict(input, max_step, output);
+    for (size_t i = 0; i < output.size(); ++i)
+        cout<<input[i]<<" "<<output[i]<<endl;
     return 0;
 }
@@ -0,0 +1,59 @@
+#include "sharded_model.h"
+
+// topic inference over a model split by word: the rows of the words of
+// every query read from stdin are fetched from the lda_shard processes at
+// shard_addresses, comma separated in shard order, then inferred as model2
+// does:
+//   query \t topic:prob topic:prob ...\n
+// the queries of stdin are tokenized, the words separated by spaces. with
+// cache_size > 0 the rows of the last cache_size words are kept.
+int main(int argc, char *argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr = 1;
+
+    if (argc < 3)
+    {
+        cout<<"Usage: "<<argv[0]<<" alpha shard_addresses [cache_size] [fold_in_tokens]"<<endl;
+        return 0;
+    }
+
+    double alpha = boost::lexical_cast<double>(argv[1]);
+    vector<string> addresses;
+    string address_list = argv[2];
+    boost::split(addresses, address_list, boost::is_any_of(","));
+    size_t cache_size = argc > 3 ? boost::lexical_cast<size_t>(argv[3]) : 0;
+    int fold_in_tokens = argc > 4 ? boost::lexical_cast<int>(argv[4]) : 0;
+
+    ShardedLdaInfer infer(addresses, alpha, 0.0, 10, 100);
+    if (cache_size > 0)  infer.EnableCache(cache_size, 0.0);
+    infer.SetFoldIn(fold_in_tokens);
+    if (!infer.Connect())  return 1;
+
+    Document doc;
+    vector<string> tokens;
+    string line;
+    size_t failed = 0;
+    while (getline(cin, line))
+    {
+        boost::split(tokens, line, boost::is_any_of(" "), boost::token_compress_on);
+        if (!infer.Infer(tokens, &doc))  ++failed;
+
+        cout<<line<<'\t';
+        const vector<int>& topics = doc._accumulate_topic_dist.Keys();
+        bool first = true;
+        for (size_t i = 0; i < topics.size(); ++i)
+        {
+            double prob = doc._accumulate_topic_dist.Get(topics[i]);
+            if (prob <= 1e-4)  continue;
+            cout<<(first ? "" : " ")<<topics[i]<<':'<<prob;
+            first = false;
+        }
+        cout<<'\n';
+    }
+
+    ShardFetchStats stats = infer.GetStats();
+    LOG(INFO)<<stats._queries<<" queries, "<<failed<<" failed, "<<stats._words<<" words, "
+             <<stats._cache_hits<<" cache hits, "<<stats._requests<<" shard requests";
+    return 0;
+}
@@ -0,0 +1,339 @@
+#ifndef SHARDED_MODEL_H_
+#define SHARDED_MODEL_H_
+
+#include "model.h"
+#include "model_shard.h"
+#include "frame_server.h"
+
+// the front end of a model split by word, see model_shard.h: the rows of
+// the words of a query are fetched from the shards that hold them, with
+// one request per shard, all of them written before any response is read,
+// so a query costs one round trip whatever the number of shards. the rows
+// are kept in an LRU cache, the frequent words are not fetched again. the
+// query is then inferred by the unchanged LdaInfer on a model made of its
+// rows only, the result is the same as on the whole model.
+
+// a fetched row, also the value of the row cache
+struct ShardRow
+{
+    bool _known;                      // false for a word unseen by the model
+    vector<int> _topic;
+    vector<float> _prob;
+};
+
+typedef QueryCache<ShardRow> ShardRowCache;
+
+struct ShardFetchStats
+{
+    uint64_t _queries;
+    uint64_t _words;                  // distinct words of the queries
+    uint64_t _cache_hits;
+    uint64_t _requests;               // one per shard and query with a row to fetch
+
+    ShardFetchStats() : _queries(0), _words(0), _cache_hits(0), _requests(0) { }
+};
+
+// what Connect() learnt of the shards, a new one on every Connect(). it is
+// also the version of the cached rows
+struct ShardedModelInfo
+{
+    vector<double> _topic_total;      // of the whole model, the same on every shard
+};
+
+// per thread connections to the shards and buffers of a query
+struct ShardWorkspace
+{
+    vector<int> _fd;                  // shard -> connection, -1 until connected
+    vector<string> _request;          // shard -> request payload of the query
+    vector<vector<int> > _fetch;      // shard -> index in _words of the rows to fetch
+    vector<string> _words;            // distinct words of the query
+    vector<ShardRow> _rows;
+    vector<char> _fetched;            // index in _words -> fetched by this query
+    string _frame;
+
+    ~ShardWorkspace()
+    {
+        for (size_t i = 0; i < _fd.size(); ++i)
+            if (_fd[i] >= 0)  close(_fd[i]);
+    }
+};
+
+class ShardedModelClient {
+public:
+    // addresses[i] is shard i, a unix socket path if it contains '/', a
+    // local tcp port otherwise, as for lda_server
+    explicit ShardedModelClient(const vector<string>& addresses)
+    : _addresses(addresses), _cache(NULL) { }
+
+    ~ShardedModelClient()
+    {
+        delete _cache;
+    }
+
+    // keeps the rows of the last capacity words for ttl_seconds (<= 0:
+    // until evicted). call it before serving
+    void EnableCache(size_t capacity, double ttl_seconds, int num_shards = 16)
+    {
+        delete _cache;
+        _cache = new ShardRowCache(capacity, ttl_seconds, num_shards, _info.Get());
+    }
+
+    // asks every shard for its info and checks that they are the shards of
+    // one model, in order. call it before serving, and again once the
+    // shards loaded a new model, which empties the cache
+    bool Connect()
+    {
+        vector<double> topic_total;
+        for (size_t i = 0; i < _addresses.size(); ++i)
+        {
+            int fd = ConnectToShard(_addresses[i]);
+            string buf, payload;
+            bool ok = fd >= 0 && WriteFrame(fd, "I", &buf) && ReadFrame(fd, kMaxShardFrameSize, &payload);
+            if (fd >= 0)  close(fd);
+            ShardReader reader(payload.data(), payload.size());
+            uint32_t shard_index, num_shards, num_topic;
+            ok = ok && reader.ReadUint32(&shard_index) && reader.ReadUint32(&num_shards)
+                 && reader.ReadUint32(&num_topic);
+            vector<double> shard_total(ok ? num_topic : 0);
+            for (size_t t = 0; t < shard_total.size(); ++t)
+                ok = ok && reader.ReadDouble(&shard_total[t]);
+            if (!ok || !reader.AtEnd())
+            {
+                LOG(ERROR)<<"shard info failed: "<<_addresses[i];
+                return false;
+            }
+            if (shard_index != i || num_shards != _addresses.size() || (i > 0 && shard_total != topic_total))
+            {
+                LOG(ERROR)<<"shard "<<_addresses[i]<<" is shard "<<shard_index<<" of "<<num_shards
+                          <<", not shard "<<i<<" of "<<_addresses.size()<<" of the model";
+                return false;
+            }
+            topic_total.swap(shard_total);
+        }
+        ShardedModelInfo* info = new ShardedModelInfo();
+        info->_topic_total.swap(topic_total);
+        InfoPtr info_ptr(info);
+        _info.Publish(info_ptr);
+        if (_cache != NULL)  _cache->Invalidate(info_ptr);
+        LOG(INFO)<<"connected to "<<_addresses.size()<<" shards, num_topic="<<info->_topic_total.size();
+        return true;
+    }
+
+    // the model of the words of tokens only, with their alias tables if
+    // alias_table. NULL if a shard fails, its connection is opened again by
+    // the next query, or before Connect(). safe to call from many threads at
+    // once
+    ModelPtr FetchModel(const vector<string>& tokens, bool alias_table)
+    {
+        InfoPtr info = _info.Get();
+        if (!info)  return ModelPtr();
+        ShardWorkspace& ws = *_workspace.Get();
+        size_t num_shards = _addresses.size();
+        if (ws._fd.size() != num_shards)
+        {
+            ws._fd.resize(num_shards, -1);
+            ws._request.resize(num_shards);
+            ws._fetch.resize(num_shards);
+        }
+        ws._words.assign(tokens.begin(), tokens.end());
+        sort(ws._words.begin(), ws._words.end());
+        ws._words.erase(unique(ws._words.begin(), ws._words.end()), ws._words.end());
+        ws._rows.resize(ws._words.size());
+        ws._fetched.assign(ws._words.size(), 0);
+        __sync_fetch_and_add(&_stats._queries, 1);
+        __sync_fetch_and_add(&_stats._words, ws._words.size());
+
+        for (size_t s = 0; s < num_shards; ++s)
+            ws._fetch[s].clear();
+        for (size_t i = 0; i < ws._words.size(); ++i)
+        {
+            if (_cache != NULL && _cache->Lookup(ws._words[i], info, &ws._rows[i]))
+            {
+                __sync_fetch_and_add(&_stats._cache_hits, 1);
+                continue;
+            }
+            ws._fetch[ShardOfWord(ws._words[i], num_shards)].push_back(i);
+            ws._fetched[i] = 1;
+        }
+
+        // every request out before the first response is read
+        bool ok = true;
+        for (size_t s = 0; s < num_shards && ok; ++s)
+        {
+            if (ws._fetch[s].empty())  continue;
+            string& request = ws._request[s];
+            request.assign(1, 'R');
+            AppendShardUint32(ws._fetch[s].size(), &request);
+            for (size_t j = 0; j < ws._fetch[s].size(); ++j)
+            {
+                const string& word = ws._words[ws._fetch[s][j]];
+                AppendShardUint32(word.size(), &request);
+                request.append(word);
+            }
+            if (ws._fd[s] < 0)  ws._fd[s] = ConnectToShard(_addresses[s]);
+            ok = ws._fd[s] >= 0 && WriteFrame(ws._fd[s], request, &ws._frame);
+            if (ok)  __sync_fetch_and_add(&_stats._requests, 1);
+            else  Disconnect(&ws, s);
+        }
+        for (size_t s = 0; s < num_shards && ok; ++s)
+        {
+            if (ws._fetch[s].empty())  continue;
+            ok = ReadFrame(ws._fd[s], kMaxShardFrameSize, &ws._frame) && ParseRows(ws._frame, ws._fetch[s], &ws._rows);
+            if (!ok)  Disconnect(&ws, s);
+        }
+        if (!ok)
+        {
+            // the responses left on the other connections belong to no query
+            for (size_t s = 0; s < num_shards; ++s)
+                if (!ws._fetch[s].empty())  Disconnect(&ws, s);
+            LOG(ERROR)<<"fetch of the rows of a query failed";
+            return ModelPtr();
+        }
+
+        vector<string> words;
+        vector<WordTopicRow> rows;
+        for (size_t i = 0; i < ws._words.size(); ++i)
+        {
+            const ShardRow& row = ws._rows[i];
+            // a cache hit is not inserted again, its ttl runs from its fetch
+            if (_cache != NULL && ws._fetched[i])
+                _cache->Insert(ws._words[i], info, row);
+            if (!row._known)  continue;
+            words.push_back(ws._words[i]);
+            rows.push_back(WordTopicRow(TopicIdArray(row._topic.empty() ? NULL : &row._topic[0], 32),
+                                        ProbArray(row._prob.empty() ? NULL : &row._prob[0], 32, NULL),
+                                        row._topic.size()));
+        }
+        Model* model = new Model();
+        model->BuildFromRows(words, rows, info->_topic_total);
+        if (alias_table)  model->BuildAliasTable();
+        return ModelPtr(model);
+    }
+
+    // 0 before Connect()
+    inline int GetTopicNum() const
+    {
+        InfoPtr info = _info.Get();
+        return info ? info->_topic_total.size() : 0;
+    }
+
+    ShardFetchStats GetStats() const
+    {
+        ShardFetchStats stats;
+        stats._queries = __sync_fetch_and_add(const_cast<uint64_t*>(&_stats._queries), 0);
+        stats._words = __sync_fetch_and_add(const_cast<uint64_t*>(&_stats._words), 0);
+        stats._cache_hits = __sync_fetch_and_add(const_cast<uint64_t*>(&_stats._cache_hits), 0);
+        stats._requests = __sync_fetch_and_add(const_cast<uint64_t*>(&_stats._requests), 0);
+        return stats;
+    }
+
+private:
+    typedef SnapshotSlot<const ShardedModelInfo>::Ptr InfoPtr;
+
+    static int ConnectToShard(const string& address)
+    {
+        int fd = ConnectTo(address);
+        if (fd < 0)  LOG(WARNING)<<"connect to shard "<<address<<" failed: "<<strerror(errno);
+        return fd;
+    }
+
+    static void Disconnect(ShardWorkspace* ws, size_t shard)
+    {
+        if (ws->_fd[shard] >= 0)  close(ws->_fd[shard]);
+        ws->_fd[shard] = -1;
+    }
+
+    // the rows of a response into rows[fetch[...]]
+    static bool ParseRows(const string& payload, const vector<int>& fetch, vector<ShardRow>* rows)
+    {
+        ShardReader reader(payload.data(), payload.size());
+        for (size_t j = 0; j < fetch.size(); ++j)
+        {
+            ShardRow& row = (*rows)[fetch[j]];
+            uint32_t size;
+            if (!reader.ReadUint32(&size))  return false;
+            row._known = size != kUnknownRow;
+            if (!row._known)  size = 0;
+            if (size > payload.size())  return false;
+            row._topic.resize(size);
+            row._prob.resize(size);
+            for (uint32_t k = 0; k < size; ++k)
+            {
+                uint32_t topic;
+                if (!reader.ReadUint32(&topic) || !reader.ReadFloat(&row._prob[k]))  return false;
+                row._topic[k] = topic;
+            }
+        }
+        return reader.AtEnd();
+    }
+
+private:
+    vector<string> _addresses;
+    // empty until Connect()
+    SnapshotSlot<const ShardedModelInfo> _info;
+    ThreadLocal<ShardWorkspace> _workspace;
+    // NULL unless EnableCache()
+    ShardRowCache* _cache;
+    ShardFetchStats _stats;
+};
+
+// LdaInfer over a model split by word: every Infer() fetches the rows of
+// its words, see ShardedModelClient
+class ShardedLdaInfer {
+public:
+    ShardedLdaInfer(const vector<string>& addresses, double alpha, double beta, int burnin_iter, int max_iter,
+                    SamplerType sampler = SAMPLER_LINEAR, int mh_steps = 2)
+    : _client(addresses), _infer(alpha, beta, burnin_iter, max_iter, sampler, mh_steps),
+      _alias_table(sampler == SAMPLER_ALIAS_MH) { }
+
+    // see ShardedModelClient
+    void EnableCache(size_t capacity, double ttl_seconds, int num_shards = 16)
+    {
+        _client.EnableCache(capacity, ttl_seconds, num_shards);
+    }
+
+    bool Connect()
+    {
+        return _client.Connect();
+    }
+
+    // see LdaInfer::SetFoldIn() and LdaInfer::SetTolerance()
+    void SetFoldIn(int max_tokens, int max_iter = 20)
+    {
+        _infer.SetFoldIn(max_tokens, max_iter);
+    }
+
+    void SetTolerance(double tolerance)
+    {
+        _infer.SetTolerance(tolerance);
+    }
+
+    // as LdaInfer::Infer(), the word ids of doc refer to the model of the
+    // query, given in model if not NULL. false, and doc empty, if a shard
+    // fails
+    bool Infer(const vector<string>& string_doc, Document* doc, InferMethod method = INFER_DEFAULT,
+               ModelPtr* model = NULL)
+    {
+        ModelPtr query_model = _client.FetchModel(string_doc, _alias_table);
+        if (!query_model)
+        {
+            doc->Clear();
+            return false;
+        }
+        _infer.Infer(*query_model, string_doc, doc, method);
+        if (model != NULL)  model->swap(query_model);
+        return true;
+    }
+
+    ShardFetchStats GetStats() const
+    {
+        return _client.GetStats();
+    }
+
+private:
+    ShardedModelClient _client;
+    LdaInfer _infer;
+    bool _alias_table;
+};
+
+#endif
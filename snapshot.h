@@ -0,0 +1,56 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <pthread.h>
+#include <tr1/memory>
+
+// RCU style publication of a read-mostly object such as a model: a reader
+// takes a reference counted snapshot with Get() and keeps using it for the
+// whole request, Publish() swaps in a new version at any time. the old
+// version is freed when its last reader lets go of it, so a swap neither
+// blocks the readers nor pulls the object from under them. the spinlock
+// only guards the copy of the pointer.
+template<typename T>
+class SnapshotSlot {
+public:
+    typedef std::tr1::shared_ptr<T> Ptr;
+
+    explicit SnapshotSlot(const Ptr& ptr = Ptr()) : _ptr(ptr)
+    {
+        pthread_spin_init(&_lock, PTHREAD_PROCESS_PRIVATE);
+    }
+
+    ~SnapshotSlot()
+    {
+        pthread_spin_destroy(&_lock);
+    }
+
+    Ptr Get() const
+    {
+        pthread_spin_lock(&_lock);
+        Ptr ptr = _ptr;
+        pthread_spin_unlock(&_lock);
+        return ptr;
+    }
+
+    void Publish(const Ptr& ptr)
+    {
+        Ptr old = ptr;
+        pthread_spin_lock(&_lock);
+        _ptr.swap(old);
+        pthread_spin_unlock(&_lock);
+        // the previous version, possibly the last reference, is released
+        // here outside of the lock
+    }
+
+private:
+    // disallow copy and assignment
+    SnapshotSlot(const SnapshotSlot&);
+    SnapshotSlot& operator = (const SnapshotSlot&);
+
+private:
+    mutable pthread_spinlock_t _lock;
+    Ptr _ptr;
+};
+
+#endif
@@ -6,6 +6,11 @@
 #include <string>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include "model_file.h"
+#include "random.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "benchmark.h"
 #include <algorithm>
 #include <functional>
 #include <ext/functional>
@@ -31,64 +36,96 @@ ostream& operator<<(ostream& out, vector<float>& v)
 }
 
 
+class LdaModel;
+// a loaded model, pinned by a predictor for the duration of predict()
+typedef tr1::shared_ptr<const LdaModel> LdaModelPtr;
+// the model being served. a retrained model is loaded in the background
+// with LdaModel::load() and swapped in with Publish(), the predictions in
+// flight finish on the previous one
+typedef SnapshotSlot<const LdaModel> LdaModelSlot;
+
 class LdaModel {
 public:
-    static inline LdaModel& get_instance(string model_file, int num_topic, float alpha)
-    {
-        static LdaModel lda_model(model_file, num_topic, alpha);
-        //if (NULL == _p_lda_model)
-        //{
-        //    _p_lda_model = new LdaModel(model_file, num_topic, alpha);
-        //}
-        return lda_model;
-    }
-
-    ~LdaModel()
+    // NULL if model_file can not be loaded
+    static LdaModelPtr load(const string& model_file, int num_topic, float alpha, float beta = 0.0f)
     {
-        for (unordered_map<int, unordered_map<int, float>* >::iterator iter=_wor2top.begin();
-             iter != _wor2top.end();
-             ++iter)
-        {    delete iter->second;  }
+        LdaModel* lda_model = new LdaModel(num_topic, alpha, beta);
+        if (!lda_model->load_model(model_file, num_topic))
+        {
+            delete lda_model;
+            return LdaModelPtr();
+        }
+        lda_model->calc_buckets();
+        return LdaModelPtr(lda_model);
     }
 
 private:
-    LdaModel(const string& model_file, int num_topic, float alpha) 
-     : _num_topic(num_topic), _alpha(alpha)
+    LdaModel(int num_topic, float alpha, float beta) 
+     : _num_topic(num_topic), _alpha(alpha), _beta(beta) { }
+
+    // load model file, either the text format
+    //   topic_id  \t  wordid:count space word:count ...
+    // or its binary form written by convert_model
+    bool load_model(const string& model_file, int num_topic)
     {
-        load_model(model_file, num_topic);
+        bool ok = ModelData::IsBinaryFile(model_file) ? _model_data.Map(model_file)
+                                                      : _model_data.LoadText(model_file);
+        if (!ok)  return false;
+        _num_topic = max(num_topic, _model_data.GetTopicNum());
+
+        // the words of the model are wordids, map them to rows of the word->topic table
+        for (int i = 0; i < _model_data.GetVocabNum(); ++i)
+        {
+            int wordid = boost::lexical_cast<int>(_model_data.GetWord(i));
+            if (wordid >= static_cast<int>(_word_index.size()))
+                _word_index.resize(wordid + 1, -1);
+            _word_index[wordid] = i;
+        }
+        return true;
     }
 
-    // load model file
-    // format:  topic_id  \t  wordid:count space word:count ...
-    void load_model(const string& model_file, int num_topic)
+    // the posterior of SparseLDA (Yao et al. 2009) with a fixed model
+    //   p(z=k) ~ (alpha + n_dk) (n_wk + beta) / (n_k + V beta)
+    //          = alpha beta / (n_k + V beta)            smoothing bucket s
+    //          + n_dk beta / (n_k + V beta)             document bucket r
+    //          + (alpha + n_dk) n_wk / (n_k + V beta)   word bucket q
+    // precompute what does not depend on the document: the normalizer and
+    // cdf of s, and per word the cdf of alpha * n_wk / (n_k + V beta)
+    void calc_buckets()
     {
-        _num_topic = num_topic;
-        _topsum.resize(_num_topic, 0.0f);
+        int num_word = _model_data.GetVocabNum();
 
-        ifstream ifs(model_file.c_str());
-        string buf;
-        while(getline(ifs, buf))
+        _topic_norm.resize(_num_topic);
+        _topic_scale.resize(_num_topic);
+        _smooth_cdf.resize(_num_topic);
+        double smooth_mass = 0.0;
+        for (int k = 0; k < _num_topic; ++k)
         {
-            istringstream ss(buf);
-            int topic_id;
-            ss >> topic_id;
+            double n_k = k < _model_data.GetTopicNum() ? _model_data.GetTopicTotalCount(k) : 0.0;
+            double norm = n_k + num_word * _beta;
+            _topic_norm[k] = norm > 0 ? 1.0 / norm : 0.0;
+            // n_wk / (n_k + V beta) == p(w|z) * _topic_scale[k]
+            _topic_scale[k] = n_k * _topic_norm[k];
+            smooth_mass += _alpha * _beta * _topic_norm[k];
+            _smooth_cdf[k] = smooth_mass;
+        }
 
-            string item;
-            while(ss >> item)  
+        _row_offset.resize(num_word + 1);
+        _word_cdf.resize(_model_data.GetEntryNum());
+        uint32_t begin = 0;
+        for (int i = 0; i < num_word; ++i)
+        {
+            WordTopicRow row = _model_data.GetWordTopicRow(i);
+            _row_offset[i] = begin;
+            double mass = 0.0;
+            for (int j = 0; j < row._size; ++j)
             {
-                vector<string> tokens;
-                boost::split(tokens, item, boost::is_any_of(":"));
-                int wordid = boost::lexical_cast<int>(tokens[0]);
-                float count = boost::lexical_cast<float>(tokens[1]);
-                _topsum[topic_id] += count;
-
-                if (_wor2top.find(wordid) == _wor2top.end())
-                {
-                    _wor2top[wordid] = new unordered_map<int, float>(); 
-                }
-                (*_wor2top[wordid])[topic_id] = count;
+                mass += _alpha * row._prob[j] * _topic_scale[row._topic[j]];
+                _word_cdf[begin + j] = mass;
             }
+            begin += row._size;
         }
+        _row_offset[num_word] = begin;
     }
    
     // disallow copy and assignment
@@ -96,35 +133,116 @@ private:
     LdaModel& operator = (const LdaModel&);
 
 public:
-    // wordid  topicid::count
-    unordered_map<int, unordered_map<int, float>* > _wor2top;
-    // topic's total word count 
-    vector<float> _topsum; 
+    inline bool has_word(int wordid) const
+    {
+        return wordid >= 0 && wordid < static_cast<int>(_word_index.size()) && _word_index[wordid] >= 0;
+    }
+
+    // row of _model_data of wordid, wordid must be known by model
+    inline int word_row(int wordid) const
+    {
+        return _word_index[wordid];
+    }
+
+    // n_wk / (n_k + V beta), 0 if topic k is not in the row
+    inline double word_coef(int row, int topic) const
+    {
+        return _model_data.GetWordTopicProb(row, topic) * _topic_scale[topic];
+    }
+
+    // total mass of the alpha part of the word bucket
+    inline double word_mass(int row) const
+    {
+        uint32_t end = _row_offset[row + 1];
+        return end > _row_offset[row] ? _word_cdf[end - 1] : 0.0;
+    }
+
+    // topic of the alpha part of the word bucket at mass u
+    inline int sample_word_bucket(int row, double u) const
+    {
+        const double* first = &_word_cdf[0] + _row_offset[row];
+        const double* last = &_word_cdf[0] + _row_offset[row + 1];
+        const double* iter = upper_bound(first, last, u);
+        if (iter == last)  --iter;
+        return _model_data.GetWordTopicRow(row)._topic[iter - first];
+    }
+
+    // topic of the smoothing bucket at mass u
+    inline int sample_smooth_bucket(double u) const
+    {
+        vector<double>::const_iterator iter = upper_bound(_smooth_cdf.begin(), _smooth_cdf.end(), u);
+        if (iter == _smooth_cdf.end())  --iter;
+        return iter - _smooth_cdf.begin();
+    }
+
+    inline double smooth_mass() const
+    {
+        return _smooth_cdf.empty() ? 0.0 : _smooth_cdf.back();
+    }
+
+    // word->topic table, shared with the other predictors
+    ModelData _model_data;
+    // wordid -> row of _model_data, -1 if unseen
+    vector<int> _word_index;
     int _num_topic;
     float _alpha;
+    float _beta;
+
+    // 1 / (n_k + V beta)
+    vector<double> _topic_norm;
+    // n_k / (n_k + V beta)
+    vector<double> _topic_scale;
+    // cdf of the smoothing bucket over all topics
+    vector<double> _smooth_cdf;
+    // per word cdf of alpha * n_wk / (n_k + V beta), rows as in _model_data
+    vector<uint32_t> _row_offset;
+    vector<double> _word_cdf;
 
 };
 
 //LdaModel* LdaModel::_p_lda_model = NULL;
 
 
+// Trace is the trace level, see trace.h
+template<typename Trace = DefaultTrace>
 class SparseLdaPredictor{
 public:
-    SparseLdaPredictor(LdaModel& lda_model) : _lda_model(lda_model) { }
+    // one predictor per thread, they can share one LdaModelSlot. every
+    // predict() runs on the model published at its start
+    SparseLdaPredictor(const LdaModelSlot& lda_models, uint64_t seed = NextRandomSeed())
+     : _lda_models(lda_models), _rng(seed), _len(0), _doc_bucket(0.0) { }
 
     friend class LdaModel;
+
+    // restart the random stream, the result is reproducible for a given seed
+    void seed(uint64_t seed)
+    {
+        _rng.Seed(seed);
+    }
+
+    // forget the previous document, predict() starts with it
+    void reset()
+    {
+        _doc.clear();
+        _wor2top.clear();
+        _doc_topics.clear();
+        _doc_bucket = 0.0;
+        _len = 0;
+    }
     
     void predict(const vector<int>& word_vector, int max_step, vector<pair<int, int> >& topic_vector)
     {
+       reset();
+       _lda_model = _lda_models.Get();
        for (size_t i=0; i<word_vector.size(); ++i)
        {
-           if (_lda_model._wor2top.find(word_vector[i]) != _lda_model._wor2top.end())
+           if (_lda_model->has_word(word_vector[i]))
                _doc.push_back(word_vector[i]);
        }
        _len = _doc.size();
 
        init_predictor();
-       // start rt lda inference
+       // start sparse lda inference
 
        int step = 0;
        while (step < max_step)
@@ -133,92 +251,128 @@ public:
            {
                int old_topic = _wor2top[i];
                int word = _doc[i];
-               cout<<"-------- step "<<step<<", word "<<word<<", old_topic "<<old_topic<<"-----------"<<endl;
-               cout<<_wor2top<<endl;
-               unordered_map<int, float> *p_top_of_wor = _lda_model._wor2top[word];
-               unordered_map<int, float> prob;
-               for (unordered_map<int, float>::iterator iter = p_top_of_wor->begin();
-                    iter != p_top_of_wor->end();
-                    ++iter)
+               if (Trace::kEnabled)
                {
-                   int cur_topic = iter->first;
-                   int adjust = 0;
-                   if (old_topic == cur_topic && 
-                       _doc2top.find(cur_topic) != _doc2top.end() && 
-                       _doc2top[cur_topic] > 0)
-                   {
-                       adjust = 1;
-                   }
-                   int theta = _doc2top[cur_topic] - adjust;
-                   prob[cur_topic] = iter->second / _lda_model._topsum[cur_topic]
-                                       * (theta + _lda_model._alpha);
-                   cout<<"cur_topic="<<cur_topic
-                       <<" theta="<<theta
-                       <<" p(w|z)="<<iter->second / _lda_model._topsum[iter->first]
-                       <<" p(w z)="<<prob[cur_topic]<<endl;
+                   Trace::Sink()<<"-------- step "<<step<<", word "<<word<<", old_topic "<<old_topic<<"-----------"<<endl;
+                   Trace::Sink()<<_wor2top<<endl;
                }
-               int sample = random_sparse_multinomial(prob);
 
-               // adjust topic assignment
-               if (old_topic != sample)
-               {
-                   _wor2top[i] = sample;
-                   _doc2top[old_topic] --;
-                   
-                   if (_doc2top.find(sample) != _doc2top.end())
-                   {
-                       _doc2top[sample] ++;
-                   }
-                   else
-                   {
-                       _doc2top[sample] = 1;
-                   }
-               }
-               cout<<"+++++ sample="<<sample<<"  after adjust: "<<_wor2top<<endl;
+               // take the token out of the document, the buckets see n_dk without it
+               update_doc_topic(old_topic, -1);
+               int sample = sample_topic(_lda_model->word_row(word));
+               update_doc_topic(sample, 1);
+               _wor2top[i] = sample;
+
+               if (Trace::kEnabled)  Trace::Sink()<<"+++++ sample="<<sample<<"  after adjust: "<<_wor2top<<endl;
            }//end for
            step++;
        }// end while
       
        topic_vector.resize(_doc.size());
        transform(_doc.begin(), _doc.end(), _wor2top.begin(), topic_vector.begin(), make_pair<int, int>);
+       // don't keep an old model alive between the predictions
+       _lda_model.reset();
     }
 
 
 private:
     void init_predictor()
     {
+        _doc2top.assign(_lda_model->_num_topic, 0);
+        _doc_topic_pos.assign(_lda_model->_num_topic, -1);
+        _doc_topics.clear();
+        _doc_bucket = 0.0;
+
         _wor2top.resize(_len); 
         for (int i = 0; i<_len; ++i)
         {
             int topic = random_topic();
             _wor2top[i] = topic;
-            if (_doc2top.find(topic) == _doc2top.end())
-                _doc2top[topic] = 1;
-            else
-                _doc2top[topic] += 1;
+            update_doc_topic(topic, 1);
         }
     }
 
+    // n_dk += delta, keeps the nonzero topic list and the cached document
+    // bucket normalizer r = sum_k n_dk beta / (n_k + V beta) up to date
+    inline void update_doc_topic(int topic, int delta)
+    {
+        _doc2top[topic] += delta;
+        _doc_bucket += delta * _lda_model->_beta * _lda_model->_topic_norm[topic];
+        if (_doc2top[topic] > 0 && _doc_topic_pos[topic] < 0)
+        {
+            _doc_topic_pos[topic] = _doc_topics.size();
+            _doc_topics.push_back(topic);
+        }
+        else if (_doc2top[topic] == 0 && _doc_topic_pos[topic] >= 0)
+        {
+            int last = _doc_topics.back();
+            _doc_topics[_doc_topic_pos[topic]] = last;
+            _doc_topic_pos[last] = _doc_topic_pos[topic];
+            _doc_topics.pop_back();
+            _doc_topic_pos[topic] = -1;
+        }
+    }
+
+    // draws from s + r + q, only the nonzero topics of the document are visited
+    int sample_topic(int row)
+    {
+        // n_dk part of the word bucket
+        double q_doc = 0.0;
+        _doc_weight.resize(_doc_topics.size());
+        for (size_t j = 0; j < _doc_topics.size(); ++j)
+        {
+            int topic = _doc_topics[j];
+            _doc_weight[j] = _doc2top[topic] * _lda_model->word_coef(row, topic);
+            q_doc += _doc_weight[j];
+        }
+        double q_word = _lda_model->word_mass(row);
+        double r = max(_doc_bucket, 0.0);
+        double s = _lda_model->smooth_mass();
+
+        double u = uniform() * (q_doc + q_word + r + s);
+        if (u < q_doc)
+        {
+            for (size_t j = 0; j < _doc_topics.size(); ++j)
+            {
+                u -= _doc_weight[j];
+                if (u <= 0)  return _doc_topics[j];
+            }
+            return _doc_topics.back();
+        }
+        u -= q_doc;
+        if (u < q_word || (r + s) <= 0)
+            return _lda_model->sample_word_bucket(row, u);
+        u -= q_word;
+        if (u < r && !_doc_topics.empty())
+        {
+            for (size_t j = 0; j < _doc_topics.size(); ++j)
+            {
+                int topic = _doc_topics[j];
+                u -= _doc2top[topic] * _lda_model->_beta * _lda_model->_topic_norm[topic];
+                if (u <= 0)  return topic;
+            }
+            return _doc_topics.back();
+        }
+        u -= r;
+        return _lda_model->sample_smooth_bucket(u);
+    }
 
     inline int random_topic()
     {
-        return static_cast<int>(rand() / static_cast<double>(RAND_MAX) * _lda_model._num_topic);
+        return _rng.UniformInt(_lda_model->_num_topic);
     }
 
-    inline int random_sparse_multinomial(unordered_map<int, float>& prob)
+    // uniform in [0, 1)
+    inline double uniform()
     {
-        vector<pair<int, float> > prob_vec(prob.begin(), prob.end());
-        size_t sz = prob.size();
-        for (size_t i=1; i<sz; ++i)
-            prob_vec[i].second += prob_vec[i-1].second;
-        double rdm = rand() / static_cast<double>(RAND_MAX) * prob_vec[sz-1].second;
-        vector<pair<int, float> >::iterator iter = find_if(prob_vec.begin(), prob_vec.end(), 
-                                  compose1(bind1st(less_equal<double>(), rdm), _Select2nd<pair<int, float> >()));
-        return iter->first;
+        return _rng.Uniform();
     }
 
 private:
-    LdaModel&  _lda_model;
+    const LdaModelSlot& _lda_models;
+    // model of the running predict()
+    LdaModelPtr _lda_model;
+    Random _rng;
     // word vector
     vector<int> _doc;
     // topic vector for each word
@@ -226,7 +380,14 @@ private:
     // doc length
     int _len;
     // topic -> count
-    unordered_map<int, int> _doc2top;
+    vector<int> _doc2top;
+    // nonzero topics of _doc2top, and their position in it (-1 if zero)
+    vector<int> _doc_topics;
+    vector<int> _doc_topic_pos;
+    // cached document bucket normalizer
+    double _doc_bucket;
+    // scratch, n_dk * n_wk / (n_k + V beta) of _doc_topics
+    vector<double> _doc_weight;
 };
 
 }
@@ -234,55 +395,118 @@ private:
 
 using namespace lda;
 
-#define rdtsc(low,high) __asm__ \
- __volatile__("rdtsc" : "=a" (low), "=d" (high))
-unsigned long long get_cycles()
+// one predict() per query, for the benchmark
+class PredictTask : public ParallelTask {
+public:
+    PredictTask(SparseLdaPredictor<>* predictor, const vector<vector<int> >& queries, int max_step)
+    : _predictor(predictor), _queries(queries), _max_step(max_step) { }
+
+    virtual void Run(int index)
+    {
+        _output.clear();
+        _predictor->predict(_queries[index % _queries.size()], _max_step, _output);
+    }
+
+private:
+    SparseLdaPredictor<>* _predictor;
+    const vector<vector<int> >& _queries;
+    int _max_step;
+    vector<pair<int, int> > _output;
+};
+
+// model load and predict() latency over synthetic queries and the wordid
+// lines of query_file, see benchmark.h
+static int RunBenchmark(float alpha, float beta, int num_topic, const string& model_file, int max_step,
+                        const string& query_file, const string& json_file, size_t num_queries)
 {
-    unsigned low, high;
-    unsigned long long val;
-    rdtsc(low,high);
-    val = high;
-    val = (val << 32) | low; //将 low 和 high 合成一个 64 位值
-    return val;
-}
-double mhz = 2128.054 * 1000;
+    BenchmarkReport report;
+    uint64_t start = NowNs();
+    LdaModelPtr lda_model = LdaModel::load(model_file, num_topic, alpha, beta);
+    if (!lda_model)
+    {
+        cout<<"load model failed: "<<model_file<<endl;
+        return 1;
+    }
+    report.AddTime("sparse_model_load", (NowNs() - start) * 1e-9);
+    LdaModelSlot lda_models(lda_model);
+    SparseLdaPredictor<> predictor(lda_models, 1);
+
+    vector<vector<int> > queries;
+    MakeSyntheticQueries(lda_model->_model_data, num_queries, 8, 1, &queries);
+    for (size_t i = 0; i < queries.size(); ++i)
+        for (size_t j = 0; j < queries[i].size(); ++j)
+            queries[i][j] = boost::lexical_cast<int>(lda_model->_model_data.GetWord(queries[i][j]));
+    PredictTask task(&predictor, queries, max_step);
+    report.Run("sparse_predict", "synthetic", &task, num_queries, num_queries / 10 + 1);
+
+    if (query_file != "-")
+    {
+        vector<vector<string> > lines;
+        if (!ReadQueries(query_file, &lines) || lines.empty())
+        {
+            cout<<"read queries failed: "<<query_file<<endl;
+            return 1;
+        }
+        queries.assign(lines.size(), vector<int>());
+        for (size_t i = 0; i < lines.size(); ++i)
+            for (size_t j = 0; j < lines[i].size(); ++j)
+                queries[i].push_back(boost::lexical_cast<int>(lines[i][j]));
+        PredictTask replay_task(&predictor, queries, max_step);
+        report.Run("sparse_predict", "replay", &replay_task, queries.size(), queries.size() / 10 + 1);
+    }
 
+    report.Print(cerr);
+    return report.WriteJson(json_file) ? 0 : 1;
+}
 
 int main(int argc, char *argv[])
 {
-    
     if (argc < 5)
     {
-        cout<<"Usage : "<< argv[0]<<" alpha num_topic model_file query"<<endl;
+        cout<<"Usage : "<< argv[0]<<" alpha num_topic model_file query [beta]"<<endl;
+        cout<<"        "<< argv[0]<<" alpha num_topic model_file --bench [beta] [query_file|-] [json_file|-] [num_queries]"<<endl;
         return 0;
     }
-    srand(time(NULL));
     float alpha = boost::lexical_cast<float>(argv[1]);
     int num_topic = boost::lexical_cast<int>(argv[2]);
     string model_file = argv[3];
     string query = argv[4];
+    float beta = argc > 5 ? boost::lexical_cast<float>(argv[5]) : 0.0f;
 
     int max_step = 10;
 
-    long long t_start, t_end;
+    if (query == "--bench")
+    {
+        return RunBenchmark(alpha, beta, num_topic, model_file, max_step,
+                            argc > 6 ? argv[6] : "-", argc > 7 ? argv[7] : "-",
+                            argc > 8 ? boost::lexical_cast<size_t>(argv[8]) : 10000);
+    }
+
+    uint64_t t_start, t_end;
 
-    LdaModel& lda_model = LdaModel::get_instance(model_file, num_topic, alpha);
+    LdaModelPtr lda_model = LdaModel::load(model_file, num_topic, alpha, beta);
+    if (!lda_model)
+    {
+        cout<<"load model failed: "<<model_file<<endl;
+        return 1;
+    }
+    LdaModelSlot lda_models(lda_model);
 
-    SparseLdaPredictor predictor(lda_model);
+    SparseLdaPredictor<> predictor(lda_models, time(NULL));
 
     vector<int> input;
     istringstream iss(query);
     string buf;
     while (iss>>buf) { input.push_back(boost::lexical_cast<int>(buf)); }
     
-    t_start = get_cycles();
+    t_start = NowNs();
     vector<pair<int, int> > output;
     predictor.predict(input, max_step, output);
-    t_end = get_cycles();
+    t_end = NowNs();
 
     cout<<"%%%%%%%%%%% final result %%%%%%%%%%%%%%%"<<endl;
     for(size_t i=0; i<output.size(); ++i)
         cout<<output[i].first<<" "<<output[i].second<<endl;
-    cout<<"cost "<<(t_end - t_start)/mhz<<" ms"<<endl;
+    cout<<"cost "<<(t_end - t_start) * 1e-6<<" ms"<<endl;
     return 0;
 }
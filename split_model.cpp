@@ -0,0 +1,51 @@
+#include <iostream>
+#include <stdlib.h>
+#include <sstream>
+#include "model_shard.h"
+using namespace std;
+
+// split a model by word into num_shards binary models, output_prefix.0 to
+// output_prefix.<num_shards - 1>, each served by an lda_shard, see
+// model_shard.h. the shards keep p(w|z) of the whole model
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        cout<<"Usage: "<<argv[0]<<" model_file num_shards output_prefix"<<endl;
+        return 0;
+    }
+
+    string model_file = argv[1];
+    int num_shards = atoi(argv[2]);
+    string output_prefix = argv[3];
+    if (num_shards <= 0)
+    {
+        cerr<<"bad num_shards: "<<argv[2]<<endl;
+        return 1;
+    }
+
+    ModelData model_data;
+    bool ok = ModelData::IsBinaryFile(model_file) ? model_data.Map(model_file)
+                                                  : model_data.LoadText(model_file);
+    if (!ok)
+    {
+        cerr<<"load model failed: "<<model_file<<endl;
+        return 1;
+    }
+
+    for (int i = 0; i < num_shards; ++i)
+    {
+        ostringstream shard_file;
+        shard_file<<output_prefix<<"."<<i;
+        ModelData shard;
+        BuildModelShard(model_data, i, num_shards, &shard);
+        ModelData check;
+        if (!shard.Save(shard_file.str()) || !check.Map(shard_file.str()))
+        {
+            cerr<<"write shard failed: "<<shard_file.str()<<endl;
+            return 1;
+        }
+        cout<<shard_file.str()<<": num_topic="<<check.GetTopicNum()<<" num_vocab="<<check.GetVocabNum()<<endl;
+    }
+    return 0;
+}
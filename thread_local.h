@@ -0,0 +1,83 @@
+#ifndef THREAD_LOCAL_H_
+#define THREAD_LOCAL_H_
+
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+
+// one lazily created T per thread, e.g. the Document workspace of LdaInfer.
+// the object of a thread lives until the thread exits or the ThreadLocal
+// itself is destroyed, so a worker thread keeps its warmed-up buffers
+// across calls.
+template<typename T>
+class ThreadLocal {
+public:
+    ThreadLocal()
+    {
+        pthread_key_create(&_key, &ThreadLocal::ThreadExit);
+        pthread_mutex_init(&_mutex, NULL);
+    }
+
+    ~ThreadLocal()
+    {
+        // no ThreadExit() past this point
+        pthread_key_delete(_key);
+        for (size_t i = 0; i < _objects.size(); ++i)
+        {
+            delete _objects[i]->_object;
+            delete _objects[i];
+        }
+        pthread_mutex_destroy(&_mutex);
+    }
+
+    T* Get()
+    {
+        Slot* slot = static_cast<Slot*>(pthread_getspecific(_key));
+        if (slot == NULL)
+        {
+            slot = new Slot();
+            slot->_owner = this;
+            slot->_object = new T();
+            pthread_setspecific(_key, slot);
+            pthread_mutex_lock(&_mutex);
+            _objects.push_back(slot);
+            pthread_mutex_unlock(&_mutex);
+        }
+        return slot->_object;
+    }
+
+private:
+    struct Slot
+    {
+        ThreadLocal* _owner;
+        T* _object;
+    };
+
+    // key destructor, frees the object of an exiting thread
+    static void ThreadExit(void* arg)
+    {
+        Slot* slot = static_cast<Slot*>(arg);
+        ThreadLocal* owner = slot->_owner;
+        pthread_mutex_lock(&owner->_mutex);
+        typename std::vector<Slot*>::iterator it = std::find(owner->_objects.begin(), owner->_objects.end(), slot);
+        if (it != owner->_objects.end())
+        {
+            *it = owner->_objects.back();
+            owner->_objects.pop_back();
+        }
+        pthread_mutex_unlock(&owner->_mutex);
+        delete slot->_object;
+        delete slot;
+    }
+
+    // disallow copy and assignment
+    ThreadLocal(const ThreadLocal&);
+    ThreadLocal& operator = (const ThreadLocal&);
+
+private:
+    pthread_key_t _key;
+    pthread_mutex_t _mutex;
+    std::vector<Slot*> _objects;
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+// one unit of work of ThreadPool::ParallelFor, Run() is called concurrently
+// from the worker threads
+class ParallelTask {
+public:
+    virtual ~ParallelTask() { }
+    virtual void Run(int index) = 0;
+};
+
+// fixed set of worker threads, started once and reused for every batch
+class ThreadPool {
+public:
+    explicit ThreadPool(int num_threads)
+    : _stop(false), _task(NULL), _num_tasks(0), _next(0), _running(0), _generation(0)
+    {
+        pthread_mutex_init(&_mutex, NULL);
+        pthread_mutex_init(&_call_mutex, NULL);
+        pthread_cond_init(&_work_cond, NULL);
+        pthread_cond_init(&_done_cond, NULL);
+        if (num_threads < 1)  num_threads = 1;
+        _threads.resize(num_threads);
+        for (int i = 0; i < num_threads; ++i)
+            pthread_create(&_threads[i], NULL, &ThreadPool::WorkerMain, this);
+    }
+
+    ~ThreadPool()
+    {
+        pthread_mutex_lock(&_mutex);
+        _stop = true;
+        pthread_cond_broadcast(&_work_cond);
+        pthread_mutex_unlock(&_mutex);
+        for (size_t i = 0; i < _threads.size(); ++i)
+            pthread_join(_threads[i], NULL);
+        pthread_cond_destroy(&_done_cond);
+        pthread_cond_destroy(&_work_cond);
+        pthread_mutex_destroy(&_call_mutex);
+        pthread_mutex_destroy(&_mutex);
+    }
+
+    inline int Size() const { return _threads.size(); }
+
+    // calls task->Run(i) for every i in [0, num_tasks) on the workers, the
+    // indices are handed out one by one, blocks until all of them are done
+    void ParallelFor(int num_tasks, ParallelTask* task)
+    {
+        if (num_tasks <= 0)  return;
+        pthread_mutex_lock(&_call_mutex);
+        pthread_mutex_lock(&_mutex);
+        _task = task;
+        _num_tasks = num_tasks;
+        _next = 0;
+        _running = _threads.size();
+        ++_generation;
+        pthread_cond_broadcast(&_work_cond);
+        while (_running > 0)
+            pthread_cond_wait(&_done_cond, &_mutex);
+        _task = NULL;
+        pthread_mutex_unlock(&_mutex);
+        pthread_mutex_unlock(&_call_mutex);
+    }
+
+private:
+    static void* WorkerMain(void* arg)
+    {
+        static_cast<ThreadPool*>(arg)->Work();
+        return NULL;
+    }
+
+    void Work()
+    {
+        uint64_t seen = 0;
+        pthread_mutex_lock(&_mutex);
+        while (true)
+        {
+            while (!_stop && _generation == seen)
+                pthread_cond_wait(&_work_cond, &_mutex);
+            if (_stop)  break;
+            seen = _generation;
+            ParallelTask* task = _task;
+            int num_tasks = _num_tasks;
+            pthread_mutex_unlock(&_mutex);
+
+            int index;
+            while ((index = __sync_fetch_and_add(&_next, 1)) < num_tasks)
+                task->Run(index);
+
+            pthread_mutex_lock(&_mutex);
+            if (--_running == 0)
+                pthread_cond_signal(&_done_cond);
+        }
+        pthread_mutex_unlock(&_mutex);
+    }
+
+    // disallow copy and assignment
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator = (const ThreadPool&);
+
+private:
+    std::vector<pthread_t> _threads;
+    pthread_mutex_t _mutex;
+    // serializes concurrent ParallelFor callers
+    pthread_mutex_t _call_mutex;
+    pthread_cond_t _work_cond;
+    pthread_cond_t _done_cond;
+
+    bool _stop;
+    ParallelTask* _task;
+    int _num_tasks;
+    volatile int _next;
+    int _running;
+    uint64_t _generation;
+};
+
+#endif
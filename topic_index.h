@@ -0,0 +1,316 @@
+#ifndef TOPIC_INDEX_H_
+#define TOPIC_INDEX_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// relative margin of TopicIndex::Search() for the float rounding of the
+// partial scores
+static const float kTopicScoreSlack = 1e-4f;
+
+// TopicIndex::Search() scans the topics of the query until the bounds of
+// the topics left sum to this part of the k-th score. the bare MaxScore
+// split, 1, leaves so many docs to complete by binary search that it is
+// slower than scanning a few more topics
+static const float kTopicScanRatio = 0.6f;
+
+// per thread workspace of TopicIndex::Search(), reused across queries
+struct TopicSearchWorkspace
+{
+    struct QueryTopic
+    {
+        int _topic;
+        double _weight;               // normalized query weight
+        double _upper_bound;          // _weight * largest posting weight of the topic
+    };
+
+    std::vector<QueryTopic> _topics;
+    std::vector<double> _rest;
+    std::vector<float> _score;        // doc -> partial score, 0 but for _touched
+    std::vector<uint32_t> _touched;
+    std::vector<std::pair<float, uint32_t> > _candidates;
+    std::vector<std::pair<float, uint32_t> > _heap;
+};
+
+// inverted index topic -> (doc, weight) over the topic distributions of a
+// corpus, e.g. a query log inferred by model2, to find the docs whose
+// topic mixture is the closest to the one of a new query. the postings of
+// all topics are stored back to back (CSR) and sorted by doc, the weights
+// are normalized to unit length at build time, so that the dot product of
+// two vectors is their cosine.
+//
+// Search() prunes as MaxScore (Turtle and Flood, Query Evaluation:
+// Strategies and Optimizations), with the upper bounds of WAND: the bound
+// of a topic is its query weight times its largest posting weight, and a
+// doc found only in the last topics by bound, whose bounds sum to at most
+// the score of the k-th doc, can not enter the top_k. the first topics
+// are scanned, the last ones only complete the scores of the docs found,
+// by binary search. the docs are numbered by their main topic and its
+// weight, so the k-th score to start from comes from the docs of the main
+// topic of the query at the head of its list. the result is that of a
+// full scoring, the docs of equal score in any order.
+class TopicIndex {
+public:
+    typedef std::pair<int, double> TopicWeight;
+    typedef std::pair<int, float> DocScore;
+
+    TopicIndex() : _num_docs(0) { }
+
+    // doc i gets the topics of docs[i], which are distinct. the topics >=
+    // num_topic are left out
+    void Build(const std::vector<std::vector<TopicWeight> >& docs, int num_topic)
+    {
+        _num_docs = docs.size();
+        _offset.assign(num_topic + 1, 0);
+        for (size_t i = 0; i < docs.size(); ++i)
+            for (size_t j = 0; j < docs[i].size(); ++j)
+                if (Valid(docs[i][j], num_topic))  ++_offset[docs[i][j].first + 1];
+        for (int t = 0; t < num_topic; ++t)
+            _offset[t + 1] += _offset[t];
+
+        // internal numbering by main topic, then by its weight descending.
+        // the docs of no topic go last, under main topic num_topic
+        std::vector<std::pair<std::pair<int, double>, uint32_t> > order(docs.size());
+        for (size_t i = 0; i < docs.size(); ++i)
+        {
+            std::pair<int, double> main_topic(num_topic, 0.0);
+            for (size_t j = 0; j < docs[i].size(); ++j)
+                if (Valid(docs[i][j], num_topic) && -docs[i][j].second < main_topic.second)
+                    main_topic = std::make_pair(docs[i][j].first, -docs[i][j].second);
+            order[i] = std::make_pair(main_topic, i);
+        }
+        std::sort(order.begin(), order.end());
+        _doc_id.resize(docs.size());
+        _main_offset.assign(num_topic + 2, 0);
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            _doc_id[i] = order[i].second;
+            ++_main_offset[order[i].first.first + 1];
+        }
+        for (int t = 0; t <= num_topic; ++t)
+            _main_offset[t + 1] += _main_offset[t];
+
+        // docs in internal order, so every posting list is sorted by doc
+        std::vector<uint32_t> next(_offset.begin(), _offset.end() - 1);
+        _doc.resize(_offset[num_topic]);
+        _weight.resize(_offset[num_topic]);
+        _max_weight.assign(num_topic, 0.0f);
+        for (size_t i = 0; i < _doc_id.size(); ++i)
+        {
+            const std::vector<TopicWeight>& doc = docs[_doc_id[i]];
+            double norm = Norm(doc, num_topic);
+            for (size_t j = 0; j < doc.size(); ++j)
+            {
+                if (!Valid(doc[j], num_topic))  continue;
+                int topic = doc[j].first;
+                float weight = doc[j].second / norm;
+                _doc[next[topic]] = i;
+                _weight[next[topic]++] = weight;
+                _max_weight[topic] = std::max(_max_weight[topic], weight);
+            }
+        }
+    }
+
+    // the top_k docs by cosine to query, in descending score. the docs with
+    // no topic in common with query are never returned. safe to call from
+    // many threads at once, each with its own workspace
+    void Search(const std::vector<TopicWeight>& query, size_t top_k, TopicSearchWorkspace* ws,
+                std::vector<DocScore>* results) const
+    {
+        results->clear();
+        int num_topic = GetTopicNum();
+        double norm = Norm(query, num_topic);
+        if (top_k == 0 || norm <= 0)  return;
+
+        std::vector<TopicSearchWorkspace::QueryTopic>& topics = ws->_topics;
+        topics.clear();
+        for (size_t i = 0; i < query.size(); ++i)
+        {
+            int topic = query[i].first;
+            if (!Valid(query[i], num_topic) || _offset[topic] == _offset[topic + 1])  continue;
+            TopicSearchWorkspace::QueryTopic query_topic;
+            query_topic._topic = topic;
+            query_topic._weight = query[i].second / norm;
+            query_topic._upper_bound = query_topic._weight * _max_weight[topic];
+            topics.push_back(query_topic);
+        }
+        if (topics.empty())  return;
+        std::sort(topics.begin(), topics.end(), UpperBoundGreater());
+        // rest[i], the sum of the bounds of the topics from i on
+        std::vector<double>& rest = ws->_rest;
+        rest.assign(topics.size() + 1, 0.0);
+        for (size_t i = topics.size(); i > 0; --i)
+            rest[i - 1] = rest[i] + topics[i - 1]._upper_bound;
+
+        // the k-th score to start from, of the heads of the docs of the
+        // first topic as main topic, or of its list if there are none
+        std::vector<std::pair<float, uint32_t> >& heap = ws->_heap;
+        heap.clear();
+        int first = topics[0]._topic;
+        std::vector<uint32_t>::const_iterator end = _doc.begin() + _offset[first + 1];
+        std::vector<uint32_t>::const_iterator head = std::lower_bound(_doc.begin() + _offset[first], end,
+                                                                      _main_offset[first]);
+        if (head == end || *head >= _main_offset[first + 1])  head = _doc.begin() + _offset[first];
+        for (; head != end && heap.size() < top_k; ++head)
+            PushTopK(&heap, top_k, std::make_pair(Score(topics, 0, 0.0, *head, 0.0f), *head));
+        float min_score = heap.size() == top_k ? heap.front().first : 0.0f;
+        heap.clear();
+
+        // the topics to scan, at least the first one, which holds the
+        // heads above
+        size_t num_scanned = 1;
+        while (num_scanned < topics.size() && rest[num_scanned] >= kTopicScanRatio * min_score)
+            ++num_scanned;
+        std::vector<float>& score = ws->_score;
+        std::vector<uint32_t>& touched = ws->_touched;
+        score.resize(_num_docs, 0.0f);
+        touched.clear();
+        for (size_t i = 0; i < num_scanned; ++i)
+        {
+            int topic = topics[i]._topic;
+            float weight = topics[i]._weight;
+            for (uint32_t pos = _offset[topic]; pos < _offset[topic + 1]; ++pos)
+            {
+                uint32_t doc = _doc[pos];
+                if (score[doc] == 0)  touched.push_back(doc);
+                score[doc] += weight * _weight[pos];
+            }
+        }
+
+        // the docs that may still reach the k-th score above, with a margin
+        // for the rounding of the partial scores. the top_k of them by
+        // partial score are completed first, their k-th score then rules
+        // out most of the others before any binary search
+        std::vector<std::pair<float, uint32_t> >& candidates = ws->_candidates;
+        candidates.clear();
+        float min_partial = (min_score - rest[num_scanned]) * (1.0f - kTopicScoreSlack);
+        for (size_t i = 0; i < touched.size(); ++i)
+        {
+            uint32_t doc = touched[i];
+            if (score[doc] >= min_partial)  candidates.push_back(std::make_pair(score[doc], doc));
+            score[doc] = 0.0f;
+        }
+        size_t num_first = std::min(top_k, candidates.size());
+        std::nth_element(candidates.begin(), candidates.begin() + num_first, candidates.end(), ScoreGreater());
+        for (size_t i = 0; i < candidates.size(); ++i)
+        {
+            float threshold = heap.size() == top_k ? heap.front().first : 0.0f;
+            if (candidates[i].first + rest[num_scanned] < threshold)  continue;
+            uint32_t doc = candidates[i].second;
+            PushTopK(&heap, top_k, std::make_pair(Score(topics, num_scanned, candidates[i].first, doc, threshold), doc));
+        }
+
+        std::sort(heap.begin(), heap.end(), ScoreGreater());
+        for (size_t i = 0; i < heap.size(); ++i)
+            results->push_back(DocScore(_doc_id[heap[i].second], heap[i].first));
+    }
+
+    inline size_t GetDocNum() const
+    {
+        return _num_docs;
+    }
+
+    inline int GetTopicNum() const
+    {
+        return _max_weight.size();
+    }
+
+    inline size_t GetPostingNum() const
+    {
+        return _doc.size();
+    }
+
+    // bytes of the index
+    inline size_t GetMemorySize() const
+    {
+        return sizeof(uint32_t) * (_offset.size() + _doc.size() + _doc_id.size() + _main_offset.size())
+             + sizeof(float) * (_weight.size() + _max_weight.size());
+    }
+
+private:
+    struct UpperBoundGreater
+    {
+        bool operator()(const TopicSearchWorkspace::QueryTopic& lhs,
+                        const TopicSearchWorkspace::QueryTopic& rhs) const
+        {
+            return lhs._upper_bound > rhs._upper_bound;
+        }
+    };
+
+    // the heap of the top_k keeps the least score on top
+    struct ScoreGreater
+    {
+        bool operator()(const std::pair<float, uint32_t>& lhs, const std::pair<float, uint32_t>& rhs) const
+        {
+            return lhs.first > rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second);
+        }
+    };
+
+    static inline bool Valid(const TopicWeight& topic, int num_topic)
+    {
+        return topic.first >= 0 && topic.first < num_topic && topic.second > 0;
+    }
+
+    static double Norm(const std::vector<TopicWeight>& topics, int num_topic)
+    {
+        double sum = 0.0;
+        for (size_t i = 0; i < topics.size(); ++i)
+            if (Valid(topics[i], num_topic))  sum += topics[i].second * topics[i].second;
+        return sqrt(sum);
+    }
+
+    // partial plus the weights of doc in topics[from...], found by binary
+    // search. gives up, with a score below threshold, once the bounds of
+    // the topics left can not lift it there
+    float Score(const std::vector<TopicSearchWorkspace::QueryTopic>& topics, size_t from, double partial,
+                uint32_t doc, float threshold) const
+    {
+        double bound = partial;
+        for (size_t i = from; i < topics.size(); ++i)
+            bound += topics[i]._upper_bound;
+        for (size_t i = from; i < topics.size() && bound >= threshold; ++i)
+        {
+            int topic = topics[i]._topic;
+            std::vector<uint32_t>::const_iterator begin = _doc.begin() + _offset[topic];
+            std::vector<uint32_t>::const_iterator end = _doc.begin() + _offset[topic + 1];
+            std::vector<uint32_t>::const_iterator iter = std::lower_bound(begin, end, doc);
+            double weight = 0.0;
+            if (iter != end && *iter == doc)
+                weight = topics[i]._weight * _weight[iter - _doc.begin()];
+            partial += weight;
+            bound -= topics[i]._upper_bound - weight;
+        }
+        return bound >= threshold ? partial : -1.0f;
+    }
+
+    static inline void PushTopK(std::vector<std::pair<float, uint32_t> >* heap, size_t top_k,
+                                const std::pair<float, uint32_t>& item)
+    {
+        if (item.first <= 0)  return;
+        if (heap->size() < top_k)
+        {
+            heap->push_back(item);
+            std::push_heap(heap->begin(), heap->end(), ScoreGreater());
+        }
+        else if (item.first > heap->front().first)
+        {
+            std::pop_heap(heap->begin(), heap->end(), ScoreGreater());
+            heap->back() = item;
+            std::push_heap(heap->begin(), heap->end(), ScoreGreater());
+        }
+    }
+
+private:
+    size_t _num_docs;
+    std::vector<uint32_t> _offset;    // topic -> first posting, num_topic + 1 entries
+    std::vector<uint32_t> _doc;       // postings, sorted by doc within a topic
+    std::vector<float> _weight;
+    std::vector<float> _max_weight;   // topic -> largest weight of its postings
+    std::vector<uint32_t> _doc_id;    // internal doc -> index of the doc in Build()
+    std::vector<uint32_t> _main_offset;   // main topic -> first internal doc, num_topic + 2 entries
+};
+
+#endif
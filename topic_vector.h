@@ -0,0 +1,160 @@
+#ifndef TOPIC_VECTOR_H_
+#define TOPIC_VECTOR_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+// the topics of a SparseTopicVector are uint16
+static const int kMaxSparseTopicNum = 65536;
+
+// the top_k topics of a distribution, renormalized to sum 1, as two arrays
+// sorted by topic: two vectors are merged in one pass, with no hash table.
+// the compact form of a topic distribution kept per query or item, e.g. in
+// a feature store, see AppendTopicVector() for its serialization. Assign()
+// keeps the capacity of the arrays, reuse the same vector to avoid the
+// allocations
+struct SparseTopicVector
+{
+    std::vector<uint16_t> _topic;     // ascending
+    std::vector<float> _weight;
+    std::vector<std::pair<float, int> > _entries;     // scratch of Assign(), (weight, topic)
+
+    // the top_k largest of the counts count[keys[i]], top_k 0 for all of
+    // them. the counts <= 0 and the topics >= kMaxSparseTopicNum are left
+    // out, of equal counts the lower topic is kept
+    void Assign(const std::vector<int>& keys, const double* count, size_t top_k)
+    {
+        _entries.clear();
+        for (size_t i = 0; i < keys.size(); ++i)
+            if (count[keys[i]] > 0 && keys[i] < kMaxSparseTopicNum)
+                _entries.push_back(std::make_pair(static_cast<float>(count[keys[i]]), keys[i]));
+        if (top_k > 0 && top_k < _entries.size())
+        {
+            std::nth_element(_entries.begin(), _entries.begin() + top_k, _entries.end(), WeightGreater());
+            _entries.resize(top_k);
+        }
+
+        double sum = 0.0;
+        for (size_t i = 0; i < _entries.size(); ++i)
+            sum += _entries[i].first;
+        std::sort(_entries.begin(), _entries.end(), TopicLess());
+        _topic.resize(_entries.size());
+        _weight.resize(_entries.size());
+        for (size_t i = 0; i < _entries.size(); ++i)
+        {
+            _topic[i] = _entries[i].second;
+            _weight[i] = _entries[i].first / sum;
+        }
+    }
+
+    inline size_t Size() const
+    {
+        return _topic.size();
+    }
+
+    void Clear()
+    {
+        _topic.clear();
+        _weight.clear();
+    }
+
+private:
+    struct WeightGreater
+    {
+        bool operator()(const std::pair<float, int>& lhs, const std::pair<float, int>& rhs) const
+        {
+            return lhs.first > rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second);
+        }
+    };
+
+    struct TopicLess
+    {
+        bool operator()(const std::pair<float, int>& lhs, const std::pair<float, int>& rhs) const
+        {
+            return lhs.second < rhs.second;
+        }
+    };
+};
+
+// LEB128, 7 bits per byte, low bits first
+inline void AppendVarint(uint32_t value, std::string* out)
+{
+    while (value >= 0x80)
+    {
+        out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out->push_back(static_cast<char>(value));
+}
+
+// the binary form of a SparseTopicVector, the same on every host:
+//   varint size, size * varint topic delta, size * float32 weight
+// the varints are LEB128, the first delta is the first topic itself, the
+// floats are IEEE little endian. 10 topics of a model of a few thousand
+// topics take about 60 bytes, 84 as the int32, float pairs of model2
+inline void AppendTopicVector(const SparseTopicVector& topics, std::string* out)
+{
+    AppendVarint(topics.Size(), out);
+    uint32_t last = 0;
+    for (size_t i = 0; i < topics.Size(); ++i)
+    {
+        AppendVarint(topics._topic[i] - last, out);
+        last = topics._topic[i];
+    }
+    for (size_t i = 0; i < topics.Size(); ++i)
+    {
+        uint32_t bits;
+        memcpy(&bits, &topics._weight[i], sizeof(bits));
+        for (int b = 0; b < 4; ++b)
+            out->push_back(static_cast<char>(bits >> (8 * b)));
+    }
+}
+
+// LEB128 of at most 32 bits at data[*pos...len), false if it runs past len
+// or is longer
+inline bool ParseVarint(const char* data, size_t len, size_t* pos, uint32_t* value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 32 && *pos < len; shift += 7)
+    {
+        unsigned char byte = data[(*pos)++];
+        *value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)  return true;
+    }
+    return false;
+}
+
+// reads one vector of AppendTopicVector() at the head of data, returns the
+// bytes read, 0 if data does not hold a whole valid vector
+inline size_t ParseTopicVector(const char* data, size_t len, SparseTopicVector* topics)
+{
+    size_t pos = 0;
+    uint32_t size;
+    if (!ParseVarint(data, len, &pos, &size) || size > static_cast<uint32_t>(kMaxSparseTopicNum))  return 0;
+    topics->_topic.resize(size);
+    topics->_weight.resize(size);
+    uint32_t topic = 0;
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        uint32_t delta;
+        if (!ParseVarint(data, len, &pos, &delta) || (i > 0 && delta == 0))  return 0;
+        topic += delta;
+        if (topic >= static_cast<uint32_t>(kMaxSparseTopicNum))  return 0;
+        topics->_topic[i] = topic;
+    }
+    if (len - pos < 4 * static_cast<size_t>(size))  return 0;
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        uint32_t bits = 0;
+        for (int b = 0; b < 4; ++b)
+            bits |= static_cast<uint32_t>(static_cast<unsigned char>(data[pos++])) << (8 * b);
+        memcpy(&topics->_weight[i], &bits, sizeof(bits));
+    }
+    return pos;
+}
+
+#endif
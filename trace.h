@@ -0,0 +1,48 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <iostream>
+
+// compile time trace level of the predictors and the query extension. the
+// tracing statements are written as
+//     if (Trace::kEnabled)  Trace::Sink()<<...;
+// with NoTrace the condition is a constant false and the statement is
+// compiled out, the sampling loops do no I/O at all. with DebugTrace every
+// step of every token is traced to Sink(), stderr unless SetSink() gives
+// another stream, so the traces stay apart from the regular output.
+template<bool Enabled>
+struct TraceLevel
+{
+    static const bool kEnabled = Enabled;
+
+    static std::ostream& Sink()
+    {
+        return *Stream();
+    }
+
+    // not synchronized, set it before the traced threads start
+    static void SetSink(std::ostream* sink)
+    {
+        Stream() = sink;
+    }
+
+private:
+    static std::ostream*& Stream()
+    {
+        static std::ostream* stream = &std::cerr;
+        return stream;
+    }
+};
+
+typedef TraceLevel<false> NoTrace;
+typedef TraceLevel<true> DebugTrace;
+
+// the level of the classes that are not given one, -DLDA_TRACE for the
+// debug builds
+#ifdef LDA_TRACE
+typedef DebugTrace DefaultTrace;
+#else
+typedef NoTrace DefaultTrace;
+#endif
+
+#endif